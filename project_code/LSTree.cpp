@@ -3,15 +3,18 @@
 #include "LSTree.hpp"
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <fstream>
 #include <sstream>
 #include <vector>
-//for default_random_engine
-#include <random>
 //for shuffle
 #include <algorithm>
 #include <filesystem>
+#include <cmath>
+#include <stdexcept>
+#include <climits>
+#include <future>
 
 
 
@@ -19,26 +22,59 @@ using namespace std;
 
 namespace fs = filesystem;
 
-//root.meta is used for page directory organization
-const string LS_ROOT_META_FILE = "ls_tree_pages/root.meta";
+//catalog and memory level snapshots, kept in the tree's directory next to the levels
+const string LS_CATALOG_FILE = "catalog.meta";
+constexpr int LS_CATALOG_VERSION = 1;
+const string LS_MEMORY_SNAPSHOT_FILES[2] = {"memory_level_0.bin", "memory_level_1.bin"};
+
+//name of a disk level's directory (inside the tree's directory) in a generation, the first build keeps the plain names
+static string generationName(size_t index, int generation) {
+
+    string name = "btree" + to_string(index);
+
+    return (generation == 0) ? name : name + "_gen" + to_string(generation);
+}
+
+//directory of a disk level in a generation
+static string generationDirectory(const string& base, size_t index, int generation) {
+
+    return base + "/" + generationName(index, generation);
+}
 
 
 //constructor
-ls_tree::ls_tree(const string& dir) : memoryTree("/tmp/inMemoryTree"), handler(dir) {
-    // uses memory from /tmp
+ls_tree::ls_tree(const string& dir) : handler(dir), baseDirectory(dir) {
     fs::create_directory(dir);
+    builder.base = dir;
 }
 
+//a rebuild that was never swapped in is of no use to anyone, the saved catalog points at the old levels
+ls_tree::~ls_tree() {
+
+    if (!rebuild.valid())
+        return;
 
+    try {
+        ls_levels unused = rebuild.get();
 
-void ls_tree::addToTree(const string& treeName, int key, const Record& rec) {
+        for (auto& level : unused.disk)
+            fs::remove_all(generationDirectory(baseDirectory, level.first, unused.generation));
+    }
+    catch (const exception& e) {
+        cerr << "LS-tree rebuild failed: " << e.what() << endl;
+    }
+}
+
+
+
+void ls_tree::addToTree(size_t level, int key, const Record& rec) {
     // Check if the tree exists
 
-    auto it = levels.find(treeName);
+    auto it = levels.find(level);
     if (it == levels.end()) {
-        b_plus_tree btree(treeName);
+        b_plus_tree btree(levelDirectory(level));
         btree.insert(key, rec);
-        levels.insert({treeName, btree});
+        levels.insert({(int) level, btree});
     } else {
         it->second.insert(key, rec);
 }
@@ -49,35 +85,15 @@ void ls_tree::addToTree(const string& treeName, int key, const Record& rec) {
 //helper function to read records from a tree
 vector<Record> ls_tree::getRecords(b_plus_tree& tree) {
     vector<Record> result;
-    char buffer[PAGE_SIZE];
-
-    page_handler& handler = tree.getHandler();
-    int current = tree.getRootPage();
-
-    
-    while (true) {
-        handler.readPage(current, buffer);
-
-        int is_leaf;
-        memcpy(&is_leaf, buffer, sizeof(int));
-        if (is_leaf)
-            break;
-
-        internal_node* inode = reinterpret_cast<internal_node*>(buffer);
-        current = inode->children[0];
-    }
 
     //returns leaves
-    while (current != INVALID_PAGE) {
-        handler.readPage(current, buffer);
-        leaf_node* leaf = reinterpret_cast<leaf_node*>(buffer);
+    leaf_cursor cursor(tree);
+    const Record* first;
+    const Record* last;
 
-        for (int i = 0; i < leaf->record_num; ++i) {
-            result.push_back(leaf->records[i]);
-        }
+    while (cursor.nextSlice(first, last))
+        result.insert(result.end(), first, last);
 
-        current = leaf->next_leaf_page;
-    }
     return result;
 }
 
@@ -89,179 +105,1205 @@ void ls_tree::insertMemoryTree(const string& dir) {
     //check if levels is empty before getting last tree
     if (!levels.empty()) {
         b_plus_tree& lastTree = levels.rbegin()->second; 
-        vector<Record> records = getRecords(lastTree); 
-        memoryTree = b_plus_tree("/tmp/inMemoryTree"); 
+
+        //the leaves come out in hilbert order, so they go straight onto the end of the blocks, one leaf in
+        //memory at a time besides the level itself
+        memoryTree.build({});
+
+        leaf_cursor cursor(lastTree);
+        Record r;
+
+        while (cursor.next(r))
+            memoryTree.appendSorted(r);
+
         isMemoryTree = true;
-        //cout << "checking memoryTree " << endl;
 
-        for (size_t i = 0; i < records.size(); i++)
-        {
-            memoryTree.insert(records[i].hilbert, records[i]);
-        }
-        
 
         //now remove from disk
         auto lastDiskTree = levels.rbegin();
-        string lastDiskTreeName = lastDiskTree->first;
+        int lastDiskLevel = lastDiskTree->first;
 
 
-        fs::remove_all(lastDiskTreeName);
+        fs::remove_all(levelDirectory(lastDiskLevel));
 
         //remove in levels
-        levels.erase(lastDiskTreeName); 
+        levels.erase(lastDiskLevel); 
         
     }
 }
 
-//range query used for experiments 
-vector<Record> ls_tree::querying(int low, int high, long unsigned int k) { //int k
+//directory of a disk level
+string ls_tree::levelDirectory(size_t index) const {
 
-    vector<Record> results;
-    //
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    if (isMemoryTree) {
-        //cout << "inMemorytree" << endl;
-        //cout << memoryTree.getRootPage() << " yikes" << endl; 
-        //if(low < maxMin.back().max_hilbert || high > maxMin.back().min_hilbert)
-        if (low <= maxMin.back().max_hilbert && high >= maxMin.back().min_hilbert)
-        {
-            //query the memory tree first
-            //cout << "in if statement" << endl; 
-            vector<Record> memoryResults = memoryTree.rangeQueryR(low, high);
-            //cout << "ending rangeQuery and onto shuffle" << endl; 
-            //vector<Record> rs = memoryTree.rangeQuery(32876, 100000);
-            //vector<Record> rs = memoryTree.rangeQuery(0, 100000);
-            
-            shuffle (memoryResults.begin(), memoryResults.end(), default_random_engine(seed));
-            //cout << "size of memoryTree: " << memoryResults.size() << endl; 
-
-            //check if memoryTree works
-            //cout << "Results from inMemoryTree:\n";
-            for (size_t i = 0; i < memoryResults.size(); i++)
-            {
-                /*cout << "ID: " << memoryResults[i].id
-                << ", Lat: " << memoryResults[i].lat
-                << ", Lon: " << memoryResults[i].lon
-                << ", Time: " << memoryResults[i].timestamp
-                << ", Hilbert: " << memoryResults[i].hilbert << endl; */
-
-                results.push_back(memoryResults[i]); 
-                if(results.size() == k) {
-                    //up to k in results
-                    return results; 
+    return generationDirectory(baseDirectory, index, generation);
+}
+
+//draws the record's top level and hands it to the builder
+void ls_tree::buildAppend(const Record& rec) {
+
+    if (builder.building.empty())
+        builder.result.generation = generation;
+
+    Record r = rec;
+    r.top_level = threadRng().geometric(MAX_LS_LEVELS - 1);
+
+    builder.append(r);
+}
+
+//closes the disk levels, the first level that stayed small becomes the memory level
+void ls_tree::finishBuild() {
+
+    installLevels(builder.finish());
+}
+
+//hands a record to levels 0 to its top level
+void ls_tree::level_builder::append(const Record& r) {
+
+    //the bulk loaders need hilbert order, the csv has to be sorted first
+    if (!building.empty() && r.hilbert < building[0].range.max_hilbert)
+        throw runtime_error("records are not sorted by hilbert value");
+
+    if (building.size() <= r.top_level)
+        building.resize(r.top_level + 1);
+
+    for (size_t i = 0; i <= r.top_level; i++) {
+
+        build_level& level = building[i];
+
+        level.range.min_hilbert = min(level.range.min_hilbert, (long int) r.hilbert);
+        level.range.max_hilbert = max(level.range.max_hilbert, (long int) r.hilbert);
+        level.records++;
+
+        if (level.on_disk) {
+            result.disk.find(i)->second.appendSorted(r);
+            continue;
+        }
+
+        level.buffered.push_back(r);
+
+        //too big for the memory level, from now on the level streams into its bulk loader
+        if (level.buffered.size() > LS_MEMORY_LEVEL_RECORDS) {
+
+            string directory = generationDirectory(base, i, result.generation);
+            b_plus_tree& tree = result.disk.emplace((int) i, b_plus_tree(directory)).first->second;
+
+            for (const Record& buffered : level.buffered)
+                tree.appendSorted(buffered);
+
+            level.buffered.clear();
+            level.buffered.shrink_to_fit();
+            level.on_disk = true;
+        }
+    }
+}
+
+//closes the disk levels and stops at the first level that stayed small, which becomes the memory level
+ls_levels ls_tree::level_builder::finish() {
+
+    for (size_t i = 0; i < building.size(); i++) {
+
+        build_level& level = building[i];
+
+        result.ranges.push_back(level.range);
+        result.records.push_back(level.records);
+
+        if (level.on_disk) {
+            result.disk.find(i)->second.finishBulkLoad();
+            continue;
+        }
+
+        //levels are subsets of the ones below, so every level after this one is smaller still
+        result.memory.build(move(level.buffered));
+        result.has_memory = true;
+        break;
+    }
+
+    building.clear();
+
+    ls_levels built = move(result);
+    result = ls_levels();
+
+    return built;
+}
+
+//the new levels replace the old ones in one go, between two calls on the tree
+void ls_tree::installLevels(ls_levels built) {
+
+    levels = move(built.disk);
+    maxMin = move(built.ranges);
+    levelRecords = move(built.records);
+    memoryTree = move(built.memory);
+    isMemoryTree = built.has_memory;
+    generation = built.generation;
+
+    builtRecords = recordCount();
+
+    //inserts made while a rebuild ran are still in the buffer, and now belong to the new levels
+    insertBuffer.rangeScanR(INT_MIN, INT_MAX, [&](const Record* first, const Record* last) {
+        for (const Record* r = first; r < last; r++)
+            countInsert(*r);
+        return true;
+    });
+}
+
+//keeps the hilbert ranges covering the levels' records, and their counts
+void ls_tree::countInsert(const Record& r) {
+
+    //an empty tree starts out with an empty memory level
+    if (size() == 0)
+        isMemoryTree = true;
+
+    if (maxMin.size() < size()) {
+        maxMin.resize(size(), {INT64_MAX, INT64_MIN});
+        levelRecords.resize(size(), 0);
+    }
+
+    for (size_t i = 0; i < size() && i <= r.top_level; i++) {
+
+        maxMin[i].min_hilbert = min(maxMin[i].min_hilbert, (long int) r.hilbert);
+        maxMin[i].max_hilbert = max(maxMin[i].max_hilbert, (long int) r.hilbert);
+        levelRecords[i]++;
+    }
+}
+
+//the buffer in hilbert order, so that inserts into the same leaves come one after the other
+void ls_tree::flushInserts() {
+
+    collectRebuild(false);
+
+    //a rebuild is reading level 0, the buffer keeps growing until it is swapped in
+    if (rebuilding() || insertBuffer.empty())
+        return;
+
+    insertBuffer.rangeScanR(INT_MIN, INT_MAX, [&](const Record* first, const Record* last) {
+
+        for (const Record* r = first; r < last; r++) {
+
+            for (size_t i = 0; i < levels.size() && i <= r->top_level; i++)
+                getTree(i).insert(r->hilbert, *r);
+
+            if (isMemoryTree && r->top_level >= levels.size())
+                memoryTree.insert(*r);
+        }
+
+        return true;
+    });
+
+    insertBuffer.build({});
+}
+
+//the memory level is past its size, or the data set doubled or halved, so the levels no longer have the sizes
+//the query's level choice assumes. A tree that fits in the memory level is left alone
+bool ls_tree::needsRebuild() const {
+
+    if (rebuilding() || size() == 0)
+        return false;
+
+    size_t m = levels.size();
+    if (isMemoryTree && m < levelRecords.size() && levelRecords[m] > LS_REBUILD_GROWTH * LS_MEMORY_LEVEL_RECORDS)
+        return true;
+
+    long int records = recordCount();
+    if ((size_t) max(records, builtRecords) <= LS_MEMORY_LEVEL_RECORDS)
+        return false;
+
+    return records > LS_REBUILD_GROWTH * builtRecords || records * LS_REBUILD_GROWTH < builtRecords;
+}
+
+//level 0 has every record once the buffer is flushed, and every record keeps the top level it was drawn with,
+//so the rebuild only has to read level 0 in order and bulk load the next generation from it. Nothing writes to
+//the levels while it runs: flushes wait, and deletes outside of the buffer are held back until the swap
+bool ls_tree::startRebuild() {
+
+    collectRebuild(false);
+
+    if (rebuilding() || size() == 0)
+        return false;
+
+    flushInserts();
+
+    string base = baseDirectory;
+    int next = generation + 1;
+
+    //level 0 is the memory level, copied so that inserts into it can carry on
+    if (levels.empty()) {
+
+        vector<Record> records = memoryTree.rangeQueryR(INT_MIN, INT_MAX);
+
+        rebuild = async(launch::async, [records = move(records), base, next]() {
+
+            level_builder rebuilt;
+            rebuilt.base = base;
+            rebuilt.result.generation = next;
+
+            for (const Record& r : records)
+                rebuilt.append(r);
+
+            return rebuilt.finish();
+        });
+
+        return true;
+    }
+
+    //the rebuild reads level 0 through its own copy of the tree, pages are only read. A leaf cursor feeds the
+    //builder, which streams every level into its bulk loader, so only a leaf and the small levels are in memory
+    b_plus_tree source = getTree(0);
+
+    rebuild = async(launch::async, [source, base, next]() mutable {
+
+        level_builder rebuilt;
+        rebuilt.base = base;
+        rebuilt.result.generation = next;
+
+        leaf_cursor cursor(source);
+        Record r;
+
+        while (cursor.next(r))
+            rebuilt.append(r);
+
+        return rebuilt.finish();
+    });
+
+    return true;
+}
+
+//swaps in the rebuilt levels and removes the old directories. A failed rebuild keeps the old levels
+void ls_tree::collectRebuild(bool wait) {
+
+    if (!rebuild.valid())
+        return;
+
+    if (!wait && rebuild.wait_for(chrono::seconds(0)) != future_status::ready)
+        return;
+
+    ls_levels built;
+
+    try {
+        built = rebuild.get();
+    }
+    catch (const exception& e) {
+        cerr << "LS-tree rebuild failed, keeping the old levels: " << e.what() << endl;
+        return;
+    }
+
+    vector<string> old;
+    for (auto& level : levels)
+        old.push_back(levelDirectory(level.first));
+
+    installLevels(move(built));
+
+    //the rebuild read level 0 before the removes that were held back, so they are done on the new levels
+    set<pair<int, string>> removes = move(pendingRemoves);
+    pendingRemoves.clear();
+
+    for (const pair<int, string>& removed : removes)
+        removeFromLevels(removed.first, removed.second.c_str());
+
+    //a saved catalog points at the old directories, so it is written again before they go. If that fails they
+    //are kept, and the saved catalog still opens the tree as it was saved
+    if (catalogExists(baseDirectory) && !saveCatalog()) {
+        cerr << "Could not save the LS-tree catalog after a rebuild, keeping the old levels for it" << endl;
+        return;
+    }
+
+    for (const string& directory : old)
+        fs::remove_all(directory);
+}
+
+void ls_tree::finishMaintenance() {
+
+    collectRebuild(true);
+    flushInserts();
+}
+
+//writes the memory level snapshot, then the catalog through a temporary file, so a crash leaves either the
+//old catalog or the new one. The snapshot goes under the name the current catalog does not use, and the old one is
+//only removed once the new catalog is in place. A line per level: number, directory (inside the tree's directory),
+//records, hilbert bounds and sampling rate
+bool ls_tree::saveCatalog() {
+
+    //the buffered inserts and a running rebuild go into the levels first, the catalog only knows about levels
+    finishMaintenance();
+
+    string snapshot_file = (savedSnapshot == LS_MEMORY_SNAPSHOT_FILES[0]) ? LS_MEMORY_SNAPSHOT_FILES[1] : LS_MEMORY_SNAPSHOT_FILES[0];
+
+    if (isMemoryTree && !memoryTree.snapshot(baseDirectory + "/" + snapshot_file)) {
+        return false;
+    }
+
+    string path = baseDirectory + "/" + LS_CATALOG_FILE;
+    string temp = path + ".tmp";
+
+    {
+        ofstream out(temp, ios::trunc);
+        if (!out) {
+            return false;
+        }
+
+        out << "ls_tree_catalog " << LS_CATALOG_VERSION << "\n";
+        out << "disk_levels " << levels.size() << "\n";
+        out << "generation " << generation << "\n";
+
+        for (size_t i = 0; i < levels.size(); i++) {
+
+            long int records = (i < levelRecords.size()) ? levelRecords[i] : -1;
+            const max_min_hilbert& range = maxMin[i];
+
+            out << "level " << i << " " << generationName(i, generation) << " " << records << " " << range.min_hilbert << " "
+                << range.max_hilbert << " " << ldexp(1.0, -(int) i) << "\n";
+        }
+
+        if (isMemoryTree) {
+
+            size_t m = levels.size();
+            const max_min_hilbert& range = maxMin[m];
+
+            out << "memory " << m << " " << snapshot_file << " " << memoryTree.size() << " " << range.min_hilbert
+                << " " << range.max_hilbert << " " << ldexp(1.0, -(int) m) << "\n";
+        }
+        else {
+            out << "memory none" << "\n";
+        }
+
+        if (!out) {
+            return false;
+        }
+    }
+
+    error_code error;
+    fs::rename(temp, path, error);
+
+    if (error) {
+        return false;
+    }
+
+    //nothing points at the old snapshot anymore
+    if (!savedSnapshot.empty() && (!isMemoryTree || savedSnapshot != snapshot_file))
+        fs::remove(baseDirectory + "/" + savedSnapshot, error);
+
+    savedSnapshot = isMemoryTree ? snapshot_file : "";
+
+    return true;
+}
+
+//reads the catalog back: the disk levels open through their own root.meta, the memory level from its snapshot
+bool ls_tree::openCatalog() {
+
+    ifstream in(baseDirectory + "/" + LS_CATALOG_FILE);
+    if (!in) {
+        return false;
+    }
+
+    string word;
+    int version = 0;
+    size_t disk_levels = 0;
+    int saved_generation = 0;
+
+    if (!(in >> word >> version) || word != "ls_tree_catalog" || version != LS_CATALOG_VERSION) {
+        return false;
+    }
+
+    if (!(in >> word >> disk_levels) || word != "disk_levels") {
+        return false;
+    }
+
+    if (!(in >> word >> saved_generation) || word != "generation") {
+        return false;
+    }
+
+    map<int, b_plus_tree> opened;
+    vector<max_min_hilbert> ranges;
+    vector<long int> records;
+
+    for (size_t i = 0; i < disk_levels; i++) {
+
+        size_t number;
+        string directory;
+        long int count;
+        max_min_hilbert range;
+        double rate;
+
+        if (!(in >> word >> number >> directory >> count >> range.min_hilbert >> range.max_hilbert >> rate) ||
+            word != "level" || number != i) {
+            return false;
+        }
+
+        //the level directories are kept relative to the tree's directory, so the tree can be moved
+        directory = baseDirectory + "/" + directory;
+
+        if (!fs::exists(directory)) {
+            return false;
+        }
+
+        opened.emplace((int) i, b_plus_tree(directory));
+        ranges.push_back(range);
+        records.push_back(count);
+    }
+
+    memory_level memory;
+    bool has_memory = false;
+    string snapshot;
+
+    if (!(in >> word) || word != "memory" || !(in >> word)) {
+        return false;
+    }
+
+    if (word != "none") {
+
+        long int count;
+        max_min_hilbert range;
+        double rate;
+
+        if (!(in >> snapshot >> count >> range.min_hilbert >> range.max_hilbert >> rate) ||
+            !memory.restore(baseDirectory + "/" + snapshot)) {
+            return false;
+        }
+
+        ranges.push_back(range);
+        records.push_back(count);
+        has_memory = true;
+    }
+
+    levels = move(opened);
+    maxMin = move(ranges);
+    levelRecords = move(records);
+    memoryTree = move(memory);
+    isMemoryTree = has_memory;
+    generation = saved_generation;
+    savedSnapshot = snapshot;
+
+    insertBuffer.build({});
+    builtRecords = recordCount();
+
+    return true;
+}
+
+bool ls_tree::catalogExists(const string& dir) {
+
+    return fs::exists(dir + "/" + LS_CATALOG_FILE);
+}
+
+//level 0 has every record
+long int ls_tree::recordCount() const {
+
+    return levelRecords.empty() ? 0 : levelRecords[0];
+}
+
+//number of levels, the disk trees plus the memory tree
+size_t ls_tree::size() const {
+
+    return levels.size() + (isMemoryTree ? 1 : 0);
+}
+
+//tree of a disk level
+b_plus_tree& ls_tree::getTree(size_t index) {
+
+    return levels.at(index);
+}
+
+//scans a level, the memory level is the last one
+void ls_tree::scanLevel(size_t index, int low, int high, const function<bool(const Record*, const Record*)>& visit) {
+
+    scanLevel(index, scan_filter::hilbertRange(low, high), visit);
+}
+
+//disk levels go down the subtrees whose zone maps overlap the filter, the memory level and the buffer are
+//searched by hilbert range and filtered record by record
+void ls_tree::scanLevel(size_t index, const scan_filter& filter, const function<bool(const Record*, const Record*)>& visit) {
+
+    bool more = true;
+
+    //removes held back by a rebuild are cut out of the slices, in the same runs as the buffer below
+    auto live = [&](const Record* r) { return pendingRemoves.count({r->hilbert, r->id}) == 0; };
+
+    auto visitLive = [&](const Record* first, const Record* last) {
+
+        if (pendingRemoves.empty())
+            return more = visit(first, last);
+
+        while (first < last) {
+
+            const Record* run = first;
+            while (run < last && live(run))
+                run++;
+
+            if (run > first && !(more = visit(first, run)))
+                return false;
+
+            first = run;
+            while (first < last && !live(first))
+                first++;
+        }
+
+        return true;
+    };
+
+    if (isMemoryTree && index == levels.size())
+        memoryTree.filteredScan(filter, visitLive);
+    else
+        getTree(index).filteredScan(filter, visitLive);
+
+    if (!more || insertBuffer.empty())
+        return;
+
+    //buffered records drawn up to this level or higher, handed out in runs
+    auto belongs = [&](const Record* r) { return r->top_level >= index && filter.matches(*r); };
+
+    insertBuffer.rangeScanR(filter.low, filter.high, [&](const Record* first, const Record* last) {
+
+        while (first < last) {
+
+            const Record* run = first;
+            while (run < last && belongs(run))
+                run++;
+
+            if (run > first && !visit(first, run))
+                return false;
+
+            first = run;
+            while (first < last && !belongs(first))
+                first++;
+        }
+
+        return true;
+    });
+}
+
+//k of the level's in-range records, picked while scanning with a reservoir that skips over the records it does
+//not need, so only O(k) records are ever copied. A stopped scan ends at the next slice
+vector<Record> ls_tree::sampleLevel(int level, const scan_filter& filter, size_t k, xoshiro256& rand_gen, const function<bool()>& stop) {
+
+    reservoir_sampler<Record> reservoir(k, rand_gen);
+
+    //levels without a recorded hilbert range are always read
+    bool overlaps = level >= (int) maxMin.size() ||
+                    (filter.low <= maxMin[level].max_hilbert && filter.high >= maxMin[level].min_hilbert);
+
+    if (overlaps) {
+        scanLevel(level, filter, [&](const Record* first, const Record* last) {
+
+            for (const Record* it = first; it < last; ) {
+
+                //passes over as much of the slice as the reservoir allows
+                size_t skipped = min(reservoir.skip(), (size_t) (last - it));
+                reservoir.pass(skipped);
+                it += skipped;
+
+                if (it < last)
+                    reservoir.offer(*it++);
+            }
+
+            return !stop || !stop();
+        });
+    }
+
+    return reservoir.take();
+}
+
+//every level from top down to bottom is scanned as its own task. Any level with k records in range gives k uniform
+//samples of the range, so the first one to finish with k is the answer and the scans still going are cancelled.
+//Otherwise the bottom level, which has the most records in range of all of them, is the one that is returned.
+//Every scan checks the budget as it goes, and running out of it cancels all of them
+vector<Record> ls_tree::sampleLevelsParallel(int top, int bottom, const scan_filter& filter, size_t k, work_stealing_pool& pool,
+                                             query_budget* budget, int& reached, bool& cut_short) {
+
+    vector<vector<Record>> found(top - bottom + 1);
+
+    atomic<bool> cancel{false};
+    atomic<int> winner{-1};
+    atomic<long int> worker_pages{0};
+
+    //the budget's page counter only sees the calling thread, so the scans add up their pages here as they go
+    atomic<bool> out_of_budget{false};
+    atomic<long int> scan_pages{0};
+    long int pages_before = budget ? budget->pagesRead() : 0;
+
+    thread::id caller = this_thread::get_id();
+
+    work_stealing_pool::task_group group;
+
+    //smallest level first, it is the one expected to finish first
+    for (int level = top; level >= bottom; level--) {
+
+        pool.submit(group, [&, level]() {
+
+            if (cancel.load(memory_order_relaxed))
+                return;
+
+            long int task_pages = page_handler::threadPageReads();
+            long int last_pages = task_pages;
+
+            auto stop = [&]() {
+
+                long int now = page_handler::threadPageReads();
+                scan_pages += now - last_pages;
+                last_pages = now;
+
+                if (budget && budget->overBudget(pages_before + scan_pages)) {
+                    out_of_budget = true;
+                    cancel = true;
                 }
-                
+
+                return cancel.load(memory_order_relaxed);
+            };
+
+            vector<Record> sample = sampleLevel(level, filter, k, threadRng(), stop);
+
+            //pages read by the caller while it waits are already counted by its own page counter
+            if (this_thread::get_id() != caller)
+                worker_pages += page_handler::threadPageReads() - task_pages;
+
+            //a cancelled scan has only seen part of the level
+            if (cancel.load(memory_order_relaxed))
+                return;
+
+            if (sample.size() >= k) {
+
+                int none = -1;
+                if (winner.compare_exchange_strong(none, level))
+                    cancel = true;
             }
+
+            found[top - level] = move(sample);
+        });
+    }
+
+    pool.wait(group);
+
+    if (budget)
+        budget->addPages(worker_pages);
+
+    reached = (winner >= 0) ? winner.load() : bottom;
+    cut_short = out_of_budget && winner < 0;
+
+    return move(found[top - reached]);
+}
+
+//range query used for experiments, following the LS-tree query of Wang et al.: a level holding about
+//|q ∩ P| / 2^i records in range, the smallest level that is expected to hold at least k is the only one
+//that has to be read. All of a level's in-range records are a uniform sample of the range, so any k of
+//them picked uniformly are k uniform samples without replacement
+vector<Record> ls_tree::querying(int low, int high, long unsigned int k, query_budget* budget, work_stealing_pool* pool) { //int k
+
+    return querying(scan_filter::hilbertRange(low, high), k, budget, pool);
+}
+
+//the same level choice works for any filter, as every level's matching records are a uniform sample of all of them
+vector<Record> ls_tree::querying(const scan_filter& filter, size_t k, query_budget* budget, work_stealing_pool* pool) {
+
+    //picks up a rebuild that finished in the meantime
+    collectRebuild(false);
+
+    vector<Record> results;
+
+    if (k == 0 || size() == 0) {
+        if (budget) budget->setReason(STOP_EXHAUSTED);
+        return results;
+    }
+
+    //starts at the smallest level, which is cheap to read and gives the first estimate
+    int level = size() - 1;
+
+    while (true) {
+
+        //out of time or page reads, returns what was found so far
+        if (budget && budget->check(results.size()) != STOP_NONE) {
+            return results;
+        }
+
+        //the level read last, the bottom of the window when levels are read in parallel
+        int reached = level;
+        vector<Record> found;
+
+        //set if the budget ran out partway through the level
+        bool cut_short = false;
+
+        //after the first estimate, a pool reads the jump level along with the ones below it, in case it comes up short
+        if (pool && level < (int) size() - 1) {
+
+            int bottom = max(level - (int) LS_PARALLEL_LEVELS + 1, 0);
+            found = sampleLevelsParallel(level, bottom, filter, k, *pool, budget, reached, cut_short);
         }
+
+        //the budget is also checked along the scan, since reading one cold level can take long on its own
+        else {
+            found = sampleLevel(level, filter, k, threadRng(), [&]() {
+                cut_short = budget && budget->check(results.size()) != STOP_NONE;
+                return cut_short;
+            });
+        }
+
+        //part of a level is not a uniform sample of the range, so what the last full level found is returned
+        if (cut_short) {
+            budget->check(results.size());
+            return results;
+        }
+
+        //enough records, or the full data set, which has all there is
+        if (found.size() >= k || reached == 0) {
+
+            if (budget) budget->setReason(found.size() == k ? STOP_SAMPLES : STOP_EXHAUSTED);
+
+            return found;
+        }
+
+        //shortfall, the level's records are kept in case the budget runs out before the next level
+        results = found;
+
+        //|q ∩ P| is about the level's count times 2^level, so the level to jump to is the highest one with
+        //estimate / 2^next >= k. Nothing found says little, so that only moves down one level
+        int next = reached - 1;
+
+        if (!found.empty()) {
+
+            double estimate = ldexp((double) found.size(), reached);
+            int jump = (int) floor(log2(estimate / k));
+
+            next = max(min(jump, reached - 1), 0);
+        }
+
+        level = next;
+    }
+}
+
+
+void ls_tree::insertMoreRecords(const Record& rec) {
+   //used to insert records after tree is built
+
+   collectRebuild(false);
+
+   //the record's top level is drawn once, the buffer hands it to levels 0 to top_level when it is flushed
+   Record r = rec;
+   r.top_level = threadRng().geometric(MAX_LS_LEVELS - 1);
+
+   insertBuffer.insert(r);
+   countInsert(r);
+
+   if (insertBuffer.size() >= LS_INSERT_BUFFER_RECORDS)
+       flushInserts();
+
+   if (needsRebuild())
+       startRebuild();
+}
+
+
+bool ls_tree::removeHilbert(const Record& rec) {
+    //to remove from ls-tree based on hilbert value and id
+
+    collectRebuild(false);
+
+    Record stored;
+
+    //not flushed yet, only the buffer and the counts have it
+    if (insertBuffer.remove(rec.hilbert, rec.id, &stored)) {
+
+        for (size_t i = 0; i < levelRecords.size() && i <= stored.top_level; i++)
+            levelRecords[i]--;
+
+        return true;
     }
 
-    //now check disk based trees
-    //i is for going from smallest tree to biggest tree (reverse)
-    //cout << "done checking MemTree and going to disk trees" << endl;
-    size_t i = maxMin.size() - 1; 
-    //looping through a map
-    //https://stackoverflow.com/questions/26281979/how-do-you-loop-through-a-stdmap
-    for (auto it = levels.rbegin(); it!=levels.rend(); it++, --i) {
-
-        max_min_hilbert& treeRange = maxMin[i];
-        if(low > treeRange.max_hilbert || high < treeRange.min_hilbert) { continue;}
-    
-        //if (it->first == memoryTree)
-        vector<Record> diskResults = it->second.rangeQueryR(low, high);
-        std::shuffle(diskResults.begin(), diskResults.end(), default_random_engine(seed));
-        for (size_t i = 0; i < diskResults.size(); i++)
-        {
-            /*cout << " disk ID: " << diskResults[i].id
-            << ", Lat: " << diskResults[i].lat
-            << ", Lon: " << diskResults[i].lon
-            << ", Time: " << diskResults[i].timestamp
-            << ", Hilbert: " << diskResults[i].hilbert << endl; */
-
-            results.push_back(diskResults[i]); 
-            if(results.size() == k) {
-                //up to k in results
-                return results; 
+    //a rebuild is reading level 0, so the levels are left alone until it is swapped in. The record is looked up,
+    //counted out and hidden from the scans right away, and removed from the new levels by collectRebuild
+    if (rebuilding()) {
+
+        bool found = false;
+
+        scanLevel(0, rec.hilbert, rec.hilbert, [&](const Record* first, const Record* last) {
+
+            for (; first < last && !found; first++) {
+                if (strcmp(first->id, rec.id) == 0) {
+                    stored = *first;
+                    found = true;
+                }
             }
-            
+
+            return !found;
+        });
+
+        if (!found) {
+            return false;
         }
-    
+
+        pendingRemoves.insert({rec.hilbert, rec.id});
+
+        for (size_t i = 0; i < levelRecords.size() && i <= stored.top_level; i++)
+            levelRecords[i]--;
+
+        return true;
     }
 
-    return results; 
+    return removeFromLevels(rec.hilbert, rec.id);
 }
 
+//removes a record from level 0, and from the other levels its stored copy's top level says it is in
+bool ls_tree::removeFromLevels(int hilbert, const char* id) {
 
-void ls_tree::insertMoreRecords(const Record& rec) {
-   //used to insert records after tree is built
+    Record stored;
 
-   //insert 5000 records from beginning of file
-   int hilbert = rec.hilbert;
-   int directoryCounter = 0; 
-   string LSTreeDir = "ls_tree_pages/btree";
-   string strDCounter = to_string(directoryCounter);
-   string directroy = LSTreeDir + strDCounter;
+    //everything is in level 0, which might be the memory level if the tree is small
+    if (levels.empty()) {
 
-   //cout << "going to add to directory: " << directroy << endl;
+        if (!isMemoryTree || !memoryTree.remove(hilbert, id)) {
+            return false;
+        }
 
-   addToTree(directroy, hilbert, rec);
-    //updates directory to add record to 
-   directoryCounter++; 
+        if (!levelRecords.empty()) levelRecords[0]--;
+        return true;
+    }
 
-   for (size_t i = 1; i < levels.size(); i++)
-   {
-    int flip = rand() % 2; 
-    if (flip == 1){
-        //cout << "coin flip at: " << i << " is a: " << flip << endl; 
-        break;
-        
+    if (!getTree(0).removeRecord(hilbert, id, &stored)) {
+        return false;
+    }
+
+    if (!levelRecords.empty()) levelRecords[0]--;
+
+    //the stored top level says which other levels have the record
+    for (size_t i = 1; i < levels.size() && i <= stored.top_level; i++) {
+        if (getTree(i).removeRecord(hilbert, id) && i < levelRecords.size()) {
+            levelRecords[i]--;
+        }
+    }
+
+    size_t m = levels.size();
+    if (isMemoryTree && stored.top_level >= m) {
+        if (memoryTree.remove(hilbert, id) && m < levelRecords.size()) {
+            levelRecords[m]--;
+        }
+    }
+
+    return true;
+}
+
+
+//builds the blocks from the records, sorted by hilbert value
+void memory_level::build(vector<Record> records) {
+
+    stable_sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.hilbert < b.hilbert; });
+
+    blocks.clear();
+    first_keys.clear();
+    count = records.size();
+
+    for (size_t i = 0; i < records.size(); i += MEMORY_BLOCK_RECORDS) {
+
+        size_t end = min(i + MEMORY_BLOCK_RECORDS, records.size());
+
+        blocks.emplace_back(records.begin() + i, records.begin() + end);
+        first_keys.push_back(records[i].hilbert);
     }
-    else { 
-        //directoryCounter++;
-        strDCounter = to_string(directoryCounter);
-        //directroy = LSTreeDir + strDCounter;
-        directroy = LSTreeDir + to_string(i);
-        addToTree(directroy, hilbert, rec);
+}
+
+//the last block whose first key is at most key, or the first block
+size_t memory_level::blockFor(int key) const {
+
+    size_t block = upper_bound(first_keys.begin(), first_keys.end(), key) - first_keys.begin();
+
+    return (block == 0) ? 0 : block - 1;
+}
+
+//the first block that can hold key: the one before the first block starting at key or later, since that
+//one can end with key. Runs of equal keys can span several blocks
+size_t memory_level::firstBlockFor(int key) const {
+
+    size_t block = lower_bound(first_keys.begin(), first_keys.end(), key) - first_keys.begin();
+
+    return (block == 0) ? 0 : block - 1;
+}
+
+//inserts after any records with the same key, within its block
+void memory_level::insert(const Record& rec) {
+
+    if (blocks.empty()) {
+        blocks.push_back({rec});
+        first_keys.push_back(rec.hilbert);
+        count = 1;
+        return;
+    }
+
+    size_t block = blockFor(rec.hilbert);
+    vector<Record>& records = blocks[block];
+
+    auto it = upper_bound(records.begin(), records.end(), rec.hilbert,
+                          [](int key, const Record& r) { return key < r.hilbert; });
+
+    records.insert(it, rec);
+    first_keys[block] = records.front().hilbert;
+    count++;
+
+    rebalance(block);
+}
+
+//fills the last block up to MEMORY_BLOCK_RECORDS, then starts a new one
+void memory_level::appendSorted(const Record& rec) {
+
+    if (!blocks.empty() && rec.hilbert < blocks.back().back().hilbert) {
+        insert(rec);
+        return;
     }
 
-   }
-   
+    if (blocks.empty() || blocks.back().size() >= MEMORY_BLOCK_RECORDS) {
+        blocks.emplace_back();
+        blocks.back().reserve(MEMORY_BLOCK_RECORDS);
+        first_keys.push_back(rec.hilbert);
+    }
 
+    blocks.back().push_back(rec);
+    count++;
 }
 
+//removes the record with the same key and id, looking through every block the key can be in
+bool memory_level::remove(int hilbert, const char* id, Record* removed) {
+
+    for (size_t block = firstBlockFor(hilbert); block < blocks.size() && first_keys[block] <= hilbert; block++) {
+
+        vector<Record>& records = blocks[block];
+
+        auto it = lower_bound(records.begin(), records.end(), hilbert,
+                              [](const Record& r, int key) { return r.hilbert < key; });
 
-void ls_tree::removeHilbert(const Record& rec) {
-    //to remove from ls-tree based on hilbert value
+        for (; it != records.end() && it->hilbert == hilbert; it++) {
 
-    if(isMemoryTree) {
-        vector<Record> memResults = memoryTree.rangeQueryR(rec.hilbert, rec.hilbert);
-        int count = 0;
-        for(const auto& r : memResults) {
-            if (strcmp(rec.id, r.id) == 0) {
-                memoryTree.removeR(r.hilbert);
-                //cout << "removed " << r.hilbert << "from memorytree with id: " << r.id << endl ;
-                break; 
-                count++;
+            if (strcmp(it->id, id) == 0) {
+
+                if (removed)
+                    *removed = *it;
+
+                records.erase(it);
+                count--;
+
+                rebalance(block);
+                return true;
             }
         }
-        /*if (count ==0) { 
-            //cout << "[mem] id: " << rec.id << "could not find: " << rec.hilbert << "/ id: " << endl;
-        }*/
-    }
-
-    //int count = 0; 
-    for (auto it = levels.begin(); it!=levels.end(); it++) {
-        vector <Record> diskResults = it->second.rangeQueryR(rec.hilbert, rec.hilbert); 
-        for(const auto& r : diskResults) {
-            if (strcmp(rec.id, r.id) == 0) {
-                it->second.removeR(r.hilbert); 
-                //cout << "removed " << r.hilbert << "from disktree with id: " << r.id << endl ;
-                break; 
-            }
+    }
+
+    return false;
+}
+
+//keeps the blocks between 1 and 2 * MEMORY_BLOCK_RECORDS records
+void memory_level::rebalance(size_t block) {
+
+    vector<Record>& records = blocks[block];
+
+    if (records.empty()) {
+        blocks.erase(blocks.begin() + block);
+        first_keys.erase(first_keys.begin() + block);
+        return;
+    }
+
+    first_keys[block] = records.front().hilbert;
+
+    if (records.size() > 2 * MEMORY_BLOCK_RECORDS) {
+
+        vector<Record> upper(records.begin() + MEMORY_BLOCK_RECORDS, records.end());
+        records.resize(MEMORY_BLOCK_RECORDS);
+
+        int upper_key = upper.front().hilbert;
+
+        blocks.insert(blocks.begin() + block + 1, move(upper));
+        first_keys.insert(first_keys.begin() + block + 1, upper_key);
+    }
+}
+
+//copies the in-range slices
+vector<Record> memory_level::rangeQueryR(int low, int high) const {
+
+    vector<Record> result;
+
+    rangeScanR(low, high, [&](const Record* first, const Record* last) {
+        result.insert(result.end(), first, last);
+        return true;
+    });
+
+    return result;
+}
+
+//binary searches for the first block and record, then walks the blocks until a key is past the range
+void memory_level::rangeScanR(int low, int high, const function<bool(const Record*, const Record*)>& visit) const {
+
+    if (low > high)
+        return;
+
+    for (size_t block = firstBlockFor(low); block < blocks.size(); block++) {
+
+        const vector<Record>& records = blocks[block];
+
+        auto first = lower_bound(records.begin(), records.end(), low,
+                                 [](const Record& r, int key) { return r.hilbert < key; });
+        auto last = upper_bound(first, records.end(), high,
+                                [](int key, const Record& r) { return key < r.hilbert; });
+
+        if (first < last && !visit(&*first, &*first + (last - first)))
+            return;
+
+        if (last != records.end())
+            return;
+    }
+}
+
+//the blocks of the hilbert range, split into runs of matching records
+void memory_level::filteredScan(const scan_filter& filter, const function<bool(const Record*, const Record*)>& visit) const {
+
+    rangeScanR(filter.low, filter.high, [&](const Record* first, const Record* last) {
+
+        while (first < last) {
+
+            const Record* run = first;
+            while (run < last && filter.matches(*run))
+                run++;
+
+            if (run > first && !visit(first, run))
+                return false;
+
+            first = run;
+            while (first < last && !filter.matches(*first))
+                first++;
         }
 
-        /*if (count ==0) { 
-            cout << "[disk] id: " << rec.id << "could not find: " << rec.hilbert << "/ id: " << endl;
-        }*/
+        return true;
+    });
+}
+
+//record count followed by the records
+bool memory_level::snapshot(const string& path) const {
+
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out)
+        return false;
+
+    uint64_t records = count;
+    out.write(reinterpret_cast<const char*>(&records), sizeof(records));
+
+    for (const vector<Record>& block : blocks)
+        out.write(reinterpret_cast<const char*>(block.data()), block.size() * sizeof(Record));
+
+    return (bool) out;
+}
+
+//reads a snapshot back, leaving the level as it was if the file is not a complete one
+bool memory_level::restore(const string& path) {
+
+    ifstream in(path, ios::binary);
+    if (!in)
+        return false;
+
+    uint64_t records = 0;
+    in.read(reinterpret_cast<char*>(&records), sizeof(records));
+
+    vector<Record> loaded(records);
+    in.read(reinterpret_cast<char*>(loaded.data()), records * sizeof(Record));
+
+    if (!in)
+        return false;
+
+    build(move(loaded));
+    return true;
+}
+
+//stream constructor, the levels are handed out from the top down
+ls_sample_stream::ls_sample_stream(ls_tree& tree, int low, int high)
+    : tree(tree), low(low), high(high), top((int) tree.size() - 1), level((int) tree.size()), salt(threadRng()()) {}
+
+//hands out the next record of the current bucket, moving on to the next bucket when it runs out
+bool ls_sample_stream::next(Record& out) {
+
+    while (position == current.size()) {
+
+        if (!nextBucket())
+            return false;
     }
 
-}
\ No newline at end of file
+    //one Fisher-Yates step per record, so the bucket's records are shuffled as they are handed out
+    swap(current[position], current[position + threadRng().bounded(current.size() - position)]);
+
+    out = current[position++];
+    handed_out++;
+
+    return true;
+}
+
+//level i holds the records with top level i or higher, so the ones with exactly i are the ones not handed out yet
+bool ls_sample_stream::newAt(const Record& rec, int at) const {
+
+    return at == top ? rec.top_level >= at : rec.top_level == at;
+}
+
+//the top levels are drawn independently of the records, and so is the salt, so every bucket is a uniform part of
+//the level's new records
+size_t ls_sample_stream::bucketOf(const Record& rec) const {
+
+    uint64_t h = salt ^ hash<string_view>()(string_view(rec.id, strnlen(rec.id, sizeof(rec.id)))) ^ (uint64_t) (uint32_t) rec.hilbert;
+
+    return splitmix64(h) % buckets;
+}
+
+size_t ls_sample_stream::bucketsFor(int at) {
+
+    //a level whose hilbert range misses the query has nothing to hand out
+    if (at < (int) tree.maxMin.size()) {
+        max_min_hilbert& treeRange = tree.maxMin[at];
+        if (low > treeRange.max_hilbert || high < treeRange.min_hilbert)
+            return 0;
+    }
+
+    //the level's count minus the count of the level above is a bound on its new records, most levels fit in one
+    //bucket on that alone
+    if (at < (int) tree.levelRecords.size()) {
+
+        long int bound = tree.levelRecords[at];
+        if (at < top && at + 1 < (int) tree.levelRecords.size())
+            bound -= tree.levelRecords[at + 1];
+
+        if (bound <= (long int) LS_STREAM_BUCKET_RECORDS)
+            return 1;
+    }
+
+    //otherwise the new records in range are counted first
+    size_t count = 0;
+
+    tree.scanLevel(at, low, high, [&](const Record* first, const Record* last) {
+        for (const Record* r = first; r < last; r++)
+            count += newAt(*r, at);
+        return true;
+    });
+
+    return (count + LS_STREAM_BUCKET_RECORDS - 1) / LS_STREAM_BUCKET_RECORDS;
+}
+
+//scans the level for the records of the next bucket, going down a level once every bucket of it is out
+bool ls_sample_stream::nextBucket() {
+
+    current.clear();
+    position = 0;
+
+    while (true) {
+
+        if (bucket >= buckets) {
+
+            if (level == 0)
+                return false;
+
+            level--;
+            bucket = 0;
+            buckets = bucketsFor(level);
+
+            continue;
+        }
+
+        size_t scanning = bucket++;
+
+        tree.scanLevel(level, low, high, [&](const Record* first, const Record* last) {
+
+            for (const Record* r = first; r < last; r++) {
+                if (newAt(*r, level) && (buckets == 1 || bucketOf(*r) == scanning))
+                    current.push_back(*r);
+            }
+
+            return true;
+        });
+
+        if (!current.empty())
+            return true;
+    }
+}
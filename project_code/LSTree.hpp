@@ -2,6 +2,9 @@
 
 
 #include "rtree.hpp"
+#include "OnlineAggregation.hpp"
+#include "rng.hpp"
+#include "ThreadPool.hpp"
 #include <iostream>
 #include <string>
 #include <cstring>
@@ -9,6 +12,11 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <set>
+#include <random>
+#include <functional>
+#include <future>
+#include <atomic>
 
 
 
@@ -20,34 +28,211 @@ struct max_min_hilbert {
 } ; 
 
 
+//a level with at most this many records is small enough to be the memory level, and the levels stop there
+//(Page 7, Wang et al.). Default: 256000
+constexpr size_t LS_MEMORY_LEVEL_RECORDS = 256000;
+
+//cap on the number of levels a record can be drawn into
+constexpr int MAX_LS_LEVELS = 32;
+
+//records per block of the memory level. Default: 512
+constexpr size_t MEMORY_BLOCK_RECORDS = 512;
+
+//inserts wait in an in-memory buffer and go into the levels this many at a time. Default: 16384
+constexpr size_t LS_INSERT_BUFFER_RECORDS = 16384;
+
+//the levels are rebuilt once the tree grew or shrank by this factor since they were built, or once the memory
+//level got this many times bigger than LS_MEMORY_LEVEL_RECORDS. Default: 2
+constexpr double LS_REBUILD_GROWTH = 2.0;
+
+//levels a query scans at once on a pool: the one it jumped to and the ones below it. Default: 3
+constexpr size_t LS_PARALLEL_LEVELS = 3;
+
+//records a sample stream holds at once, a level with more new records in range is handed out in buckets of
+//about this many. Default: 65536
+constexpr size_t LS_STREAM_BUCKET_RECORDS = 65536;
+
+//the smallest LS-tree level, held in memory as a sorted array of records cut into blocks of at most
+//2 * MEMORY_BLOCK_RECORDS, with the first key of every block kept in a separate array. Lookups binary search
+//the first keys and then the block, and inserts and deletes only move the records of one block, so nothing
+//goes through the page handler (or any system call) once it is built. It can be saved to and loaded from a file
+class memory_level {
+
+public:
+
+    //replaces the contents with the given records
+    void build(vector<Record> records);
+
+    //adds a record, keeping the hilbert order
+    void insert(const Record& rec);
+
+    //adds a record that comes after every record so far (in hilbert order) to the end of the last block, so a
+    //level can be loaded from a cursor without a copy or a sort. Anything out of order falls back to insert
+    void appendSorted(const Record& rec);
+
+    //removes the record with this hilbert value and id, returns false if there is none. The removed record is
+    //copied into removed if given
+    bool remove(int hilbert, const char* id, Record* removed = nullptr);
+
+    vector<Record> rangeQueryR(int low, int high) const;
+
+    //calls visit with every block's slice [first, last) of records in [low, high], in order, without copying them.
+    //Returning false from visit ends the scan
+    void rangeScanR(int low, int high, const function<bool(const Record*, const Record*)>& visit) const;
+
+    //the same, with the slices cut down to the runs of records that match the filter
+    void filteredScan(const scan_filter& filter, const function<bool(const Record*, const Record*)>& visit) const;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    //writes the records to a file, and reads them back, false if the file could not be used
+    bool snapshot(const string& path) const;
+    bool restore(const string& path);
+
+private:
+
+    vector<vector<Record>> blocks;
+
+    //hilbert value of the first record of every block
+    vector<int> first_keys;
+
+    size_t count = 0;
+
+    //block that a key goes into, the last block whose first key is at most key
+    size_t blockFor(int key) const;
+
+    //first block that can hold records with key
+    size_t firstBlockFor(int key) const;
+
+    //splits a block that got too big, and drops one that got empty
+    void rebalance(size_t block);
+};
+
+//a whole set of levels as a build or a rebuild makes them, to be swapped in at once
+struct ls_levels {
+
+    map<int, b_plus_tree> disk;
+    vector<max_min_hilbert> ranges;
+    vector<long int> records;
+
+    memory_level memory;
+    bool has_memory = false;
+
+    //disk level directories are numbered by generation, so a rebuild never writes over the levels in use
+    int generation = 0;
+};
+
 class ls_tree {
     public:
     //class for LSTree, collection of RTrees
     ls_tree(const string& dir); 
 
-    map<string, b_plus_tree> levels;
+    //waits for a rebuild that is still running and throws its levels away
+    ~ls_tree();
+
+    //the rebuild holds on to the tree
+    ls_tree(const ls_tree&) = delete;
+    ls_tree& operator=(const ls_tree&) = delete;
+
+    //disk levels by level number, so that btree10 comes after btree2
+    map<int, b_plus_tree> levels;
     vector<max_min_hilbert> maxMin; 
 
+    //number of records in every level, the memory level last
+    vector<long int> levelRecords;
+
     //used to get root and handler info for main
     int getRootPage()  { return root_page; }
     page_handler& getHandler()  { return handler; }
 
-    b_plus_tree memoryTree;
+    //smallest level, kept in memory
+    memory_level memoryTree;
     bool isMemoryTree = false; 
 
+    //level index of the trees: 0 is the full data set and level i holds about a 2^-i sample of it, with the memory
+    //tree as the last (smallest) level. getTree only gives the disk levels
     b_plus_tree& getTree(size_t index);
     size_t size() const; 
+
+    //calls visit with the in-range records of a level, slice by slice, whether the level is on disk or in memory,
+    //followed by the buffered inserts that belong to the level
+    void scanLevel(size_t index, int low, int high, const function<bool(const Record*, const Record*)>& visit);
+
+    //the same with a filter, the disk levels skip whole subtrees by their zone maps
+    void scanLevel(size_t index, const scan_filter& filter, const function<bool(const Record*, const Record*)>& visit);
     //void addToTree(b_plus_tree& btree, int key, const Record& rec);
-    void addToTree(const string& treeName, int key, const Record& rec); 
+    void addToTree(size_t level, int key, const Record& rec); 
 
     void insertMemoryTree(const string& dir);
 
-    vector<Record> querying(int low, int high, long unsigned int k); //int k 
+    //streaming build from records in hilbert order: every record gets its top level drawn once and is handed to
+    //all of its levels right away. A level is buffered in memory until it outgrows LS_MEMORY_LEVEL_RECORDS, after
+    //which it is bulk loaded on disk. finishBuild closes the disk levels and makes the first level that stayed
+    //small the memory level, dropping the ones above it
+    void buildAppend(const Record& rec);
+    void finishBuild();
+
+    //directory of a disk level, in the current generation
+    string levelDirectory(size_t index) const;
+
+    //catalog of the levels (directories, record counts, hilbert bounds, sampling rates) along with a snapshot of
+    //the memory level, written into the tree's directory so that the tree can be reopened without a rebuild
+    bool saveCatalog();
+
+    //reopens the tree saved in the directory, false if there is no (complete) catalog, leaving the tree empty
+    bool openCatalog();
+
+    //whether dir holds a saved tree
+    static bool catalogExists(const string& dir);
+
+    //number of records in the tree, the size of level 0
+    long int recordCount() const;
+
+    //k records of [low, high] without replacement. The smallest level is read first, its in-range count times 2^i
+    //estimates |q ∩ P|, and the query jumps to the smallest level expected to hold k records, only moving on to
+    //bigger levels on a shortfall. With a budget, stops before the next level once it runs out of time or page reads.
+    //With a pool, the level it jumps to and the LS_PARALLEL_LEVELS - 1 below it are scanned at the same time, and
+    //the first to finish with k records cancels the others, so a shortfall costs about as much as the slowest scan
+    vector<Record> querying(int low, int high, long unsigned int k, query_budget* budget = nullptr,
+                            work_stealing_pool* pool = nullptr); //int k 
+
+    //k records that match the filter (a hilbert range, and a rectangle or time window), without replacement
+    vector<Record> querying(const scan_filter& filter, size_t k, query_budget* budget = nullptr,
+                            work_stealing_pool* pool = nullptr);
 
+    //adds a record after the build. The record's top level is drawn right away, but it waits in the insert buffer
+    //(where queries see it) until LS_INSERT_BUFFER_RECORDS have piled up, which then go into the levels together.
+    //Once the tree has drifted too far from the shape it was built with, the levels are rebuilt in the background
     void insertMoreRecords(const Record& rec); 
 
-    void removeHilbert(const Record& rec);
+    //writes the buffered inserts into the levels, unless a rebuild is reading them
+    void flushInserts();
 
+    //starts rebuilding every level from level 0 on another thread, with bulk loading, returns false if one is
+    //already running. Queries and inserts carry on with the current levels, and the new ones are swapped in by
+    //the first call on the tree after the rebuild is done
+    bool startRebuild();
+
+    //whether the tree drifted far enough from its last build to be rebuilt
+    bool needsRebuild() const;
+
+    bool rebuilding() const { return rebuild.valid(); }
+
+    //waits for a running rebuild, swaps it in and flushes the insert buffer, so everything is in the levels
+    void finishMaintenance();
+
+    //records waiting in the insert buffer
+    size_t bufferedInserts() const { return insertBuffer.size(); }
+
+    //removes the record with rec's hilbert value and id from every level it is in. Level 0 holds every record,
+    //and the copy found there tells the record's top level, so only levels 0 to top_level are touched (two
+    //on average). While a rebuild runs the record is only hidden from queries, and removed from the levels once
+    //the rebuild is swapped in, so a remove never waits on it. Returns false if the record is not in the tree
+    bool removeHilbert(const Record& rec);
+
+    //every record of a tree, read through a leaf cursor. This holds the whole tree in memory, construction and
+    //rebuilds stream through leaf_cursor instead
     vector<Record> getRecords(b_plus_tree& tree); 
     
 
@@ -64,6 +249,128 @@ class ls_tree {
 
     string baseDirectory; 
 
+    //generation of the disk level directories in use
+    int generation = 0;
+
+    //memory level snapshot that the saved catalog points at, empty if there is none
+    string savedSnapshot;
+
+    //inserts not in the levels yet, each with its top level drawn
+    memory_level insertBuffer;
+
+    //records in the tree when the levels were last built, to tell how far it drifted since
+    long int builtRecords = 0;
+
+    //a level of a build that is still running
+    struct build_level {
+
+        //records while the level is small, empty once it went to disk
+        vector<Record> buffered;
+        bool on_disk = false;
+
+        max_min_hilbert range{INT64_MAX, INT64_MIN};
+        long int records = 0;
+    };
+
+    //bulk loads a set of levels from records in hilbert order that already have their top levels, into the
+    //directories of one generation. The first build and the rebuilds both go through it
+    struct level_builder {
+
+        string base;
+        vector<build_level> building;
+        ls_levels result;
+
+        void append(const Record& rec);
+        ls_levels finish();
+    };
+
+    level_builder builder;
+
+    //rebuild running in the background
+    future<ls_levels> rebuild;
+
+    //records removed while the rebuild reads the levels, by hilbert value and id. Scans skip them, and they are
+    //removed from the new levels when those are swapped in
+    set<pair<int, string>> pendingRemoves;
+
+    //removes a record from the levels, without looking at the insert buffer or a running rebuild
+    bool removeFromLevels(int hilbert, const char* id);
+
+    //k uniform records of a level's matching records, or all of them if there are fewer. stop is asked after
+    //every slice of the scan, and the scan ends with the records so far once it returns true
+    vector<Record> sampleLevel(int level, const scan_filter& filter, size_t k, xoshiro256& rand_gen,
+                               const function<bool()>& stop = nullptr);
+
+    //scans levels top down to bottom on the pool at once. Returns the first level to find k records, or the bottom
+    //level's records if none did, with reached set to the level returned. cut_short is set if the budget ran out
+    //before any level was read in full
+    vector<Record> sampleLevelsParallel(int top, int bottom, const scan_filter& filter, size_t k, work_stealing_pool& pool,
+                                        query_budget* budget, int& reached, bool& cut_short);
+
+    //swaps in a finished rebuild, waiting for it if wait is set
+    void collectRebuild(bool wait);
+
+    //makes a set of levels the tree's levels, the buffered inserts are counted into them
+    void installLevels(ls_levels built);
+
+    //adds a record to the hilbert ranges and counts of levels 0 to its top level
+    void countInsert(const Record& rec);
+
 } ;
 
+//pull based sampling over the LS-tree: hands out every record of [low, high] once, in an order where any prefix is
+//a uniform sample without replacement. The smallest level comes first, then each level below it adds only the
+//records whose top level is that level (the ones it does not share with the level above), shuffled, so a record
+//comes out of the one level it was last drawn into. A level with more than LS_STREAM_BUCKET_RECORDS such records
+//is split into buckets by a salted hash of the records and scanned once per bucket, so the stream never holds
+//much more than a bucket. Unlike querying there is no k to pick a level for. The ls_tree has to outlive the
+//stream, and must not change while it is in use
+class ls_sample_stream {
+
+public:
+
+    ls_sample_stream(ls_tree& tree, int low, int high);
+
+    //puts the next record in out, false once every level has been gone through
+    bool next(Record& out);
+
+    //number of records handed out so far
+    size_t produced() const { return handed_out; }
+
+private:
+
+    ls_tree& tree;
+    int low;
+    int high;
+
+    //highest level, the only one that hands out all of its records
+    int top;
+
+    //level being handed out, starting above the top, and its bucket to scan next out of buckets
+    int level;
+    size_t bucket = 0;
+    size_t buckets = 0;
+
+    //picks the buckets, drawn once per stream
+    uint64_t salt;
+
+    //records of the current bucket, the ones before position are shuffled and handed out
+    vector<Record> current;
+    size_t position = 0;
+
+    size_t handed_out = 0;
+
+    //whether a record of the level is handed out by this level
+    bool newAt(const Record& rec, int at) const;
+
+    //bucket of a record, from its id and hilbert value
+    size_t bucketOf(const Record& rec) const;
+
+    //number of buckets the level's new records in range are split into, 0 if there are none
+    size_t bucketsFor(int at);
+
+    //loads the next bucket with records, false if there is none left
+    bool nextBucket();
+};
+
 extern const string ROOT_META_FILE;
\ No newline at end of file
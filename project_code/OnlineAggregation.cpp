@@ -0,0 +1,481 @@
+// --- Online Aggregation ---
+
+/*
+References:
+J. M. Hellerstein, P. J. Haas and H. J. Wang. Online Aggregation. In SIGMOD, 1997
+B. P. Welford. Note on a Method for Calculating Corrected Sums of Squares and Products. Technometrics, 1962
+
+--- Online aggregation function implementation ---
+
+*/
+
+#include "OnlineAggregation.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+//z such that P(|Z| <= z) = confidence, found by bisection on erfc since P(|Z| > z) = erfc(z / sqrt(2))
+double normalQuantile(double confidence) {
+
+    if (confidence <= 0)
+        return 0;
+
+    if (confidence >= 1)
+        return INFINITY;
+
+    double low = 0;
+    double high = 40;
+
+    for (int i = 0; i < 100; i++) {
+
+        double mid = (low + high) / 2;
+
+        if (erfc(mid / sqrt(2.0)) > 1 - confidence)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return (low + high) / 2;
+}
+
+//constructor
+online_aggregation::online_aggregation(long int population, double confidence, bool has_predicate)
+    : N(population), level(confidence), z(normalQuantile(confidence)), predicate(has_predicate) {}
+
+//weighted sampling, the population size is not known but the total weight is
+online_aggregation online_aggregation::weighted(double total_weight, double confidence, bool has_predicate) {
+
+    online_aggregation aggregation(0, confidence, has_predicate);
+
+    aggregation.is_weighted = true;
+    aggregation.total_weight = total_weight;
+
+    return aggregation;
+}
+
+//adds a uniform sample, which stands for N records
+void online_aggregation::add(double value, bool matches) {
+
+    addExpanded(value, matches, N);
+}
+
+//adds a sample drawn with probability weight / W, which stands for W / weight records (Hansen-Hurwitz)
+void online_aggregation::addWeighted(double value, double weight, bool matches) {
+
+    addExpanded(value, matches, weight > 0 ? total_weight / weight : 0);
+}
+
+//adds a sample with its expansion factor, updating the running means, variances and co-moment
+void online_aggregation::addExpanded(double value, bool matches, double expansion) {
+
+    double x = matches ? expansion * value : 0;
+    double m = matches ? expansion : 0;
+
+    n++;
+    if (matches)
+        matched++;
+
+    double delta_x = x - mean_x;
+    double delta_m = m - mean_m;
+
+    mean_x += delta_x / n;
+    mean_m += delta_m / n;
+
+    //uses the old delta of one and the new mean of the other, as in Welford's method
+    m2_x += delta_x * (x - mean_x);
+    m2_m += delta_m * (m - mean_m);
+    c_xm += delta_x * (m - mean_m);
+}
+
+//merges in count samples of x = m = 0, with the parallel form of Welford's update (Chan et al.)
+void online_aggregation::addNonMatching(size_t count) {
+
+    if (count == 0)
+        return;
+
+    size_t total = n + count;
+    double share = (double) n * count / total;
+
+    m2_x += mean_x * mean_x * share;
+    m2_m += mean_m * mean_m * share;
+    c_xm += mean_x * mean_m * share;
+
+    mean_x = mean_x * n / total;
+    mean_m = mean_m * n / total;
+
+    n = total;
+}
+
+//builds an estimate with the interval value +- z * standard error
+aggregate_estimate online_aggregation::interval(double value, double std_error) const {
+
+    aggregate_estimate estimate;
+
+    estimate.value = value;
+    estimate.samples = n;
+
+    //a single sample says nothing about the variance
+    if (n < 2) {
+        estimate.low = -INFINITY;
+        estimate.high = INFINITY;
+        return estimate;
+    }
+
+    estimate.low = value - z * std_error;
+    estimate.high = value + z * std_error;
+
+    return estimate;
+}
+
+//COUNT = mean(m), exact if the samples are uniform and nothing can fail the predicate
+aggregate_estimate online_aggregation::count() const {
+
+    if (!is_weighted && (!predicate || N == 0)) {
+
+        aggregate_estimate estimate;
+
+        estimate.value = estimate.low = estimate.high = N;
+        estimate.samples = n;
+        estimate.exact = true;
+
+        return estimate;
+    }
+
+    double variance = (n > 1) ? m2_m / (n - 1) : 0;
+
+    return interval(mean_m, sqrt(variance / n));
+}
+
+//SUM = mean(x)
+aggregate_estimate online_aggregation::sum() const {
+
+    //nothing in range, the sum is 0
+    if (is_weighted ? total_weight <= 0 : N == 0) {
+
+        aggregate_estimate estimate;
+        estimate.exact = true;
+
+        return estimate;
+    }
+
+    double variance = (n > 1) ? m2_x / (n - 1) : 0;
+
+    return interval(mean_x, sqrt(variance / n));
+}
+
+//AVG = mean(x) / mean(m), with the delta method variance of a ratio when there is a predicate
+aggregate_estimate online_aggregation::avg() const {
+
+    //nothing matched yet, there is no average to report
+    if (matched == 0) {
+
+        aggregate_estimate estimate;
+        estimate.samples = n;
+        estimate.low = -INFINITY;
+        estimate.high = INFINITY;
+
+        return estimate;
+    }
+
+    double ratio = mean_x / mean_m;
+
+    if (n < 2)
+        return interval(ratio, 0);
+
+    //var(x - ratio * m) / (n * mean(m)^2), which is just var(x) / n without a predicate
+    double residual_variance = (m2_x - 2 * ratio * c_xm + ratio * ratio * m2_m) / (n - 1);
+
+    return interval(ratio, sqrt(max(residual_variance, 0.0) / n) / mean_m);
+}
+
+//estimate of the given aggregate
+aggregate_estimate online_aggregation::estimate(aggregate_kind kind) const {
+
+    if (kind == AGG_COUNT)
+        return count();
+
+    if (kind == AGG_SUM)
+        return sum();
+
+    return avg();
+}
+
+//records how the query ended, along with its cost
+void online_aggregation::finish(stop_reason why, double elapsed_ms, long int pages_read) {
+
+    stopped = why;
+    elapsed = elapsed_ms;
+    page_reads = pages_read;
+}
+
+//starts the clock and takes the page count at the start of the query
+query_budget::query_budget(const stop_condition& stop, function<long int()> page_counter)
+    : stop(stop), pages(page_counter), start(chrono::steady_clock::now()), start_pages(page_counter ? page_counter() : 0) {}
+
+//milliseconds since the query started
+double query_budget::elapsedMs() const {
+
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+//pages read by this query so far
+long int query_budget::pagesRead() const {
+
+    return (pages ? pages() - start_pages : 0) + other_pages;
+}
+
+//checks the conditions in order of how hard they are
+stop_reason query_budget::check(size_t samples, const online_aggregation* estimates) {
+
+    if (stop.deadline_ms > 0 && elapsedMs() >= stop.deadline_ms)
+        stopped = STOP_DEADLINE;
+
+    else if (stop.max_page_reads > 0 && pages && pagesRead() >= stop.max_page_reads)
+        stopped = STOP_PAGE_READS;
+
+    else if (samples >= stop.max_samples)
+        stopped = STOP_SAMPLES;
+
+    else if (estimates && stop.max_half_width > 0 && samples >= stop.min_samples) {
+
+        aggregate_estimate target = estimates->estimate(stop.target);
+
+        if (target.exact || target.halfWidth() <= stop.max_half_width)
+            stopped = STOP_ERROR;
+    }
+
+    return stopped;
+}
+
+//the time and page conditions of check, without recording a reason
+bool query_budget::overBudget(long int pages_read) const {
+
+    if (stop.deadline_ms > 0 && elapsedMs() >= stop.deadline_ms)
+        return true;
+
+    return stop.max_page_reads > 0 && pages && pages_read >= stop.max_page_reads;
+}
+
+//size of the next batch, so that the budgets are not overshot by much
+size_t query_budget::nextBatch(size_t batch_size, size_t samples) const {
+
+    size_t batch = min(batch_size, stop.max_samples - min(samples, stop.max_samples));
+
+    //nothing to go on until the first samples are in, a small first batch measures the cost per sample
+    if (samples == 0) {
+
+        if (stop.deadline_ms > 0 || (stop.max_page_reads > 0 && pages))
+            batch = min(batch, (size_t) 8);
+
+        return max(batch, (size_t) 1);
+    }
+
+    //samples that are expected to fit in the time left
+    if (stop.deadline_ms > 0) {
+
+        double elapsed = elapsedMs();
+        double per_sample = elapsed / samples;
+
+        if (per_sample > 0)
+            batch = min(batch, (size_t) max((stop.deadline_ms - elapsed) / per_sample, 1.0));
+    }
+
+    //samples that are expected to fit in the page reads left
+    if (stop.max_page_reads > 0 && pages) {
+
+        long int read = pagesRead();
+        double per_sample = (double) read / samples;
+
+        if (per_sample > 0)
+            batch = min(batch, (size_t) max((stop.max_page_reads - read) / per_sample, 1.0));
+    }
+
+    return max(batch, (size_t) 1);
+}
+
+//sum of the strata's values, with the standard errors recovered from the interval widths and added as variances
+aggregate_estimate combineEstimates(const vector<aggregate_estimate>& parts, double confidence) {
+
+    double z = normalQuantile(confidence);
+
+    aggregate_estimate total;
+    total.exact = true;
+
+    double variance = 0;
+
+    for (const aggregate_estimate& part : parts) {
+
+        total.value += part.value;
+        total.samples += part.samples;
+
+        if (!part.exact) {
+
+            total.exact = false;
+
+            double std_error = part.halfWidth() / z;
+            variance += std_error * std_error;
+        }
+    }
+
+    double half_width = z * sqrt(variance);
+
+    total.low = total.value - half_width;
+    total.high = total.value + half_width;
+
+    return total;
+}
+
+//constructor, the convergence target comes from a stop condition
+grouped_aggregation::grouped_aggregation(long int population, double confidence, const stop_condition& convergence)
+    : N(population), level(confidence), target(convergence) {}
+
+//a new group has missed every sample before this one
+void grouped_aggregation::add(long long int key, double value) {
+
+    auto it = groups.find(key);
+
+    if (it == groups.end()) {
+
+        group_state state;
+        state.estimates = online_aggregation(N, level, true);
+
+        it = groups.emplace(key, state).first;
+    }
+
+    group_state& state = it->second;
+
+    //pruned groups stay as they were when they converged
+    if (!state.converged) {
+
+        catchUp(state);
+        state.estimates.add(value, true);
+        state.seen++;
+    }
+
+    n++;
+}
+
+//only the sample count moves, the groups catch up on it when they are read
+void grouped_aggregation::addUngrouped() {
+
+    n++;
+}
+
+//adds the non-matching samples a running group missed
+void grouped_aggregation::catchUp(group_state& state) const {
+
+    state.estimates.addNonMatching(n - state.seen);
+    state.seen = n;
+}
+
+//freezes the running groups whose target estimate got narrow enough
+size_t grouped_aggregation::prune() {
+
+    size_t running = 0;
+
+    for (auto& [key, state] : groups) {
+
+        if (state.converged)
+            continue;
+
+        catchUp(state);
+
+        aggregate_estimate estimate = state.estimates.estimate(target.target);
+
+        if (target.max_half_width > 0 && state.estimates.samples() >= target.min_samples &&
+            (estimate.exact || estimate.halfWidth() <= target.max_half_width))
+            state.converged = true;
+        else
+            running++;
+    }
+
+    return running;
+}
+
+//groups seen so far, in key order
+vector<long long int> grouped_aggregation::keys() const {
+
+    vector<long long int> result;
+
+    for (const auto& group : groups)
+        result.push_back(group.first);
+
+    return result;
+}
+
+bool grouped_aggregation::converged(long long int key) const {
+
+    auto it = groups.find(key);
+    return it != groups.end() && it->second.converged;
+}
+
+//an up to date copy of a group's estimates
+online_aggregation grouped_aggregation::group(long long int key) const {
+
+    auto it = groups.find(key);
+
+    //never seen, every sample so far missed it
+    if (it == groups.end()) {
+
+        online_aggregation estimates(N, level, true);
+        estimates.addNonMatching(n);
+
+        return estimates;
+    }
+
+    group_state state = it->second;
+
+    if (!state.converged)
+        catchUp(state);
+
+    return state.estimates;
+}
+
+aggregate_estimate grouped_aggregation::estimate(long long int key, aggregate_kind kind) const {
+
+    return group(key).estimate(kind);
+}
+
+//records how the query ended, along with its cost
+void grouped_aggregation::finish(stop_reason why, double elapsed_ms, long int pages_read) {
+
+    stopped = why;
+    elapsed = elapsed_ms;
+    page_reads = pages_read;
+}
+
+//days since 1970-01-01 of a civil date, from Howard Hinnant's days_from_civil
+static long long int daysFromCivil(long long int year, int month, int day) {
+
+    year -= month <= 2;
+
+    long long int era = (year >= 0 ? year : year - 399) / 400;
+    long long int year_of_era = year - era * 400;
+    long long int day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    long long int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+    return era * 146097 + day_of_era - 719468;
+}
+
+//parses the timestamp by hand, so the buckets do not depend on the local time zone
+bool timestampBucket(const char* timestamp, long long int bucket_seconds, long long int& key) {
+
+    int year = 0, month = 1, day = 1, hour = 0, minute = 0, second = 0;
+
+    if (bucket_seconds <= 0 || sscanf(timestamp, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second) < 1)
+        return false;
+
+    if (month < 1 || month > 12 || day < 1 || day > 31)
+        return false;
+
+    long long int seconds = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+
+    //rounds towards negative infinity, for timestamps before 1970
+    key = seconds / bucket_seconds - (seconds % bucket_seconds < 0);
+
+    return true;
+}
@@ -0,0 +1,370 @@
+// --- Online Aggregation ---
+
+/*
+References:
+J. M. Hellerstein, P. J. Haas and H. J. Wang. Online Aggregation. In SIGMOD, 1997
+L. Wang, R. Christensen, F. Li and K. Yi. Spatial Online Sampling and Aggregation. In VLDB, 2015
+B. P. Welford. Note on a Method for Calculating Corrected Sums of Squares and Products. Technometrics, 1962
+
+Running COUNT/SUM/AVG estimates over a range, built from uniform samples (with replacement) of the
+records in the range, as described in [1] and used for the spatial case in [2].
+
+The population size N of the range comes from the index (the RS-tree's child counts), so it is exact.
+Every sample gives a value and whether it matches the query predicate (for example, a rectangle
+query answered through the hilbert ranges of the cells it covers). With x = value * match and
+m = match, the estimates are:
+    COUNT = N * mean(m)
+    SUM   = N * mean(x)
+    AVG   = mean(x) / mean(m)
+and each gets a CLT based confidence interval from the running variances, kept with [3] so that an
+estimate can be read after every sample. If there is no predicate, COUNT is exact.
+
+For samples drawn with probability proportional to a weight w (out of a total weight W), N is replaced
+by each sample's own expansion factor W / w, which gives the Hansen-Hurwitz estimators (the with
+replacement form of Horvitz-Thompson). COUNT is always estimated then.
+
+grouped_aggregation runs one such estimate per group key from a single sample stream, with a sample matching
+only its own group.
+
+For stratified sampling every stratum keeps its own estimates, and the COUNT or SUM of the strata add up
+to the total, with the variances of the strata adding up as well.
+
+Queries can be bounded with a stop_condition: a number of samples, a target confidence interval half width
+for one of the aggregates, a deadline, and a number of page reads. query_budget keeps track of those while a
+query runs, and the reason a query stopped is kept along with the (partial) estimates.
+
+This file does not depend on any of the tree headers, so it can be used with any of the trees.
+
+--- Online aggregation class declaration ---
+
+*/
+
+//a check to make sure that this header file is only included once
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+using namespace std;
+
+//an estimate along with its confidence interval
+struct aggregate_estimate {
+
+    double value = 0;
+    double low = 0;
+    double high = 0;
+
+    //samples the estimate is based on
+    size_t samples = 0;
+
+    //true when the value is known exactly, in which case low == high == value
+    bool exact = false;
+
+    //half width of the interval
+    double halfWidth() const { return (high - low) / 2; }
+};
+
+//aggregates that can be estimated
+enum aggregate_kind { AGG_COUNT, AGG_SUM, AGG_AVG };
+
+//why a query stopped
+enum stop_reason {
+
+    //still running, or never started
+    STOP_NONE,
+
+    //got the number of samples asked for
+    STOP_SAMPLES,
+
+    //the confidence interval of the target aggregate got narrow enough
+    STOP_ERROR,
+
+    //ran out of time
+    STOP_DEADLINE,
+
+    //ran out of page reads
+    STOP_PAGE_READS,
+
+    //nothing left to sample
+    STOP_EXHAUSTED,
+
+    //stopped by the caller's callback
+    STOP_CALLBACK
+};
+
+//when to stop a query, a value of 0 turns a condition off. Converts from a number of samples,
+//so a plain k can be passed wherever a stop_condition is expected
+struct stop_condition {
+
+    stop_condition(size_t max_samples = SIZE_MAX) : max_samples(max_samples) {}
+
+    size_t max_samples;
+
+    //stops once the half width of target's confidence interval is at most max_half_width
+    aggregate_kind target = AGG_AVG;
+    double max_half_width = 0;
+
+    //the interval is not trusted before this many samples, as the CLT needs a few
+    size_t min_samples = 30;
+
+    //time budget, in milliseconds
+    double deadline_ms = 0;
+
+    //page read budget
+    long int max_page_reads = 0;
+};
+
+class online_aggregation;
+
+//tracks a running query against its stop condition. page_counter returns the page reads of the calling
+//thread so far (page_handler::threadPageReads), so only the pages read by this query are counted
+class query_budget {
+
+public:
+
+    query_budget(const stop_condition& stop, function<long int()> page_counter = nullptr);
+
+    //reason to stop after samples samples, STOP_NONE to keep going. The error target is only checked when
+    //estimates are given
+    stop_reason check(size_t samples, const online_aggregation* estimates = nullptr);
+
+    //whether the time or page budget is used up, given the pages read so far. Only reads the budget, so it can
+    //be called in the middle of a scan, also from threads other than the query's
+    bool overBudget(long int pages_read) const;
+
+    //shrinks the next batch to what is expected to fit in the time and page budgets, from the cost
+    //of the samples so far, so that a single batch does not overshoot them by much
+    size_t nextBatch(size_t batch_size, size_t samples) const;
+
+    double elapsedMs() const;
+    long int pagesRead() const;
+
+    //adds pages read for the query by other threads (such as pool workers), which page_counter does not see
+    void addPages(long int count) { other_pages += count; }
+
+    //why the query stopped, set by check
+    stop_reason reason() const { return stopped; }
+    void setReason(stop_reason why) { stopped = why; }
+
+    const stop_condition& condition() const { return stop; }
+
+private:
+
+    stop_condition stop;
+    function<long int()> pages;
+
+    chrono::steady_clock::time_point start;
+    long int start_pages;
+    long int other_pages = 0;
+
+    stop_reason stopped = STOP_NONE;
+};
+
+class online_aggregation {
+
+public:
+
+    //population is the exact number of records in the range, confidence is the confidence level of the intervals
+    online_aggregation(long int population = 0, double confidence = 0.95, bool has_predicate = false);
+
+    //aggregation of samples drawn with probability weight / total_weight
+    static online_aggregation weighted(double total_weight, double confidence = 0.95, bool has_predicate = false);
+
+    //adds a uniform sample
+    void add(double value, bool matches = true);
+
+    //adds a sample that was drawn with probability proportional to weight
+    void addWeighted(double value, double weight, bool matches = true);
+
+    //adds count samples that failed the predicate at once, which is what every other group sees in a grouped query
+    void addNonMatching(size_t count);
+
+    //running estimates
+    aggregate_estimate count() const;
+    aggregate_estimate sum() const;
+    aggregate_estimate avg() const;
+
+    //estimate of the given aggregate
+    aggregate_estimate estimate(aggregate_kind kind) const;
+
+    //records how the query ended, along with its cost
+    void finish(stop_reason why, double elapsed_ms, long int pages_read);
+
+    stop_reason stopReason() const { return stopped; }
+    double elapsedMs() const { return elapsed; }
+    long int pagesRead() const { return page_reads; }
+
+    size_t samples() const { return n; }
+    long int population() const { return N; }
+    double confidence() const { return level; }
+
+private:
+
+    long int N;
+    double level;
+
+    //z value of the confidence level, from the normal quantile
+    double z;
+
+    //whether samples can fail the predicate, COUNT is only estimated then
+    bool predicate;
+
+    //weighted samples, COUNT is always estimated then
+    bool is_weighted = false;
+    double total_weight = 0;
+
+    //number of samples, and of samples that matched
+    size_t n = 0;
+    size_t matched = 0;
+
+    //running means and sums of squared differences (Welford) of x = expansion * value * match and
+    //m = expansion * match, plus the co-moment of the two, needed for the AVG ratio
+    double mean_x = 0;
+    double m2_x = 0;
+    double mean_m = 0;
+    double m2_m = 0;
+    double c_xm = 0;
+
+    //how the query ended
+    stop_reason stopped = STOP_NONE;
+    double elapsed = 0;
+    long int page_reads = 0;
+
+    //adds a sample that stands for expansion records
+    void addExpanded(double value, bool matches, double expansion);
+
+    //builds an estimate with the interval value +- z * standard error
+    aggregate_estimate interval(double value, double std_error) const;
+};
+
+//online aggregation per group (such as a grid cell or an hour) from one stream of uniform samples of a range.
+//A sample counts as matching for its own group and non-matching for all of the others, so every group gets the
+//same estimates as a query with the predicate "in this group", without running one query per group. The
+//non-matching samples are only added to a group when it is read or pruned, so a sample costs one group update.
+//A group whose target estimate is narrow enough (the stop condition's target, max_half_width and min_samples)
+//is pruned: its estimates are frozen, and the query can stop once every group seen so far is
+class grouped_aggregation {
+
+public:
+
+    grouped_aggregation(long int population = 0, double confidence = 0.95, const stop_condition& convergence = stop_condition());
+
+    //adds a sample of the given group
+    void add(long long int key, double value);
+
+    //adds a sample that is in none of the groups (for example, outside of the region)
+    void addUngrouped();
+
+    //brings the groups that are still running up to date and freezes the ones that converged, returns how many are left
+    size_t prune();
+
+    //groups seen so far, in key order
+    vector<long long int> keys() const;
+
+    bool contains(long long int key) const { return groups.count(key) > 0; }
+    bool converged(long long int key) const;
+
+    //the estimates of a group, up to date unless the group was pruned (0 if the group was never seen)
+    online_aggregation group(long long int key) const;
+    aggregate_estimate estimate(long long int key, aggregate_kind kind) const;
+
+    //records how the query ended, along with its cost
+    void finish(stop_reason why, double elapsed_ms, long int pages_read);
+
+    stop_reason stopReason() const { return stopped; }
+    double elapsedMs() const { return elapsed; }
+    long int pagesRead() const { return page_reads; }
+
+    size_t samples() const { return n; }
+    size_t groupCount() const { return groups.size(); }
+
+private:
+
+    //a group's estimates, and how many of the query's samples they have seen
+    struct group_state {
+
+        online_aggregation estimates;
+        size_t seen = 0;
+        bool converged = false;
+    };
+
+    long int N;
+    double level;
+    stop_condition target;
+
+    map<long long int, group_state> groups;
+
+    //samples of the whole query
+    size_t n = 0;
+
+    //how the query ended
+    stop_reason stopped = STOP_NONE;
+    double elapsed = 0;
+    long int page_reads = 0;
+
+    //adds the non-matching samples a running group missed
+    void catchUp(group_state& state) const;
+};
+
+//key of the time bucket of a "YYYY-MM-DD hh:mm:ss" timestamp (missing trailing fields count as their lowest value),
+//bucket_seconds wide and counted from 1970 in UTC, so 3600 gives hour buckets. Returns false if it cannot be parsed
+bool timestampBucket(const char* timestamp, long long int bucket_seconds, long long int& key);
+
+//runs a grouped aggregation over a sample stream (anything with bool next(record_type&), such as the RS-tree's
+//sample_stream or the LS-tree's ls_sample_stream). population is the number of records the stream samples from,
+//group_of(record, key) sets the record's group and returns false if it is in none, and field gives the value to
+//aggregate. Stops on the first of the stop conditions, when the stream runs out, or when every group converged
+template <typename record_type, typename stream_type, typename key_function, typename field_function>
+grouped_aggregation groupedAggregate(stream_type& stream, long int population, key_function group_of, field_function field,
+                                     const stop_condition& stop, function<long int()> page_counter = nullptr,
+                                     size_t batch_size = 256, double confidence = 0.95) {
+
+    query_budget budget(stop, page_counter);
+    grouped_aggregation aggregation(population, confidence, stop);
+
+    record_type rec;
+
+    while (budget.check(aggregation.samples()) == STOP_NONE) {
+
+        size_t batch = budget.nextBatch(max(batch_size, (size_t) 1), aggregation.samples());
+        size_t added = 0;
+
+        for (; added < batch && stream.next(rec); added++) {
+
+            long long int key;
+
+            if (group_of(rec, key))
+                aggregation.add(key, field(rec));
+            else
+                aggregation.addUngrouped();
+        }
+
+        //the stream ran out
+        if (added < batch) {
+            budget.setReason(STOP_EXHAUSTED);
+            break;
+        }
+
+        //every group converged
+        if (stop.max_half_width > 0 && aggregation.samples() >= stop.min_samples && aggregation.prune() == 0) {
+            budget.setReason(STOP_ERROR);
+            break;
+        }
+    }
+
+    aggregation.finish(budget.reason(), budget.elapsedMs(), budget.pagesRead());
+
+    return aggregation;
+}
+
+//z such that P(|Z| <= z) = confidence, for a standard normal Z
+double normalQuantile(double confidence);
+
+//adds up the estimates of independent strata (COUNT or SUM per stratum) into one estimate of the total,
+//the variances of the parts add up
+aggregate_estimate combineEstimates(const vector<aggregate_estimate>& parts, double confidence = 0.95);
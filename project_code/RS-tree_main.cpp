@@ -7,6 +7,7 @@ Used in some experiments as is
 
 // header files
 #include "RStree.hpp"
+#include "rng.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -26,9 +27,9 @@ using namespace std;
 
 int main() {
 
-    //random seeding
-    srand(time(0));
-    unsigned seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    //random seeding, SAMPLING_SEED=<number> makes a run repeatable
+    if (seedRandomFromEnv())
+        cout << "Using random seed from SAMPLING_SEED" << endl;
     string inputFile;
     cout << "Enter CSV file path: ";
     getline(cin, inputFile);
@@ -72,6 +73,17 @@ int main() {
                 r.timestamp[sizeof(r.timestamp) - 1] = '\0';
                 r.hilbert = stoi(hStr);
 
+                //optional weight column, for weighted sampling. A weight is a probability share, so
+                //negative ones (and nan or inf) make the line invalid
+                string wStr;
+                if (getline(ss, wStr, ',') && !wStr.empty()) {
+
+                    r.weight = stof(wStr);
+
+                    if (!isfinite(r.weight) || r.weight < 0)
+                        throw invalid_argument("weight must be a non negative number");
+                }
+
                 tree.insert(r.hilbert, r, true);
 
                 //incremente record counter
@@ -192,7 +204,7 @@ int main() {
             file.close();
 
             //shuffle
-            shuffle(records_to_be_shuffled.begin(), records_to_be_shuffled.end(), default_random_engine(seed));
+            shuffle(records_to_be_shuffled.begin(), records_to_be_shuffled.end(), threadRng());
             
             //capture time for every 50 insertions
             vector<double> insertTimes; 
@@ -34,6 +34,12 @@ modifications and changes
 
 #include "RStree.hpp"
 
+//per thread random streams
+#include "rng.hpp"
+
+//used to turn rectangles into hilbert ranges
+#include "hilbert.h"
+
 //data manipulation
 #include <fstream>
 #include <iostream>
@@ -47,11 +53,14 @@ modifications and changes
 #include <filesystem>
 #include <algorithm>
 #include <cassert>
+#include <climits>
 
 //sampling
 #include <chrono>
 #include <random>
 #include <unordered_set>
+#include <unordered_map>
+#include <mutex>
 
 using namespace std;
 
@@ -117,8 +126,18 @@ void page_handler::writePage(long int pageID, const void* data, size_t dataSize)
 
 }
 
+//pages read by each thread, so a query can tell how many pages it read
+thread_local long int thread_page_reads = 0;
+
+long int page_handler::threadPageReads() {
+
+    return thread_page_reads;
+}
+
 //used to read pages into memory
 void page_handler::readPage(long int pageID, void* buffer) {
+
+    thread_page_reads++;
     
     //opens page to be read from
     ifstream in(getPagePath(pageID), ios::binary);
@@ -160,7 +179,7 @@ b_plus_tree::b_plus_tree(const string& dir) : handler(dir) {
     handler.writePage(leaf_page_id, buffer, sizeof(disk_leaf_node));
 
     //root created as internal node in memory
-    internal_node * root_internal = new internal_node();
+    internal_node * root_internal = newInternalNode();
 
     //initialize memory values
     root_internal->is_leaf = 0;
@@ -172,6 +191,29 @@ b_plus_tree::b_plus_tree(const string& dir) : handler(dir) {
     //tree root set to newly created root
     root = root_internal;
 
+    //starts the background worker that replenishes sample buffers
+    worker = thread(&b_plus_tree::replenishWorker, this);
+
+}
+
+//stops the background worker, any nodes still queued are left as they are
+b_plus_tree::~b_plus_tree() {
+
+    {
+        lock_guard<mutex> lock(queue_latch);
+        stop_worker = true;
+    }
+
+    queue_signal.notify_all();
+
+    //the worker may be waiting on a query to let go of a buffer instead
+    {
+        lock_guard<mutex> lock(release_latch);
+    }
+    release_signal.notify_all();
+
+    if (worker.joinable())
+        worker.join();
 }
 
 //used to create a leaf node
@@ -219,9 +261,21 @@ inline bool b_plus_tree::isPointerValid(void* ptr) const {
     return (reinterpret_cast<uintptr_t>(ptr) & 0x8000000000000000) != 0;
 }
 
+//the active half starts at 0 or at SAMPLE_SIZE, depending on which half was swapped in last
+inline Record* b_plus_tree::activeSamples(internal_node* node) const {
+
+    return node->sample_buffer + node->active_half * SAMPLE_SIZE;
+}
+
 //used for inserts considered 
 void b_plus_tree::insert(int key, const Record& rec, bool build_mode) {
 
+    //inserts change sample buffers, so no query can be reading them
+    unique_lock<shared_mutex> write_lock(sample_latch);
+
+    //counts change, and nodes may split
+    structure_version++;
+
     //if no root, initialize one
     if (!root) {
         
@@ -233,7 +287,7 @@ void b_plus_tree::insert(int key, const Record& rec, bool build_mode) {
         int page_id = createDiskLeaf();
 
         //create root as an internal memory node
-        internal_node* new_root = new internal_node();
+        internal_node* new_root = newInternalNode();
         new_root->is_leaf = 0;
         new_root->numKeys = 0;
         new_root->children[0] = pageIDToPointer(page_id);
@@ -248,14 +302,18 @@ void b_plus_tree::insert(int key, const Record& rec, bool build_mode) {
     //pointer to newly creatd node
     void* new_child = nullptr;
 
+    //records, and their weight, that moved into new_child
+    long int new_child_count = 0;
+    double new_child_weight = 0;
+
     //calls recursive
-    insertRecursive(root, key, rec, promoted_key, new_child, build_mode);
+    insertRecursive(root, key, rec, promoted_key, new_child, new_child_count, new_child_weight, build_mode);
 
     //if root splits, create new internal, set root to new_root
     if (new_child) {
         
         //internal node instance, to serve as the root
-        internal_node* new_root = new internal_node();
+        internal_node* new_root = newInternalNode();
 
         //values initialized for the new root node
         new_root->is_leaf = 0;
@@ -264,6 +322,12 @@ void b_plus_tree::insert(int key, const Record& rec, bool build_mode) {
         new_root->children[0] = root;
         new_root->children[1] = new_child;
 
+        //the old root keeps what did not move into the new child
+        new_root->child_counts[0] = getSubtreeRecordCount(root);
+        new_root->child_counts[1] = new_child_count;
+        new_root->child_weights[0] = getSubtreeWeight(root);
+        new_root->child_weights[1] = new_child_weight;
+
         //sets root node
         root = new_root;
     }
@@ -271,7 +335,7 @@ void b_plus_tree::insert(int key, const Record& rec, bool build_mode) {
 
 //used for record insertion, splitting, and promoted key upward propagation
 //hybridized version
-void b_plus_tree::insertRecursive(void* node, int key, const Record& rec, int& promoted_key, void*& new_child, bool build_mode) {
+void b_plus_tree::insertRecursive(void* node, int key, const Record& rec, int& promoted_key, void*& new_child, long int& new_child_count, double& new_child_weight, bool build_mode) {
 
     //checks the node to see if it translates to a tagged pointer
     if (isPointerValid(node)) {
@@ -307,6 +371,8 @@ void b_plus_tree::insertRecursive(void* node, int key, const Record& rec, int& p
             //sets promote_key to -1
             promoted_key = -1;
             new_child = nullptr;
+            new_child_count = 0;
+            new_child_weight = 0;
 
         }
 
@@ -316,9 +382,17 @@ void b_plus_tree::insertRecursive(void* node, int key, const Record& rec, int& p
             //creates instance of new id
             long int new_page_id;
 
+            //record count and weight before the split, plus the new record
+            int record_total = leaf->record_num + 1;
+            double weight_total = leafWeight(*leaf) + samplingWeight(rec);
+
             //calls the split function to split the records
             splitDiskLeaf(*leaf, rec, promoted_key, new_page_id);
 
+            //whatever did not stay in the old leaf went to the new one
+            new_child_count = record_total - leaf->record_num;
+            new_child_weight = weight_total - leafWeight(*leaf);
+
             //writes record
             handler.writePage(page_id, buffer, sizeof(disk_leaf_node));
 
@@ -345,15 +419,25 @@ void b_plus_tree::insertRecursive(void* node, int key, const Record& rec, int& p
         //temporary pormoted key and new child to be inserted recursively
         int temp_key = -1;
         void* temp_child = nullptr;
-        insertRecursive(child, key, rec, temp_key, temp_child, build_mode);
+        long int temp_count = 0;
+        double temp_weight = 0;
+        insertRecursive(child, key, rec, temp_key, temp_child, temp_count, temp_weight, build_mode);
+
+        //the record went into child i, part of which may have been split off into temp_child
+        internal->child_counts[i] += 1 - temp_count;
+        internal->child_weights[i] += samplingWeight(rec) - temp_weight;
+
+        //weighted samples no longer match the subtree, they are rebuilt by buildWeightedSamples
+        internal->weighted_samples.clear();
 
         //if build mode insert isn't used, calls the update function
         if (!build_mode){
 
             long int subtree_size  = getSubtreeRecordCount(internal);
 
+            //the buffer is refilled by the background worker, so the insert does not wait on it
             if (internal->sample_count < SAMPLE_SIZE/2 && subtree_size > 2 * SAMPLE_SIZE) {
-                replenishSamples(internal);
+                scheduleReplenish(internal);
 
             }
 
@@ -371,16 +455,22 @@ void b_plus_tree::insertRecursive(void* node, int key, const Record& rec, int& p
                 for (int j = internal->numKeys; j > i; --j) {
                     internal->keys[j] = internal->keys[j - 1];
                     internal->children[j + 1] = internal->children[j];
+                    internal->child_counts[j + 1] = internal->child_counts[j];
+                    internal->child_weights[j + 1] = internal->child_weights[j];
                 }
 
                 //updates node information
                 internal->keys[i] = temp_key;
                 internal->children[i + 1] = temp_child;
+                internal->child_counts[i + 1] = temp_count;
+                internal->child_weights[i + 1] = temp_weight;
                 internal->numKeys++;
 
                 //updates promoted key and new child page accordingly
                 promoted_key = -1;
                 new_child = nullptr;
+                new_child_count = 0;
+                new_child_weight = 0;
 
 
             } 
@@ -389,7 +479,10 @@ void b_plus_tree::insertRecursive(void* node, int key, const Record& rec, int& p
             else {
 
                 //calls the function to split the internal node, and create new page internal
-                splitInternal(internal, temp_key, temp_child, promoted_key, new_child);
+                splitInternal(internal, temp_key, temp_child, temp_count, temp_weight, promoted_key, new_child);
+
+                new_child_count = getSubtreeRecordCount(new_child);
+                new_child_weight = getSubtreeWeight(new_child);
 
             }
 
@@ -399,6 +492,8 @@ void b_plus_tree::insertRecursive(void* node, int key, const Record& rec, int& p
         else {
             promoted_key = -1;
             new_child = nullptr;
+            new_child_count = 0;
+            new_child_weight = 0;
         }
     }
 
@@ -497,12 +592,16 @@ void b_plus_tree::splitLeaf(mem_leaf_node* old_node, const Record& record, int&
 }
 
 //used when internal node needs to be split
-void b_plus_tree::splitInternal(internal_node* old_node, int insert_key, void* insert_child, int& promoted_key, void*& new_node_ptr) {
+void b_plus_tree::splitInternal(internal_node* old_node, int insert_key, void* insert_child, long int insert_count, double insert_weight, int& promoted_key, void*& new_node_ptr) {
 
     //creates temporary array to hold all node keys and children, in addition to one more
     int keys[MAX_INTERNAL_KEYS + 1];
     void* children[MAX_INTERNAL_KEYS + 2];
 
+    //child counts and weights move along with their children
+    long int counts[MAX_INTERNAL_KEYS + 2];
+    double weights[MAX_INTERNAL_KEYS + 2];
+
     //loop to maintain key order, similar to how record order is maintained
     //i will record where new key is to go
     int i = 0;
@@ -520,13 +619,21 @@ void b_plus_tree::splitInternal(internal_node* old_node, int insert_key, void* i
     keys[i] = insert_key;
 
     //copies all child pointers up to and including child, insert new child pointer, fix remaining
-    for (int j = 0; j <= i; ++j)
+    for (int j = 0; j <= i; ++j) {
         children[j] = old_node->children[j];
+        counts[j] = old_node->child_counts[j];
+        weights[j] = old_node->child_weights[j];
+    }
 
     children[i + 1] = insert_child;
+    counts[i + 1] = insert_count;
+    weights[i + 1] = insert_weight;
 
-    for (int j = i + 1; j <= old_node->numKeys; ++j)
+    for (int j = i + 1; j <= old_node->numKeys; ++j) {
         children[j + 1] = old_node->children[j];
+        counts[j + 1] = old_node->child_counts[j];
+        weights[j + 1] = old_node->child_weights[j];
+    }
 
     //midpoint calculation, and key promotion based on it
     int mid = (MAX_INTERNAL_KEYS + 1) / 2;
@@ -538,11 +645,14 @@ void b_plus_tree::splitInternal(internal_node* old_node, int insert_key, void* i
         old_node->keys[j] = keys[j];
 
     //copies corresponding children for the left nde
-    for (int j = 0; j <= mid; ++j)
+    for (int j = 0; j <= mid; ++j) {
         old_node->children[j] = children[j];
+        old_node->child_counts[j] = counts[j];
+        old_node->child_weights[j] = weights[j];
+    }
 
     //create new right-hand internal node
-    internal_node* new_node = new internal_node();
+    internal_node* new_node = newInternalNode();
     new_node->numKeys = MAX_INTERNAL_KEYS - mid;
 
     //copies keys into new node
@@ -550,8 +660,11 @@ void b_plus_tree::splitInternal(internal_node* old_node, int insert_key, void* i
         new_node->keys[j] = keys[mid + 1 + j];
 
     //copies children into new node
-    for (int j = 0; j <= new_node->numKeys; ++j)
+    for (int j = 0; j <= new_node->numKeys; ++j) {
         new_node->children[j] = children[mid + 1 + j];
+        new_node->child_counts[j] = counts[mid + 1 + j];
+        new_node->child_weights[j] = weights[mid + 1 + j];
+    }
 
     //sets new node pointer to new node
     new_node_ptr = new_node;
@@ -660,8 +773,9 @@ void b_plus_tree::reenableAllRecordsInSubtree(void* node) {
 //Based on the modified SampleFirst query algorithm, provided via 
 //pseudocode algorithm 1 in Wang et al.
 
-//buggy and works with specific values
-vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
+//sample buffers are read through query-local cursors and are never consumed, so any number of
+//queries can run at once. Buffers are rotated by the background worker once they served enough queries
+vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k, query_budget* budget){
 
     //stores samples to be returned
     vector<Record> samples;
@@ -670,6 +784,20 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
     if (!root || k ==0)
         return samples;
 
+    //nodes whose buffers were read by this query, checked against the refresh policy at the end
+    vector<internal_node*> buffers_read;
+
+    //copy of the refresh policy, taken while holding the lock
+    int refresh_every = 0;
+
+    //scope of the shared lock, released before any rotation happens
+    {
+
+    //buffers are only read here, so queries only need a shared lock
+    shared_lock<shared_mutex> read_lock(sample_latch);
+
+    refresh_every = refresh_queries;
+
     //casts root pointer into a proper internal node
     //create internal node instance
     internal_node* root_internal = reinterpret_cast<internal_node*>(root);
@@ -680,11 +808,37 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
     
     Frontier.push_back(root_internal);
 
+    //query-local cursor into a sample buffer: the half it reads from, its count when the query started,
+    //random starting entry and how many entries were read. Holding on to the half means the query
+    //sees either the old or the new buffer, even if the worker swaps in a refill halfway through
+    struct buffer_cursor {
+
+        const Record* samples;
+        int count;
+        int half;
+        int start;
+        int consumed;
+    };
+    unordered_map<internal_node*, buffer_cursor> cursors;
+
+    //records rejected by this query, stored as page_id * MAX_LEAF_RECORDS + index. Replaces
+    //writing disabled flags back to the leaves, so a query never modifies the tree
+    unordered_set<long int> rejected;
+
+    //number of records rejected under each leaf parent, used to keep |P'(u)| correct
+    unordered_map<internal_node*, long int> rejected_count;
+
+    //random generator, one stream per thread as queries can run in parallel
+    xoshiro256& rand_gen = threadRng();
+
     //line 2
     //loops until all samples returned
     //if there are less available samples than wanted, then ends internally
     while (samples.size() < k) {
 
+        //out of time or page reads, returns what was found so far
+        if (budget && budget->check(samples.size()) != STOP_NONE)
+            break;
 
         //line 3
         //breaks if nothing in Frontier
@@ -700,25 +854,36 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
         //probability of selecting node u is proportional to the number of remaining
         //valid samples |P'(u)| in its subtree
         //initially, P'(u) is equal to Pu(u), the total points in subtree rooted at u
-        //for context, |P'(u)| = subtree size only including non-disabled records
+        //for context, |P'(u)| = subtree size minus the records this query rejected
+
+        //subtree sizes and |P'(u)| of every Frontier node, so each is only counted once
+        vector<long int> subtree_sizes(Frontier.size());
+        vector<long int> remaining(Frontier.size());
 
-        //get the total of all of the nodes non-disabled subtree sizes added together
+        //get the total of all of the nodes |P'(u)| added together
         long int total_subtree_nondisabled = 0;
 
         //iterates through Frontier
         for(size_t i = 0; i <Frontier.size(); i++) {
 
-            long int nondisabled_subtree_size = getNonDisabledSubtreeRecordCount(Frontier[i]);
-            total_subtree_nondisabled += nondisabled_subtree_size;
+            subtree_sizes[i] = getSubtreeRecordCount(Frontier[i]);
+            remaining[i] = subtree_sizes[i];
+
+            auto rejected_itr = rejected_count.find(Frontier[i]);
+            if (rejected_itr != rejected_count.end())
+                remaining[i] -= rejected_itr->second;
+
+            total_subtree_nondisabled += remaining[i];
 
         }
 
+        //everything left in the Frontier has been rejected
+        if (total_subtree_nondisabled <= 0)
+            break;
+
         //uses total_subtree_nondisabled size to get a uniform distribution from 1
         //basically, [1 - total_subtree_nondisabled]
-        uniform_int_distribution<> dist(1, total_subtree_nondisabled);
-
-        //random generator
-        static default_random_engine rand_gen (chrono::steady_clock::now().time_since_epoch().count());
+        uniform_int_distribution<long int> dist(1, total_subtree_nondisabled);
 
         //picks random value from random generator
         long int random_pick = dist(rand_gen);
@@ -726,6 +891,7 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
         //select node proportional to subtree size
         //creates internal node using buffer
         internal_node* u = nullptr;
+        long int u_subtree_size = 0;
        
         //used in selection
         long int cumulative = 0;
@@ -733,16 +899,55 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
         //iterates through for the selection
         for (size_t i = 0; i < Frontier.size(); i++){
 
-            cumulative += getNonDisabledSubtreeRecordCount(Frontier[i]);
+            cumulative += remaining[i];
 
             //see if the node is to be selected
             if(random_pick <= cumulative){
 
                 u = Frontier[i];
+                u_subtree_size = subtree_sizes[i];
                 break;
 
             }
         }
+
+        //a leaf parent keeps its place in the Frontier once this query has read through its buffer,
+        //as its records can then only be reached through its leaves
+        bool leaf_parent = isPointerValid(u->children[0]);
+
+        //cursor for u, created on first read with a random starting point
+        auto cursor_itr = cursors.find(u);
+        bool buffer_dry = false;
+
+        if (u_subtree_size > 2 * SAMPLE_SIZE) {
+
+            if (cursor_itr == cursors.end()) {
+
+                buffer_cursor cursor{};
+
+                //marks the active half as being read, so the worker leaves it alone until the query ends
+                {
+                    lock_guard<mutex> swap_guard(u->swap_latch);
+
+                    cursor.half = u->active_half;
+                    cursor.count = u->sample_count;
+                    cursor.samples = u->sample_buffer + cursor.half * SAMPLE_SIZE;
+                    u->half_readers[cursor.half]++;
+                }
+
+                if (cursor.count > 0)
+                    cursor.start = uniform_int_distribution<int>(0, cursor.count - 1)(rand_gen);
+
+                //buffer below the low watermark, the worker refills it while this query moves on to the children
+                if (cursor.count < SAMPLE_SIZE / 2)
+                    scheduleReplenish(u);
+
+                cursor_itr = cursors.emplace(u, cursor).first;
+                buffers_read.push_back(u);
+            }
+
+            buffer_dry = cursor_itr->second.consumed >= cursor_itr->second.count;
+        }
         
         //code below was directly adapted from Wang et al., it its illogical in practice
         //as unless it gets lucky in the first iteration from root, it will always report empty
@@ -789,17 +994,13 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
         //line 7
         //internal node without sample buffer case
         //assumed to be a leaf parent
-        long int u_subtree_size = getSubtreeRecordCount(u);
-
-        if (u_subtree_size <= 2 * SAMPLE_SIZE) {
+        if (u_subtree_size <= 2 * SAMPLE_SIZE || (leaf_parent && buffer_dry)) {
 
             //helper structure to track record location
             struct RecordLocator {
 
-                Record* rec;
-                int leaf_index;
-                long int page_id;
-                disk_leaf_node* leaf;
+                Record rec;
+                long int rejection_key;
             };
 
             //will store valid records
@@ -813,6 +1014,10 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
                 //check if child is an leaf node
                 if (isPointerValid(child)) {
 
+                    //a leaf parent can have up to 16 leaves to read, so the budget is checked before each of them
+                    if (budget && budget->check(samples.size()) != STOP_NONE)
+                        break;
+
                     //record the page_id
                     long int page_id = pointerToPageID(child);
 
@@ -821,16 +1026,22 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
                     handler.readPage(page_id, buffer);
                     disk_leaf_node* leaf = reinterpret_cast<disk_leaf_node*>(buffer);
 
-                    //records relevant information
+                    //records relevant information, skipping what this query already rejected
                     for (int j = 0; j < leaf->record_num; ++j) {
 
-                        if (!leaf->records[j].disabled) {
-                            candidates.push_back({&leaf->records[j], j, page_id, leaf});
+                        long int rejection_key = page_id * MAX_LEAF_RECORDS + j;
+
+                        if (rejected.count(rejection_key) == 0) {
+                            candidates.push_back({leaf->records[j], rejection_key});
                         }
                     }
                 }
             }
 
+            //out of budget partway through the leaves, a pick from some of them would not be uniform
+            if (budget && budget->reason() != STOP_NONE)
+                break;
+
             //if nothing found, or none of the children were leaves, remove u from Frontier        
             if (candidates.empty()) {
 
@@ -841,30 +1052,24 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
             //line 8
             //if made it past the empty check, randomly selects a record and saves
             //its relevant information
-            uniform_int_distribution<> dist_sample(0, candidates.size() - 1);
-            RecordLocator selected = candidates[dist_sample(rand_gen)];
-            Record& e = *(selected.rec);
+            uniform_int_distribution<size_t> dist_sample(0, candidates.size() - 1);
+            const RecordLocator& selected = candidates[dist_sample(rand_gen)];
+            const Record& e = selected.rec;
 
             //line 9
             //check if e is a valid sample
             if (e.hilbert >= low && e.hilbert <= high) {
-                cout << "adding a sample" <<e.hilbert << endl;
                 samples.push_back(e);
             } 
 
             
             //line 10
             else {
-        
-                //read in the leaf from disk using stored page_id
-                char buffer[PAGE_SIZE];
-                handler.readPage(selected.page_id, buffer);
-                disk_leaf_node* leaf = reinterpret_cast<disk_leaf_node*>(buffer);
 
                 //line 11
-                //disable the correct record and write back to the page
-                leaf->records[selected.leaf_index].disabled = true;
-                handler.writePage(selected.page_id, buffer, sizeof(disk_leaf_node));
+                //rejects the record for the rest of this query
+                rejected.insert(selected.rejection_key);
+                rejected_count[u]++;
             }
             
         }
@@ -908,34 +1113,26 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
 
         }*/
 
-        //error checking
-        else if (u_subtree_size > SAMPLE_SIZE * 2) {
+        //reads the buffer through the query's cursor, the buffer itself is left unchanged
+        else {
 
-            //empty buffer handler
-            if (u->sample_count == 0) {
-                Frontier.erase(std::remove(Frontier.begin(), Frontier.end(), u), Frontier.end());
-        
-                for (int i = 0; i <= u->numKeys; ++i) {
-                    if (!isPointerValid(u->children[i])) {
-                        internal_node* u_child = reinterpret_cast<internal_node*>(u->children[i]);
-                        Frontier.push_back(u_child);
-                    }
+            buffer_cursor& cursor = cursor_itr->second;
+
+            //samples buffer if this query has not read through it yet
+            if (!buffer_dry) {
+
+                Record e = cursor.samples[(cursor.start + cursor.consumed) % cursor.count];
+                cursor.consumed++;
+
+                if (e.hilbert >= low && e.hilbert <= high) {
+                    samples.push_back(e);
                 }
-        
-                //skips buffer
-                continue;  
-            }
-        
-            //samples buffer after empty confirmation
-            Record e = u->sample_buffer[u->sample_count - 1];
-            u->sample_count--;
-        
-            if (e.hilbert >= low && e.hilbert <= high) {
-                samples.push_back(e);
+
+                buffer_dry = cursor.consumed >= cursor.count;
             }
         
-            //if buffer is empty check, going off of the count
-            if (u->sample_count == 0) {
+            //if this query has read the whole buffer, continue from its children
+            if (buffer_dry && !leaf_parent) {
                 Frontier.erase(std::remove(Frontier.begin(), Frontier.end(), u), Frontier.end());
         
                 //adds children to Frontier
@@ -950,208 +1147,1575 @@ vector<Record> b_plus_tree::SampleFirstRS(int low, int high, size_t k){
 
     }
 
+    //the query is done reading, releases the halves it was reading from
+    for (auto& entry : cursors)
+        releaseHalf(entry.first, entry.second.half);
+
+    }
+
+    //got all k, or ran out of records
+    if (budget && budget->reason() == STOP_NONE)
+        budget->setReason(samples.size() >= k ? STOP_SAMPLES : STOP_EXHAUSTED);
+
+    //instead of replenishing every depleted buffer after each query, buffers that have
+    //served enough queries get a fraction of their samples rotated by the background worker
+    if (refresh_every > 0) {
 
-    //after samples reported, need to replenish depleted sample buffers
-    replenishSamples(root_internal);
+        for (internal_node* u : buffers_read) {
 
-    //re-enable records
+            if (u->queries_served.fetch_add(1) + 1 >= refresh_every) {
 
+                u->queries_served = 0;
+                u->rotation_due = true;
+                scheduleReplenish(u);
+            }
+        }
+    }
 
     return samples;
  
 }
 
+//count-augmented sampling: a uniform sample of [low, high] is the record at a uniformly random rank among
+//the records in range. The ranks are drawn up front and handed down the tree together, splitting them between
+//the children using their in-range counts, which gives k independent samples with no rejections
+vector<Record> b_plus_tree::RandomPathRS(int low, int high, size_t k) {
 
+    //stores samples to be returned
+    vector<Record> samples;
 
-//calls the remove recursive function, while setting merged status to false
-void b_plus_tree::remove(int key) {
-
-    //error checking addition
-    if (!root) 
-        return;
+    //prematurely ends if non-valid root, k is equal to 0, or the range is empty
+    if (!root || k == 0 || low > high)
+        return samples;
 
-    //same logic as in r-tree
-    bool merged = false;
+    //the tree is only read, so queries only need a shared lock
+    shared_lock<shared_mutex> read_lock(sample_latch);
 
-    //initially empty, should be populated with the deleted record info in recursive
-    Record deleted_record;
+    //partially covered leaves are read while counting, and reused when descending
+    leaf_cache cache;
 
-    removeRecursive(root, key, merged, deleted_record);
-}
+    //|P ∩ [low, high]|
+    long int total = rangeCountRecursive(root, low, high, LONG_MIN, LONG_MAX, cache);
 
-//main remove functionality, as it is down recursively
-void b_plus_tree::removeRecursive(void* node, int key, bool& merged, Record& deleted_record) {
+    if (total == 0)
+        return samples;
 
-    //if pointer is to a leaf, leaf node condition
-    if (isPointerValid(node)) {
+    //random generator, one stream per thread as queries can run in parallel
+    xoshiro256& rand_gen = threadRng();
 
-        //gets the page id from the leaf
-        int page_id = pointerToPageID(node);
+    //draws k ranks with replacement, sorted so that they can be split between children in one pass
+    vector<long int> ranks;
+    rand_gen.boundedBulk(total, k, ranks);
 
-        //creates buffer
-        char buffer[PAGE_SIZE];
-        
-        //reads in information from leaf
-        handler.readPage(page_id, buffer);
+    sort(ranks.begin(), ranks.end());
 
-        //create instance of leaf node
-        disk_leaf_node * leaf = reinterpret_cast<disk_leaf_node*>(buffer);
+    //walks down the tree once for the whole batch
+    samples.reserve(k);
+    randomPathDescend(root, low, high, LONG_MIN, LONG_MAX, ranks, samples, cache);
 
-        //find the index of the key that is to be removed
-        int i = 0;
-        while (i < leaf->record_num && leaf->records[i].hilbert < key)
-            i++;
+    //samples come out in hilbert order, shuffled so that any prefix is a uniform sample too
+    shuffle(samples.begin(), samples.end(), rand_gen);
 
-        //if the key exists, removed by shifting later records to the left
-        if (i < leaf->record_num && leaf->records[i].hilbert == key) {
+    return samples;
+}
 
-            //records the record to be deleted
-            deleted_record = leaf->records[i];
+//samples from a cover: the sorted ranks are handed to the pieces by their counts, a boundary piece resolves them
+//from its cached records and a fully covered subtree with the random-path descent, where every child is fully
+//inside too and so goes by its child count
+vector<Record> b_plus_tree::sampleCover(range_cover& cover, size_t k) {
 
-            //shift records left to remove
-            for (int j = i; j < leaf->record_num - 1; j++)
-                leaf->records[j] = leaf->records[j + 1];
-            
-            leaf->record_num--;
+    vector<Record> samples;
 
-            //writes page back to disk
-            handler.writePage(page_id, buffer, sizeof(disk_leaf_node));
+    if (!root || k == 0 || cover.low > cover.high)
+        return samples;
 
-        }
+    shared_lock<shared_mutex> read_lock(sample_latch);
 
+    leaf_cache cache;
+    refreshCover(cover, cache);
 
-        //deleting a leaf node should not trigger a merge
-        merged = false;
-        return;
-     
-    } 
-    
-    //internal node condition
-    else {
+    if (cover.total == 0)
+        return samples;
 
-        //create an internal node
-        internal_node* internal = reinterpret_cast<internal_node*>(node);
+    xoshiro256& rand_gen = threadRng();
 
-        //initial value
-        int i = 0;
+    vector<long int> ranks;
+    rand_gen.boundedBulk(cover.total, k, ranks);
 
-        //find the index of the key that is to be removed
-        while (i < internal->numKeys && key > internal->keys[i]) 
-            i++;
+    sort(ranks.begin(), ranks.end());
 
-        //recurse into the child that may contain
-        bool child_merged = false;
-        removeRecursive(internal->children[i], key, child_merged, deleted_record);
+    samples.reserve(k);
 
-        removeSample(internal, deleted_record);
-        
-        //eligibility test based off of |P(u)| ≤ 2s as mentioned in Wang et al.
-        long int subtree_size = getSubtreeRecordCount(internal);
+    size_t next = 0;
+    long int offset = 0;
 
+    for (const range_cover::piece& piece : cover.pieces) {
 
-        //check to see the if the internal node is eligible + needs replenishing after getting its buffer drained
-        if (internal->sample_count < SAMPLE_SIZE/2 && subtree_size > 2 * SAMPLE_SIZE) {
-            replenishSamples(internal);
+        if (next == ranks.size())
+            break;
 
+        vector<long int> piece_ranks;
+        while (next < ranks.size() && ranks[next] < offset + piece.count) {
+            piece_ranks.push_back(ranks[next] - offset);
+            next++;
         }
 
-        //if the child indicated that is was merged, was empitied
-        if (child_merged && i + 1 < internal->numKeys) {
-            
-            //remove the corresponding key and child pointer in the internal node
-            for (int j = i; j < internal->numKeys - 1; ++j) {
+        offset += piece.count;
 
-                internal->keys[j] = internal->keys[j + 1];
-                internal->children[j + 1] = internal->children[j + 2];
-            }
+        if (piece_ranks.empty())
+            continue;
 
-            //decrease the number of keys
-            internal->numKeys--;
+        if (piece.boundary) {
+            for (long int r : piece_ranks)
+                samples.push_back(piece.records[r]);
+        }
+        else {
+            randomPathDescend(piece.node, INT_MIN, INT_MAX, INT_MIN, INT_MAX, piece_ranks, samples, cache);
         }
-
-        //marked as merged
-        merged = (internal->numKeys == 0);
     }
+
+    //samples come out in hilbert order, shuffled so that any prefix is a uniform sample too
+    shuffle(samples.begin(), samples.end(), rand_gen);
+
+    return samples;
 }
 
+//number of records in the cover's range, taken from the cover, which is found first if it has to be
+long int b_plus_tree::coverCount(range_cover& cover) {
 
-/*sampling implementation*/
+    if (!root || cover.low > cover.high)
+        return 0;
 
-//public function to get the number of records in a node's subtree (children, grandchildren, etc)
-long int b_plus_tree::getSubtreeRecordCount(void* node){
+    shared_lock<shared_mutex> read_lock(sample_latch);
 
-    //empty tree error check
-    if (!root) {
+    leaf_cache cache;
+    refreshCover(cover, cache);
 
-        cout << "Tree is empty.\n";
-        return 1;
-    }
+    return cover.total;
+}
 
-    //calls actual counter, and returns total counter
-    long int total_records = recursiveNodeSubtreeCounter(node);
+//finds the cover again on its first use, or if the tree changed since it was found. Called under sample_latch
+void b_plus_tree::refreshCover(range_cover& cover, leaf_cache& cache) {
 
-    return total_records;
-    
-    
+    if (cover.version == structure_version)
+        return;
+
+    cover.pieces.clear();
+    cover.total = 0;
+    coverRecursive(root, cover.low, cover.high, LONG_MIN, LONG_MAX, cover, cache);
+    cover.version = structure_version;
 }
 
-//public function to get the number of NON-DISABLED records in node's subtree
-//used exclusively by the sample query function and is virtually identical
-long int b_plus_tree::getNonDisabledSubtreeRecordCount(void* node){
+//the same walk as rangeCountRecursive, keeping the fully covered children and boundary leaves it finds as pieces
+void b_plus_tree::coverRecursive(void* node, int low, int high, long int lower, long int upper, range_cover& cover, leaf_cache& cache) {
 
-    //empty tree error check
-    if (!root) {
+    //boundary leaf, its in-range records are kept
+    if (isPointerValid(node)) {
 
-        cout << "Tree is empty.\n";
-        return 1;
-    }
+        const vector<Record>& records = cachedLeaf(pointerToPageID(node), cache);
+        pair<size_t, size_t> in_range = inRangeSlice(records, low, high);
 
-    //calls the acutal counter, and returns total counter
-    long int total_non_disabled = recursiveNonDisabledSubtreeCounter(node);
+        long int count = in_range.second - in_range.first;
 
-    return total_non_disabled;
+        if (count > 0) {
+            cover.pieces.push_back({node, count, true, vector<Record>(records.begin() + in_range.first, records.begin() + in_range.second)});
+            cover.total += count;
+        }
 
-}
+        return;
+    }
 
-//recursively gets the count of all NON-DISABLED records in a node's subtree
-long int b_plus_tree::recursiveNonDisabledSubtreeCounter(void* node){
+    internal_node* internal = reinterpret_cast<internal_node*>(node);
 
-     //get direct count if leaf condition
-     if (isPointerValid(node)) {
+    for (int i = 0; i <= internal->numKeys; i++) {
 
-        //gets the page id, allocates buffer, reads from page
-        long int page_id = pointerToPageID(node);
-        char buffer[PAGE_SIZE];
-        handler.readPage(page_id, buffer);
+        long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+        long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
 
-        //creates instance of disk leaf to return record_num
-        disk_leaf_node * leaf = reinterpret_cast<disk_leaf_node*>(buffer);
-        
-        //iterates through the records and gets a count of only those not disabled
-        int valid_records_count = 0;
+        //outside of the range
+        if (child_upper < low || child_lower > high)
+            continue;
 
-        for (int i =0; i < leaf->record_num; i++) {
+        //fully inside of the range
+        if (child_lower >= low && child_upper <= high) {
 
-            //checks if not disabled
-            if (leaf->records[i].disabled == false)
-                valid_records_count++;
+            if (internal->child_counts[i] > 0) {
+                cover.pieces.push_back({internal->children[i], internal->child_counts[i], false, {}});
+                cover.total += internal->child_counts[i];
+            }
         }
 
-        return valid_records_count;
+        //on the boundary
+        else
+            coverRecursive(internal->children[i], low, high, child_lower, child_upper, cover, cache);
     }
+}
 
-    //internal condition, creates instance from node
-    internal_node * internal = reinterpret_cast<internal_node*>(node);
+//batched query: instead of k walks from the frontier, the k samples are split between the children of each
+//node with a multinomial draw on their in-range counts, and each child is visited once with its share.
+//A fully covered subtree with a big enough buffer takes its share from the buffer, and a leaf serves its
+//share with a single page read
+vector<Record> b_plus_tree::BatchMultinomialRS(int low, int high, size_t k) {
 
-    long int total_non_disabled =0;
+    //stores samples to be returned
+    vector<Record> samples;
 
-    //loops through all of its children to get count
-    for (int i = 0; i <= internal->numKeys; i++) {
+    //prematurely ends if non-valid root, k is equal to 0, or the range is empty
+    if (!root || k == 0 || low > high)
+        return samples;
 
-        total_non_disabled += recursiveNonDisabledSubtreeCounter(internal->children[i]);
-    }
+    //buffers read by this query, along with the half that was pinned
+    vector<pair<internal_node*, int>> pins;
 
-    return total_non_disabled;
+    {
+
+    //buffers and tree are only read here, so queries only need a shared lock
+    shared_lock<shared_mutex> read_lock(sample_latch);
+
+    leaf_cache cache;
+
+    //nothing in range, nothing to split
+    if (rangeCountRecursive(root, low, high, LONG_MIN, LONG_MAX, cache) == 0)
+        return samples;
+
+    samples.reserve(k);
+    batchDescend(root, low, high, LONG_MIN, LONG_MAX, k, samples, cache, pins);
+
+    //the query is done reading, releases the halves it was reading from
+    for (auto& pin : pins)
+        releaseHalf(pin.first, pin.second);
+
+    }
+
+    //samples come out grouped by subtree, shuffled so that any prefix is a uniform sample too
+    shuffle(samples.begin(), samples.end(), threadRng());
+
+    return samples;
+}
+
+//serves quota samples out of the in-range records of a node
+void b_plus_tree::batchDescend(void* node, int low, int high, long int lower, long int upper, long int quota,
+                               vector<Record>& out, leaf_cache& cache, vector<pair<internal_node*, int>>& pins) {
+
+    //random generator, one stream per thread as queries can run in parallel
+    xoshiro256& rand_gen = threadRng();
+
+    //leaf condition, one page read serves the whole quota
+    if (isPointerValid(node)) {
+
+        vector<Record> scratch;
+        const vector<Record>& records = leafRecords(pointerToPageID(node), cache, scratch);
+        pair<size_t, size_t> in_range = inRangeSlice(records, low, high);
+
+        if (in_range.first == in_range.second)
+            return;
+
+        size_t width = in_range.second - in_range.first;
+        for (long int i = 0; i < quota; i++)
+            out.push_back(records[in_range.first + rand_gen.bounded(width)]);
+
+        return;
+    }
+
+    //internal condition
+    internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+    //a fully covered subtree with an eligible buffer serves its quota from a random window of the buffer,
+    //which is a uniform sample of the subtree since the buffer is one
+    if (lower >= low && upper <= high && getSubtreeRecordCount(internal) > 2 * SAMPLE_SIZE) {
+
+        int half;
+        int count;
+        const Record* buffer_samples;
+
+        //marks the active half as being read, so the worker leaves it alone until the query ends
+        {
+            lock_guard<mutex> swap_guard(internal->swap_latch);
+
+            half = internal->active_half;
+            count = internal->sample_count;
+            buffer_samples = internal->sample_buffer + half * SAMPLE_SIZE;
+            internal->half_readers[half]++;
+        }
+
+        pins.push_back({internal, half});
+
+        //buffer below the low watermark, the worker refills it for the next queries
+        if (count < SAMPLE_SIZE / 2)
+            scheduleReplenish(internal);
+
+        if (count >= quota) {
+
+            int start = uniform_int_distribution<int>(0, count - 1)(rand_gen);
+
+            for (long int i = 0; i < quota; i++)
+                out.push_back(buffer_samples[(start + i) % count]);
+
+            return;
+        }
+    }
+
+    //in-range count of every child, the same way rangeCountRecursive gets it
+    int num_children = internal->numKeys + 1;
+    vector<long int> child_in_range(num_children, 0);
+    long int total = 0;
+
+    for (int i = 0; i < num_children; i++) {
+
+        long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+        long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
+
+        //outside of the range
+        if (child_upper < low || child_lower > high)
+            continue;
+
+        if (child_lower >= low && child_upper <= high)
+            child_in_range[i] = internal->child_counts[i];
+        else
+            child_in_range[i] = rangeCountRecursive(internal->children[i], low, high, child_lower, child_upper, cache);
+
+        total += child_in_range[i];
+    }
+
+    //multinomial split of the quota, drawn as a chain of binomials: each child gets Bin(left, count / remaining)
+    long int left = quota;
+
+    for (int i = 0; i < num_children && left > 0; i++) {
+
+        if (child_in_range[i] == 0)
+            continue;
+
+        long int share;
+        if (child_in_range[i] >= total)
+            share = left;
+        else
+            share = binomial_distribution<long int>(left, (double) child_in_range[i] / total)(rand_gen);
+
+        total -= child_in_range[i];
+        left -= share;
+
+        if (share > 0) {
+
+            long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+            long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
+
+            batchDescend(internal->children[i], low, high, child_lower, child_upper, share, out, cache, pins);
+        }
+    }
+}
+
+//online aggregation over a single hilbert range, every sample matches so COUNT comes straight from the counts
+online_aggregation b_plus_tree::aggregateRange(int low, int high, const record_field& field, const stop_condition& stop,
+                                               size_t batch_size, const aggregate_callback& on_batch, double confidence) {
+
+    return aggregateRanges({{low, high}}, field, nullptr, stop, batch_size, on_batch, confidence);
+}
+
+//online aggregation over several hilbert ranges. The cover of every range, and with it its exact count, is found
+//once, then samples are drawn in batches: each sample picks a range in proportion to its count and then a uniform
+//record of it from the range's cover, so the samples are uniform over the union of the ranges and a batch does not
+//go back through the root. The query runs until one of
+//the stop conditions is met, and the estimates are returned with the reason it stopped and what it cost
+online_aggregation b_plus_tree::aggregateRanges(const vector<pair<int, int>>& ranges, const record_field& field,
+                                                const record_predicate& predicate, const stop_condition& stop, size_t batch_size,
+                                                const aggregate_callback& on_batch, double confidence) {
+
+    //the counting pages are part of the query's cost
+    query_budget budget(stop, page_handler::threadPageReads);
+
+    //the cover of every range along with |P ∩ range|, reused by every batch
+    vector<range_cover> covers(ranges.size());
+    vector<long int> range_counts(ranges.size());
+    long int population = 0;
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+
+        covers[i].low = ranges[i].first;
+        covers[i].high = ranges[i].second;
+
+        range_counts[i] = coverCount(covers[i]);
+        population += range_counts[i];
+    }
+
+    online_aggregation aggregation(population, confidence, predicate != nullptr);
+
+    //nothing in range, the estimates are already exact
+    if (population == 0 || batch_size == 0) {
+        aggregation.finish(STOP_EXHAUSTED, budget.elapsedMs(), budget.pagesRead());
+        return aggregation;
+    }
+
+    xoshiro256& rand_gen = threadRng();
+    discrete_distribution<size_t> pick_range(range_counts.begin(), range_counts.end());
+
+    while (budget.check(aggregation.samples(), &aggregation) == STOP_NONE) {
+
+        //smaller batches as the time or page budget runs out
+        size_t batch = budget.nextBatch(batch_size, aggregation.samples());
+
+        //splits the batch between the ranges
+        vector<size_t> quotas(ranges.size(), 0);
+        for (size_t i = 0; i < batch; i++)
+            quotas[pick_range(rand_gen)]++;
+
+        size_t added = 0;
+
+        for (size_t i = 0; i < ranges.size(); i++) {
+
+            if (quotas[i] == 0)
+                continue;
+
+            vector<Record> samples = sampleCover(covers[i], quotas[i]);
+
+            for (const Record& rec : samples)
+                aggregation.add(field(rec), !predicate || predicate(rec));
+
+            added += samples.size();
+        }
+
+        //the records were removed in the meantime, nothing left to sample
+        if (added == 0) {
+            budget.setReason(STOP_EXHAUSTED);
+            break;
+        }
+
+        if (on_batch && !on_batch(aggregation)) {
+            budget.setReason(STOP_CALLBACK);
+            break;
+        }
+    }
+
+    aggregation.finish(budget.reason(), budget.elapsedMs(), budget.pagesRead());
+
+    return aggregation;
+}
+
+//online aggregation over a rectangle: the hilbert ranges of the grid cells it covers are sampled, and the
+//samples from the edge cells that fall outside of the rectangle count as non-matching
+online_aggregation b_plus_tree::aggregateRect(double lat_low, double lat_high, double lon_low, double lon_high,
+                                              double lat_min, double lat_max, double lon_min, double lon_max, int p,
+                                              const record_field& field, const stop_condition& stop, size_t batch_size,
+                                              const aggregate_callback& on_batch, double confidence) {
+
+    vector<pair<int, int>> ranges = hilbert_ranges_for_rect(lat_low, lat_high, lon_low, lon_high,
+                                                            lat_min, lat_max, lon_min, lon_max, p);
+
+    auto in_rect = [=](const Record& rec) {
+        return rec.lat >= lat_low && rec.lat <= lat_high && rec.lon >= lon_low && rec.lon <= lon_high;
+    };
+
+    return aggregateRanges(ranges, field, in_rect, stop, batch_size, on_batch, confidence);
+}
+
+//stratified sampling over a grid of cells. Every cell is a stratum, sampled uniformly through the hilbert ranges
+//covering it, with the samples that land outside of the cell rejected (an edge cell of the hilbert grid can
+//straddle two cells of the viewport). The cells are first brought up to the minimum (the pilot), then the rest
+//of the samples are allocated, and each phase draws for all of the cells with one multiSample call per round,
+//so a leaf shared by neighbouring cells is read once. Rounds repeat with more draws for cells that had
+//rejections, up to a few rounds, after which a cell with (almost) nothing inside keeps what it got
+vector<grid_stratum> b_plus_tree::stratifiedSample(double lat_low, double lat_high, double lon_low, double lon_high, int rows, int cols,
+                                                   double lat_min, double lat_max, double lon_min, double lon_max, int p,
+                                                   size_t total_k, size_t min_per_cell, allocation_mode allocation,
+                                                   const record_field& field, double confidence) {
+
+    vector<grid_stratum> strata;
+
+    if (rows <= 0 || cols <= 0 || lat_low > lat_high || lon_low > lon_high)
+        return strata;
+
+    double lat_step = (lat_high - lat_low) / rows;
+    double lon_step = (lon_high - lon_low) / cols;
+
+    //the cells, their covering hilbert ranges and the counts of those
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+
+            grid_stratum stratum;
+
+            stratum.row = row;
+            stratum.col = col;
+            stratum.lat_low = lat_low + row * lat_step;
+            stratum.lat_high = (row == rows - 1) ? lat_high : lat_low + (row + 1) * lat_step;
+            stratum.lon_low = lon_low + col * lon_step;
+            stratum.lon_high = (col == cols - 1) ? lon_high : lon_low + (col + 1) * lon_step;
+
+            stratum.ranges = hilbert_ranges_for_rect(stratum.lat_low, stratum.lat_high, stratum.lon_low, stratum.lon_high,
+                                                     lat_min, lat_max, lon_min, lon_max, p);
+
+            for (const auto& range : stratum.ranges) {
+
+                stratum.range_counts.push_back(rangeCount(range.first, range.second));
+                stratum.population += stratum.range_counts.back();
+            }
+
+            stratum.estimates = online_aggregation(stratum.population, confidence, true);
+            strata.push_back(move(stratum));
+        }
+    }
+
+    //whether a record is in a cell, with the same half open bounds as the cells
+    auto in_cell = [&](const Record& rec, const grid_stratum& stratum) {
+
+        if (rec.lat < lat_low || rec.lat > lat_high || rec.lon < lon_low || rec.lon > lon_high)
+            return false;
+
+        //a flat viewport puts everything in the first row or column, checked before dividing by the 0 step
+        int row = (lat_step > 0) ? min((int) ((rec.lat - lat_low) / lat_step), rows - 1) : 0;
+        int col = (lon_step > 0) ? min((int) ((rec.lon - lon_low) / lon_step), cols - 1) : 0;
+
+        return row == stratum.row && col == stratum.col;
+    };
+
+    xoshiro256& rand_gen = threadRng();
+
+    //draws until every cell has quota in-cell samples, or the rounds run out
+    auto fill = [&]() {
+
+        const int max_rounds = 8;
+
+        for (int round = 0; round < max_rounds; round++) {
+
+            vector<sample_request> requests;
+            vector<size_t> owners;
+
+            for (size_t s = 0; s < strata.size(); s++) {
+
+                grid_stratum& stratum = strata[s];
+
+                if (stratum.population == 0 || stratum.samples.size() >= stratum.quota)
+                    continue;
+
+                //draws enough to expect the missing samples after rejections, assuming at least 1 in 16 is kept
+                size_t missing = stratum.quota - stratum.samples.size();
+                size_t drawn = stratum.estimates.samples();
+                double acceptance = (drawn == 0) ? 1.0 : max((double) stratum.samples.size() / drawn, 1.0 / 16);
+                long int draws = (long int) ceil(missing / acceptance);
+
+                //splits the draws between the cell's ranges by their counts, as a chain of binomials
+                long int left_count = stratum.population;
+
+                for (size_t i = 0; i < stratum.ranges.size() && draws > 0; i++) {
+
+                    if (stratum.range_counts[i] == 0)
+                        continue;
+
+                    long int share;
+                    if (stratum.range_counts[i] >= left_count)
+                        share = draws;
+                    else
+                        share = binomial_distribution<long int>(draws, (double) stratum.range_counts[i] / left_count)(rand_gen);
+
+                    left_count -= stratum.range_counts[i];
+                    draws -= share;
+
+                    if (share > 0) {
+                        requests.push_back({stratum.ranges[i].first, stratum.ranges[i].second, (size_t) share});
+                        owners.push_back(s);
+                    }
+                }
+            }
+
+            //every cell is full
+            if (requests.empty())
+                return;
+
+            vector<vector<Record>> results = multiSample(requests);
+
+            for (size_t q = 0; q < results.size(); q++) {
+
+                grid_stratum& stratum = strata[owners[q]];
+
+                //every draw goes into the estimates, but the cell only keeps its quota of in-cell samples. The draws
+                //are independent, so the first quota of them inside of the cell are still uniform over its records
+                for (const Record& rec : results[q]) {
+
+                    bool inside = in_cell(rec, stratum);
+                    stratum.estimates.add(field ? field(rec) : 1.0, inside);
+
+                    if (inside && stratum.samples.size() < stratum.quota)
+                        stratum.samples.push_back(rec);
+                }
+            }
+        }
+    };
+
+    //pilot, the minimum per cell. Neyman needs a few samples per cell for the deviations
+    size_t pilot = (allocation == ALLOC_NEYMAN) ? max(min_per_cell, (size_t) 8) : min_per_cell;
+    size_t cells = 0;
+
+    for (grid_stratum& stratum : strata) {
+
+        if (stratum.population > 0) {
+            stratum.quota = pilot;
+            cells++;
+        }
+    }
+
+    fill();
+
+    size_t assigned = pilot * cells;
+
+    if (cells == 0 || total_k <= assigned)
+        return strata;
+
+    //allocation weight of every cell
+    double z = normalQuantile(confidence);
+    vector<double> weights(strata.size(), 0);
+    double weight_total = 0;
+
+    for (size_t s = 0; s < strata.size(); s++) {
+
+        const grid_stratum& stratum = strata[s];
+
+        if (stratum.population == 0)
+            continue;
+
+        if (allocation == ALLOC_UNIFORM)
+            weights[s] = 1;
+
+        //the pilot's in-cell count estimate
+        else if (allocation == ALLOC_PROPORTIONAL)
+            weights[s] = stratum.estimates.count().value;
+
+        //N_h * S_h is the deviation of the expanded values N_h * x, which is the SUM's standard error times sqrt(n)
+        else {
+            aggregate_estimate estimate = field ? stratum.estimates.sum() : stratum.estimates.count();
+            if (!estimate.exact && isfinite(estimate.halfWidth()))
+                weights[s] = estimate.halfWidth() / z * sqrt((double) estimate.samples);
+        }
+
+        weight_total += weights[s];
+    }
+
+    //no deviation anywhere (for example, a constant field), falls back on the cell sizes
+    if (weight_total <= 0) {
+
+        for (size_t s = 0; s < strata.size(); s++) {
+            weights[s] = max((double) strata[s].population, 0.0);
+            weight_total += weights[s];
+        }
+    }
+
+    //rounds down, then hands out what is left to the largest remainders
+    size_t rest = total_k - assigned;
+    size_t handed_out = 0;
+    vector<pair<double, size_t>> remainders;
+
+    for (size_t s = 0; s < strata.size(); s++) {
+
+        if (weights[s] <= 0)
+            continue;
+
+        double share = rest * weights[s] / weight_total;
+
+        strata[s].quota += (size_t) share;
+        handed_out += (size_t) share;
+        remainders.push_back({share - floor(share), s});
+    }
+
+    sort(remainders.rbegin(), remainders.rend());
+
+    for (size_t i = 0; i < remainders.size() && handed_out < rest; i++, handed_out++)
+        strata[remainders[i].second].quota++;
+
+    fill();
+
+    return strata;
+}
+
+//sample stream constructor, nothing is drawn until the first call to next
+sample_stream::sample_stream(b_plus_tree& tree, int low, int high, size_t max_batch)
+    : tree(tree), max_batch(max(max_batch, (size_t) 1)) {
+
+    cover.low = low;
+    cover.high = high;
+}
+
+//hands out the next pending sample, drawing a new batch when there is none left
+bool sample_stream::next(Record& out) {
+
+    if (position == pending.size()) {
+
+        pending = tree.sampleCover(cover, batch);
+        position = 0;
+
+        //nothing in the range (anymore)
+        if (pending.empty())
+            return false;
+
+        batch = min(batch * 2, max_batch);
+    }
+
+    out = pending[position++];
+    handed_out++;
+
+    return true;
+}
+
+//multi-query sampling: every query draws its own sorted ranks over its own in-range count, as in
+//RandomPathRS, but all of them are resolved in a single walk down the tree. Queries over nearby ranges share
+//the internal nodes and leaves on their paths, which are visited (and read) once for the whole batch, while the
+//ranks, and so the samples, of each query stay independent of the others
+vector<vector<Record>> b_plus_tree::multiSample(const vector<sample_request>& requests) {
+
+    vector<vector<Record>> results(requests.size());
+
+    if (!root || requests.empty())
+        return results;
+
+    //one shared lock for the whole batch
+    shared_lock<shared_mutex> read_lock(sample_latch);
+
+    //boundary leaves read while counting, shared between the queries
+    leaf_cache cache;
+
+    xoshiro256& rand_gen = threadRng();
+
+    vector<query_ranks> active;
+
+    for (size_t q = 0; q < requests.size(); q++) {
+
+        const sample_request& request = requests[q];
+
+        if (request.k == 0 || request.low > request.high)
+            continue;
+
+        long int total = rangeCountRecursive(root, request.low, request.high, LONG_MIN, LONG_MAX, cache);
+
+        if (total == 0)
+            continue;
+
+        //k ranks with replacement, sorted so they can be split between children in one pass
+        query_ranks query;
+        query.query = q;
+        rand_gen.boundedBulk(total, request.k, query.ranks);
+
+        sort(query.ranks.begin(), query.ranks.end());
+
+        results[q].reserve(request.k);
+        active.push_back(move(query));
+    }
+
+    if (!active.empty())
+        multiDescend(root, LONG_MIN, LONG_MAX, requests, active, results, cache);
+
+    //each query's samples come out in hilbert order, shuffled so that any prefix is a uniform sample too
+    for (auto& samples : results)
+        shuffle(samples.begin(), samples.end(), rand_gen);
+
+    return results;
+}
+
+//walks a node once for all of the queries that have ranks below it
+void b_plus_tree::multiDescend(void* node, long int lower, long int upper, const vector<sample_request>& requests,
+                               const vector<query_ranks>& active, vector<vector<Record>>& out, leaf_cache& cache) {
+
+    //leaf condition, one read serves every query
+    if (isPointerValid(node)) {
+
+        vector<Record> scratch;
+        const vector<Record>& records = leafRecords(pointerToPageID(node), cache, scratch);
+
+        for (const query_ranks& query : active) {
+
+            size_t first = inRangeSlice(records, requests[query.query].low, requests[query.query].high).first;
+
+            for (long int r : query.ranks)
+                out[query.query].push_back(records[first + r]);
+        }
+
+        return;
+    }
+
+    //internal condition
+    internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+    //per query, the first rank not handed to a child yet and the in-range records before the child
+    vector<size_t> next(active.size(), 0);
+    vector<long int> offset(active.size(), 0);
+
+    for (int i = 0; i <= internal->numKeys; i++) {
+
+        long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+        long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
+
+        //ranks of every query that fall into this child
+        vector<query_ranks> child_active;
+
+        for (size_t a = 0; a < active.size(); a++) {
+
+            const vector<long int>& ranks = active[a].ranks;
+            int low = requests[active[a].query].low;
+            int high = requests[active[a].query].high;
+
+            if (next[a] == ranks.size() || child_upper < low || child_lower > high)
+                continue;
+
+            //in-range count of the child for this query
+            long int child_in_range;
+            if (child_lower >= low && child_upper <= high)
+                child_in_range = internal->child_counts[i];
+            else
+                child_in_range = rangeCountRecursive(internal->children[i], low, high, child_lower, child_upper, cache);
+
+            query_ranks child_query;
+            child_query.query = active[a].query;
+
+            while (next[a] < ranks.size() && ranks[next[a]] < offset[a] + child_in_range) {
+                child_query.ranks.push_back(ranks[next[a]] - offset[a]);
+                next[a]++;
+            }
+
+            offset[a] += child_in_range;
+
+            if (!child_query.ranks.empty())
+                child_active.push_back(move(child_query));
+        }
+
+        if (!child_active.empty())
+            multiDescend(internal->children[i], child_lower, child_upper, requests, child_active, out, cache);
+    }
+}
+
+//weighted sampling: the same batched descent as BatchMultinomialRS, but the quota of a node is split
+//between its children by their in-range weight instead of their in-range count, and a leaf picks its records
+//with probability proportional to their weight. Fully covered subtrees can serve their share from their
+//weighted buffer, which is a weighted sample of the subtree
+vector<Record> b_plus_tree::WeightedSampleRS(int low, int high, size_t k, bool use_buffers) {
+
+    //stores samples to be returned
+    vector<Record> samples;
+
+    //prematurely ends if non-valid root, k is equal to 0, or the range is empty
+    if (!root || k == 0 || low > high)
+        return samples;
+
+    //the weighted buffers are only changed under the unique lock, so they need no pinning
+    shared_lock<shared_mutex> read_lock(sample_latch);
+
+    leaf_cache cache;
+
+    //nothing (with any weight) in range
+    if (rangeWeightRecursive(root, low, high, LONG_MIN, LONG_MAX, cache) <= 0)
+        return samples;
+
+    samples.reserve(k);
+    weightedDescend(root, low, high, LONG_MIN, LONG_MAX, k, use_buffers, samples, cache);
+
+    //samples come out grouped by subtree, shuffled so that any prefix is a weighted sample too
+    shuffle(samples.begin(), samples.end(), threadRng());
+
+    return samples;
+}
+
+//serves quota weighted samples out of the in-range records of a node
+void b_plus_tree::weightedDescend(void* node, int low, int high, long int lower, long int upper, long int quota,
+                                  bool use_buffers, vector<Record>& out, leaf_cache& cache) {
+
+    xoshiro256& rand_gen = threadRng();
+
+    //leaf condition, one page read serves the whole quota
+    if (isPointerValid(node)) {
+
+        vector<Record> scratch;
+        const vector<Record>& records = leafRecords(pointerToPageID(node), cache, scratch);
+        pair<size_t, size_t> in_range = inRangeSlice(records, low, high);
+
+        //running weight of the in-range records, a record is picked by where a uniform position falls
+        vector<double> prefix;
+        double total = 0;
+
+        for (size_t i = in_range.first; i < in_range.second; i++) {
+            total += samplingWeight(records[i]);
+            prefix.push_back(total);
+        }
+
+        if (total <= 0)
+            return;
+
+        for (long int i = 0; i < quota; i++) {
+
+            size_t pick = upper_bound(prefix.begin(), prefix.end(), rand_gen.uniform() * total) - prefix.begin();
+            out.push_back(records[in_range.first + min(pick, prefix.size() - 1)]);
+        }
+
+        return;
+    }
+
+    //internal condition
+    internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+    //a fully covered subtree with a weighted buffer serves its quota from a random window of it
+    if (use_buffers && lower >= low && upper <= high && (long int) internal->weighted_samples.size() >= quota) {
+
+        size_t count = internal->weighted_samples.size();
+        size_t start = rand_gen.bounded(count);
+
+        for (long int i = 0; i < quota; i++)
+            out.push_back(internal->weighted_samples[(start + i) % count]);
+
+        return;
+    }
+
+    //in-range weight of every child
+    int num_children = internal->numKeys + 1;
+    vector<double> child_in_range(num_children, 0);
+    double total = 0;
+
+    for (int i = 0; i < num_children; i++) {
+
+        long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+        long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
+
+        //outside of the range
+        if (child_upper < low || child_lower > high)
+            continue;
+
+        if (child_lower >= low && child_upper <= high)
+            child_in_range[i] = internal->child_weights[i];
+        else
+            child_in_range[i] = rangeWeightRecursive(internal->children[i], low, high, child_lower, child_upper, cache);
+
+        child_in_range[i] = max(child_in_range[i], 0.0);
+        total += child_in_range[i];
+    }
+
+    //multinomial split of the quota by weight, as a chain of binomials
+    long int left = quota;
+
+    for (int i = 0; i < num_children && left > 0; i++) {
+
+        if (child_in_range[i] <= 0)
+            continue;
+
+        long int share;
+        if (child_in_range[i] >= total)
+            share = left;
+        else
+            share = binomial_distribution<long int>(left, child_in_range[i] / total)(rand_gen);
+
+        total -= child_in_range[i];
+        left -= share;
+
+        if (share > 0) {
+
+            long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+            long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
+
+            weightedDescend(internal->children[i], low, high, child_lower, child_upper, share, use_buffers, out, cache);
+        }
+    }
+}
+
+//total weight of the records in [low, high]
+double b_plus_tree::rangeWeight(int low, int high) {
+
+    if (!root || low > high)
+        return 0;
+
+    shared_lock<shared_mutex> read_lock(sample_latch);
+
+    leaf_cache cache;
+    return rangeWeightRecursive(root, low, high, LONG_MIN, LONG_MAX, cache);
+}
+
+//rangeCountRecursive with weights, children fully inside the range use their child weight
+double b_plus_tree::rangeWeightRecursive(void* node, int low, int high, long int lower, long int upper, leaf_cache& cache) {
+
+    //leaf condition, reads the page once and adds up the weights of the records in range
+    if (isPointerValid(node)) {
+
+        const vector<Record>& records = cachedLeaf(pointerToPageID(node), cache);
+        pair<size_t, size_t> in_range = inRangeSlice(records, low, high);
+
+        double total = 0;
+        for (size_t i = in_range.first; i < in_range.second; i++)
+            total += samplingWeight(records[i]);
+
+        return total;
+    }
+
+    //internal condition
+    internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+    double total = 0;
+
+    for (int i = 0; i <= internal->numKeys; i++) {
+
+        long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+        long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
+
+        //outside of the range
+        if (child_upper < low || child_lower > high)
+            continue;
+
+        //fully inside of the range
+        if (child_lower >= low && child_upper <= high)
+            total += internal->child_weights[i];
+
+        //on the boundary
+        else
+            total += rangeWeightRecursive(internal->children[i], low, high, child_lower, child_upper, cache);
+    }
+
+    return total;
+}
+
+//online aggregation from weighted samples over [low, high]. Every sample stands for W / w records
+//(Hansen-Hurwitz), so SUM and COUNT are unbiased, and AVG is their ratio. The buffers are not used here,
+//so that the samples of different batches stay independent
+online_aggregation b_plus_tree::aggregateRangeWeighted(int low, int high, const record_field& field, const stop_condition& stop,
+                                                       size_t batch_size, const aggregate_callback& on_batch, double confidence) {
+
+    query_budget budget(stop, page_handler::threadPageReads);
+
+    online_aggregation aggregation = online_aggregation::weighted(rangeWeight(low, high), confidence);
+
+    while (budget.check(aggregation.samples(), &aggregation) == STOP_NONE) {
+
+        size_t batch = budget.nextBatch(max(batch_size, (size_t) 1), aggregation.samples());
+        vector<Record> samples = WeightedSampleRS(low, high, batch, false);
+
+        //nothing with any weight in range
+        if (samples.empty()) {
+            budget.setReason(STOP_EXHAUSTED);
+            break;
+        }
+
+        for (const Record& rec : samples)
+            aggregation.addWeighted(field(rec), rec.weight);
+
+        if (on_batch && !on_batch(aggregation)) {
+            budget.setReason(STOP_CALLBACK);
+            break;
+        }
+    }
+
+    aggregation.finish(budget.reason(), budget.elapsedMs(), budget.pagesRead());
+
+    return aggregation;
+}
+
+//picks the sampling engine for a query
+vector<Record> b_plus_tree::sample(int low, int high, size_t k, sampling_mode mode) {
+
+    if (mode == RANDOM_PATH)
+        return RandomPathRS(low, high, k);
+
+    if (mode == BATCH_MULTINOMIAL)
+        return BatchMultinomialRS(low, high, k);
+
+    return SampleFirstRS(low, high, k);
+}
+
+//exact count of the records in [low, high]
+long int b_plus_tree::rangeCount(int low, int high) {
+
+    if (!root || low > high)
+        return 0;
+
+    shared_lock<shared_mutex> read_lock(sample_latch);
+
+    leaf_cache cache;
+    return rangeCountRecursive(root, low, high, LONG_MIN, LONG_MAX, cache);
+}
+
+//records of a leaf, read once per query and kept in the cache, since the boundary leaves are needed again
+//when descending (and by every query of a multi-query batch)
+const vector<Record>& b_plus_tree::cachedLeaf(long int page_id, leaf_cache& cache) {
+
+    auto cached = cache.find(page_id);
+    if (cached != cache.end())
+        return cached->second;
+
+    char buffer[PAGE_SIZE];
+    handler.readPage(page_id, buffer);
+    disk_leaf_node* leaf = reinterpret_cast<disk_leaf_node*>(buffer);
+
+    vector<Record>& records = cache[page_id];
+    records.assign(leaf->records, leaf->records + leaf->record_num);
+
+    return records;
+}
+
+//records of a leaf that is only visited once, from the cache if it was already read, otherwise
+//read into scratch so that the cache does not grow with every leaf a big sample touches
+const vector<Record>& b_plus_tree::leafRecords(long int page_id, leaf_cache& cache, vector<Record>& scratch) {
+
+    auto cached = cache.find(page_id);
+    if (cached != cache.end())
+        return cached->second;
+
+    char buffer[PAGE_SIZE];
+    handler.readPage(page_id, buffer);
+    disk_leaf_node* leaf = reinterpret_cast<disk_leaf_node*>(buffer);
+
+    scratch.assign(leaf->records, leaf->records + leaf->record_num);
+
+    return scratch;
+}
+
+//leaf records are sorted by hilbert value, so the ones in [low, high] are the slice [first, second)
+pair<size_t, size_t> b_plus_tree::inRangeSlice(const vector<Record>& records, int low, int high) {
+
+    auto first = lower_bound(records.begin(), records.end(), low,
+                             [](const Record& rec, int key) { return rec.hilbert < key; });
+    auto last = upper_bound(first, records.end(), high,
+                            [](int key, const Record& rec) { return key < rec.hilbert; });
+
+    return {first - records.begin(), last - records.begin()};
+}
+
+//counts the records of a node in [low, high]. Children fully inside the range use their child count,
+//children outside of it are skipped, so only the children on the two boundary paths are visited
+long int b_plus_tree::rangeCountRecursive(void* node, int low, int high, long int lower, long int upper, leaf_cache& cache) {
+
+    //leaf condition, reads the page once and counts the records that are in range
+    if (isPointerValid(node)) {
+
+        pair<size_t, size_t> in_range = inRangeSlice(cachedLeaf(pointerToPageID(node), cache), low, high);
+
+        return in_range.second - in_range.first;
+    }
+
+    //internal condition
+    internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+    long int total = 0;
+
+    for (int i = 0; i <= internal->numKeys; i++) {
+
+        //key bounds of the child, inclusive since duplicates of a key can end up on both sides of it
+        long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+        long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
+
+        //outside of the range
+        if (child_upper < low || child_lower > high)
+            continue;
+
+        //fully inside of the range
+        if (child_lower >= low && child_upper <= high)
+            total += internal->child_counts[i];
+
+        //on the boundary
+        else
+            total += rangeCountRecursive(internal->children[i], low, high, child_lower, child_upper, cache);
+    }
+
+    return total;
+}
+
+//splits the sorted ranks between the children of a node by their in-range counts, and resolves
+//them at the leaves. Every leaf is read once no matter how many ranks land in it
+void b_plus_tree::randomPathDescend(void* node, int low, int high, long int lower, long int upper,
+                                    const vector<long int>& ranks, vector<Record>& out, leaf_cache& cache) {
+
+    //leaf condition, a rank is the position among the leaf's in-range records
+    if (isPointerValid(node)) {
+
+        vector<Record> scratch;
+        const vector<Record>& records = leafRecords(pointerToPageID(node), cache, scratch);
+        size_t first = inRangeSlice(records, low, high).first;
+
+        for (long int r : ranks)
+            out.push_back(records[first + r]);
+
+        return;
+    }
+
+    //internal condition
+    internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+    //first rank that has not been handed to a child yet, and the number of in-range records before the child
+    size_t next = 0;
+    long int offset = 0;
+
+    for (int i = 0; i <= internal->numKeys && next < ranks.size(); i++) {
+
+        long int child_lower = (i == 0) ? lower : internal->keys[i - 1];
+        long int child_upper = (i == internal->numKeys) ? upper : internal->keys[i];
+
+        //outside of the range
+        if (child_upper < low || child_lower > high)
+            continue;
+
+        //in-range count of the child, the same way rangeCountRecursive gets it
+        long int child_in_range;
+        if (child_lower >= low && child_upper <= high)
+            child_in_range = internal->child_counts[i];
+        else
+            child_in_range = rangeCountRecursive(internal->children[i], low, high, child_lower, child_upper, cache);
+
+        //ranks that fall into this child, relative to the child
+        vector<long int> child_ranks;
+        while (next < ranks.size() && ranks[next] < offset + child_in_range) {
+            child_ranks.push_back(ranks[next] - offset);
+            next++;
+        }
+
+        if (!child_ranks.empty())
+            randomPathDescend(internal->children[i], low, high, child_lower, child_upper, child_ranks, out, cache);
+
+        offset += child_in_range;
+    }
+}
+
+//changes the refresh policy, a value of 0 for every_n_queries turns rotation off
+void b_plus_tree::setSampleRefreshPolicy(int every_n_queries, double fraction) {
+
+    unique_lock<shared_mutex> write_lock(sample_latch);
+
+    refresh_queries = every_n_queries;
+    refresh_fraction = fraction;
+}
+
+//rotates the given fraction of all of the sample buffers, for when fresh samples are needed right away.
+//The sample latch is held exclusively the whole time, so every query waits until it is done
+void b_plus_tree::refreshSampleBuffers(double fraction) {
+
+    if (!root)
+        return;
+
+    unique_lock<shared_mutex> write_lock(sample_latch);
+
+    //the internal nodes are walked in memory, but every rotation draws its new samples down to the leaves, so
+    //this reads a leaf page for every sample it replaces, all of it under the exclusive latch
+    queue<internal_node*> q;
+    q.push(reinterpret_cast<internal_node*>(root));
+
+    while (!q.empty()) {
+
+        internal_node* node = q.front();
+        q.pop();
+
+        //only nodes that are eligible have a buffer
+        if (node->sample_count > 0) {
+            node->queries_served = 0;
+            rotateSampleBuffer(node, fraction);
+        }
+
+        for (int i = 0; i <= node->numKeys; ++i) {
+            if (!isPointerValid(node->children[i]))
+                q.push(reinterpret_cast<internal_node*>(node->children[i]));
+        }
+    }
+}
+
+
+//copies the active half of every buffer, walking the internal nodes the same way as refreshSampleBuffers
+vector<b_plus_tree::buffer_copy> b_plus_tree::bufferSnapshot() {
+
+    vector<buffer_copy> buffers;
+
+    if (!root)
+        return buffers;
+
+    shared_lock<shared_mutex> read_lock(sample_latch);
+
+    //the nodes along with the bounds of their keys, as in coverRecursive
+    queue<pair<internal_node*, buffer_copy>> q;
+    q.push({reinterpret_cast<internal_node*>(root), {LONG_MIN, LONG_MAX, 0, {}}});
+
+    while (!q.empty()) {
+
+        internal_node* node = q.front().first;
+        buffer_copy copy = move(q.front().second);
+        q.pop();
+
+        copy.records = getSubtreeRecordCount(node);
+
+        //the worker may be swapping the halves
+        {
+            lock_guard<mutex> swap_guard(node->swap_latch);
+            copy.samples.assign(activeSamples(node), activeSamples(node) + node->sample_count);
+        }
+
+        for (int i = 0; i <= node->numKeys; ++i) {
+
+            if (isPointerValid(node->children[i]))
+                continue;
+
+            long int child_lower = (i == 0) ? copy.lower : node->keys[i - 1];
+            long int child_upper = (i == node->numKeys) ? copy.upper : node->keys[i];
+
+            q.push({reinterpret_cast<internal_node*>(node->children[i]), {child_lower, child_upper, 0, {}}});
+        }
+
+        buffers.push_back(move(copy));
+    }
+
+    return buffers;
+}
+
+//calls the remove recursive function, while setting merged status to false
+void b_plus_tree::remove(int key) {
+
+    //error checking addition
+    if (!root) 
+        return;
+
+    //removes change sample buffers, so no query can be reading them
+    unique_lock<shared_mutex> write_lock(sample_latch);
+
+    //counts change, and nodes may merge
+    structure_version++;
+
+    //same logic as in r-tree
+    bool merged = false;
+
+    //initially empty, should be populated with the deleted record info in recursive
+    Record deleted_record;
+
+    //set if a record with the key was found and removed
+    bool removed = false;
+
+    removeRecursive(root, key, merged, deleted_record, removed);
+}
+
+//main remove functionality, as it is down recursively
+void b_plus_tree::removeRecursive(void* node, int key, bool& merged, Record& deleted_record, bool& removed) {
+
+    //if pointer is to a leaf, leaf node condition
+    if (isPointerValid(node)) {
+
+        //gets the page id from the leaf
+        int page_id = pointerToPageID(node);
+
+        //creates buffer
+        char buffer[PAGE_SIZE];
+        
+        //reads in information from leaf
+        handler.readPage(page_id, buffer);
+
+        //create instance of leaf node
+        disk_leaf_node * leaf = reinterpret_cast<disk_leaf_node*>(buffer);
+
+        //find the index of the key that is to be removed
+        int i = 0;
+        while (i < leaf->record_num && leaf->records[i].hilbert < key)
+            i++;
+
+        //if the key exists, removed by shifting later records to the left
+        if (i < leaf->record_num && leaf->records[i].hilbert == key) {
+
+            //records the record to be deleted
+            deleted_record = leaf->records[i];
+
+            //shift records left to remove
+            for (int j = i; j < leaf->record_num - 1; j++)
+                leaf->records[j] = leaf->records[j + 1];
+            
+            leaf->record_num--;
+
+            //writes page back to disk
+            handler.writePage(page_id, buffer, sizeof(disk_leaf_node));
+
+            removed = true;
+
+        }
+
+
+        //deleting a leaf node should not trigger a merge
+        merged = false;
+        return;
+     
+    } 
+    
+    //internal node condition
+    else {
+
+        //create an internal node
+        internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+        //initial value
+        int i = 0;
+
+        //find the index of the key that is to be removed
+        while (i < internal->numKeys && key > internal->keys[i]) 
+            i++;
+
+        //recurse into the child that may contain
+        bool child_merged = false;
+        removeRecursive(internal->children[i], key, child_merged, deleted_record, removed);
+
+        //a split hands the records with the promoted key to the right, so a key equal to a separator can be in any
+        //of the children up to the last separator with that key
+        while (!removed && i < internal->numKeys && key == internal->keys[i]) {
+            i++;
+            removeRecursive(internal->children[i], key, child_merged, deleted_record, removed);
+        }
+
+        //nothing to update if the key was not found
+        if (removed) {
+            internal->child_counts[i]--;
+            internal->child_weights[i] -= samplingWeight(deleted_record);
+            internal->weighted_samples.clear();
+            removeSample(internal, deleted_record);
+        }
+        
+        //eligibility test based off of |P(u)| ≤ 2s as mentioned in Wang et al.
+        long int subtree_size = getSubtreeRecordCount(internal);
+
+
+        //check to see the if the internal node is eligible + needs replenishing after getting its buffer drained
+        //the buffer is refilled by the background worker, so the remove does not wait on it
+        if (internal->sample_count < SAMPLE_SIZE/2 && subtree_size > 2 * SAMPLE_SIZE) {
+            scheduleReplenish(internal);
+
+        }
+
+        //if the child indicated that is was merged, was empitied
+        if (child_merged && i + 1 < internal->numKeys) {
+            
+            //remove the corresponding key and child pointer in the internal node
+            for (int j = i; j < internal->numKeys - 1; ++j) {
+
+                internal->keys[j] = internal->keys[j + 1];
+                internal->children[j + 1] = internal->children[j + 2];
+                internal->child_counts[j + 1] = internal->child_counts[j + 2];
+                internal->child_weights[j + 1] = internal->child_weights[j + 2];
+            }
+
+            //decrease the number of keys
+            internal->numKeys--;
+        }
+
+        //marked as merged
+        merged = (internal->numKeys == 0);
+    }
+}
+
+
+/*sampling implementation*/
+
+//public function to get the number of records in a node's subtree (children, grandchildren, etc)
+long int b_plus_tree::getSubtreeRecordCount(void* node){
+
+    //empty tree error check
+    if (!root) {
+
+        cout << "Tree is empty.\n";
+        return 1;
+    }
+
+    //internal nodes know the counts of their children, so only a leaf needs to be read
+    if (!isPointerValid(node)) {
+
+        internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+        long int total_records = 0;
+        for (int i = 0; i <= internal->numKeys; i++)
+            total_records += internal->child_counts[i];
+
+        return total_records;
+    }
+
+    //calls actual counter, and returns total counter
+    long int total_records = recursiveNodeSubtreeCounter(node);
+
+    return total_records;
+    
+    
+}
+
+//total record weight of a subtree, internal nodes know the weights of their children
+double b_plus_tree::getSubtreeWeight(void* node){
+
+    if (!root)
+        return 0;
+
+    if (!isPointerValid(node)) {
+
+        internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+        double total_weight = 0;
+        for (int i = 0; i <= internal->numKeys; i++)
+            total_weight += internal->child_weights[i];
+
+        return total_weight;
+    }
+
+    //a leaf has to be read
+    char buffer[PAGE_SIZE];
+    handler.readPage(pointerToPageID(node), buffer);
+
+    return leafWeight(*reinterpret_cast<disk_leaf_node*>(buffer));
+}
+
+//adds up the weights of a leaf's records, the same clamped weights the descent picks by
+double b_plus_tree::leafWeight(const disk_leaf_node& leaf){
+
+    double total_weight = 0;
+    for (int i = 0; i < leaf.record_num; i++)
+        total_weight += samplingWeight(leaf.records[i]);
+
+    return total_weight;
+}
+
+//the weight a record is sampled with, negative (and NaN) weights count as 0 so the child weights and the
+//descent always agree
+double b_plus_tree::samplingWeight(const Record& rec){
+
+    return rec.weight > 0 ? rec.weight : 0.0;
+}
+
+//public function to get the number of NON-DISABLED records in node's subtree
+//used exclusively by the sample query function and is virtually identical
+long int b_plus_tree::getNonDisabledSubtreeRecordCount(void* node){
+
+    //empty tree error check
+    if (!root) {
+
+        cout << "Tree is empty.\n";
+        return 1;
+    }
+
+    //calls the acutal counter, and returns total counter
+    long int total_non_disabled = recursiveNonDisabledSubtreeCounter(node);
+
+    return total_non_disabled;
+
+}
+
+//recursively gets the count of all NON-DISABLED records in a node's subtree
+long int b_plus_tree::recursiveNonDisabledSubtreeCounter(void* node){
+
+     //get direct count if leaf condition
+     if (isPointerValid(node)) {
+
+        //gets the page id, allocates buffer, reads from page
+        long int page_id = pointerToPageID(node);
+        char buffer[PAGE_SIZE];
+        handler.readPage(page_id, buffer);
+
+        //creates instance of disk leaf to return record_num
+        disk_leaf_node * leaf = reinterpret_cast<disk_leaf_node*>(buffer);
+        
+        //iterates through the records and gets a count of only those not disabled
+        int valid_records_count = 0;
+
+        for (int i =0; i < leaf->record_num; i++) {
+
+            //checks if not disabled
+            if (leaf->records[i].disabled == false)
+                valid_records_count++;
+        }
+
+        return valid_records_count;
+    }
+
+    //internal condition, creates instance from node
+    internal_node * internal = reinterpret_cast<internal_node*>(node);
+
+    long int total_non_disabled =0;
+
+    //loops through all of its children to get count
+    for (int i = 0; i <= internal->numKeys; i++) {
+
+        total_non_disabled += recursiveNonDisabledSubtreeCounter(internal->children[i]);
+    }
+
+    return total_non_disabled;
 
 }
 
@@ -1188,14 +2752,21 @@ long int b_plus_tree::recursiveNodeSubtreeCounter(void* node) {
 }
 
 
-//adapted from the pseudocode algorithm 2 provided by Wang et al., used to generate samples for internal nodes
-//takes in a node and a desired number (0 by default), and fills the samples for each node 
-vector<Record> b_plus_tree::BuildSamples(void* node, int d){
+//adapted from the pseudocode algorithm 2 provided by Wang et al., used to generate samples for internal nodes.
+//Instead of every leaf handing d samples up (which gives every child the same share, no matter its size),
+//every eligible node draws the ranks of its missing samples uniformly from [0, |P(u)|), with replacement.
+//The ranks of a node and of all of its ancestors are then split between the children using the child counts,
+//and resolved at the leaves, so every buffer is a uniform sample of its subtree and every leaf is read once,
+//in order, for all of the buffers above it. Without fill_buffers only the fills handed in are resolved, which is
+//how the background worker draws refills and rotations without writing to buffers it does not own
+void b_plus_tree::BuildSamples(void* node, vector<buffer_fill> fills, work_stealing_pool* pool, bool fill_buffers){
 
-    //lines 1-2
-    //leaf node condition
+    //leaf node condition, the ranks are positions in the leaf
     if (isPointerValid(node)){
-        
+
+        if (fills.empty())
+            return;
+
         //gets the page id, allocates buffer, reads from page
         int page_id = pointerToPageID(node);
         char buffer[PAGE_SIZE];
@@ -1204,80 +2775,83 @@ vector<Record> b_plus_tree::BuildSamples(void* node, int d){
         //creates instance of disk leaf to return record_num
         disk_leaf_node * leaf = reinterpret_cast<disk_leaf_node*>(buffer);
 
-        //creates vector to hold all of leaf records
-        vector<Record> records;
+        if (leaf->record_num == 0)
+            return;
+
+        //every fill owns its own slot, so fills of the same buffer from different tasks never overlap
+        for (const buffer_fill& fill : fills) {
 
-        //populatres vector from leaf record
-        for (int i =0; i < leaf->record_num; i++){
-            //mfers call me the sandwich
-            records.push_back(leaf->records[i]);
+            long int rank = min(fill.rank, static_cast<long int>(leaf->record_num - 1));
+            *fill.target = leaf->records[rank];
         }
 
-        //return random samples
-        return sampleWithReplacement(records, d);
+        return;
     }
 
     //internal node condition, creates instance from provided node
     internal_node* internal = reinterpret_cast<internal_node*>(node);
 
-    //eligibility test based off of |P(u)| ≤ 2s as mentioned in Wang et al.
+    int num_children = internal->numKeys + 1;
     long int subtree_size = getSubtreeRecordCount(internal);
-    //will not add records to an internal node's sample buffer if its subtree size is too low
-    if (subtree_size <= 2 * SAMPLE_SIZE) {
-      
-        return {};
-    }
 
-    //lines 3-4
-    //checks amount of samples
-    if (internal->sample_count < SAMPLE_SIZE ) {
+    //eligibility test based off of |P(u)| ≤ 2s as mentioned in Wang et al.
+    //only nodes with big enough subtrees get samples in their buffer
+    if (fill_buffers && subtree_size > 2 * SAMPLE_SIZE && internal->sample_count < SAMPLE_SIZE) {
+
+        //line 7
+        //SAMPLE_SIZE - sample count slots are missing, each gets a uniform rank of the subtree. The ranks come from
+        //the node's own generator, as the task may be run by any of the pool's threads
+        xoshiro256 rand_gen = bufferRng(internal);
+
+        for (int slot = internal->sample_count; slot < SAMPLE_SIZE; slot++)
+            fills.push_back({&activeSamples(internal)[slot], static_cast<long int>(rand_gen.bounded(subtree_size))});
 
-        d = d + (2 * SAMPLE_SIZE) - internal->sample_count;
+        internal->sample_count = SAMPLE_SIZE;
+        internal->sample_version++;
     }
 
-    //line 5
-    //basically: S <- Ø
-    vector<Record> subtree_records;
+    //sorted by rank, so the fills can be split between the children in one pass
+    sort(fills.begin(), fills.end(), [](const buffer_fill& a, const buffer_fill& b) { return a.rank < b.rank; });
 
-    //internal node condition
-    //loops through all of its children to get count
-    //line 6
-    for (int i = 0; i <= internal->numKeys; i++) {
+    //line 6 and 8
+    //hands every child the fills that land in it, with ranks relative to the child. Internal children are
+    //independent subtrees, so they are handed to the pool, leaves are read by this task
+    work_stealing_pool::task_group group;
 
-        //get the child
-        void * child = internal->children[i];
+    size_t next = 0;
+    long int offset = 0;
 
+    for (int i = 0; i < num_children; i++) {
 
-        //line 7
-        //subtract SAMPLE_SIZE from node's sample count to see how much is needed
-        int d0 = (SAMPLE_SIZE - internal->sample_count);
+        vector<buffer_fill> child_fills;
 
-        //line 8
-        //stores results of running BuildSamples recursively using internal and d0
-        vector<Record> temp_records = BuildSamples(child, d0);
-        //combine the two records
-        subtree_records.insert(subtree_records.end(), temp_records.begin(), temp_records.end());
+        while (next < fills.size() && fills[next].rank < offset + internal->child_counts[i]) {
+            child_fills.push_back(fills[next]);
+            child_fills.back().rank -= offset;
+            next++;
+        }
 
-    }
+        offset += internal->child_counts[i];
 
-    //fills up sample_buffer with elements in subtree_records, while deleting those already inserts
-    //line 9
-    //while not really mentioned in the paper, to avoid deterministic biases, subtree_records are shuffled
-    //using a different random seed
-    static default_random_engine shuffle_seed(random_device{}());
-    shuffle(subtree_records.begin(), subtree_records.end(), shuffle_seed);
-    auto itr = subtree_records.begin();
-    while (itr != subtree_records.end() && internal->sample_count < SAMPLE_SIZE){
+        //get the child
+        void * child = internal->children[i];
 
-        //inserts the record and erases it for subtree_records
-        internal->sample_buffer[internal->sample_count++] = *itr;
-        itr = subtree_records.erase(itr);  
+        if (pool && !isPointerValid(child)) {
+
+            pool->submit(group, [this, child, pool, fill_buffers, child_fills = move(child_fills)]() mutable {
+                BuildSamples(child, move(child_fills), pool, fill_buffers);
+            });
+        }
 
+        //a child without fills has nothing to resolve unless its buffers are being filled too
+        else if (fill_buffers || !child_fills.empty()) {
+            BuildSamples(child, move(child_fills), pool, fill_buffers);
+        }
     }
 
-    //return the remaining values
-    //line 10
-    return subtree_records;
+    //waits on the children, running queued subtrees in the meantime
+    if (pool)
+        pool->wait(group);
 }
 
 //used to build samples for all eligible nodes, starts at root, call when tree has been "built"
@@ -1286,50 +2860,106 @@ void b_plus_tree::buildAllSamples(){
     //print out (can remove)
     cout << "Beginning to fill all eligible node buffers" << endl;
 
-    //default value
-    int d = 0;
+    unique_lock<shared_mutex> write_lock(sample_latch);
+
+    //total records in the tree, from the child counts
+    long int total_records = getSubtreeRecordCount(root);
 
-    //call the BuildSample function from root
-    BuildSamples(root,d);
+    //independent subtrees are spread over one worker per core
+    work_stealing_pool pool;
+
+    //call the BuildSample function from root, with no fills from above
+    BuildSamples(root, {}, &pool);
 
     //debugging
-    cout << "Buffer Sample filling complete!" << endl;
+    cout << "Buffer Sample filling complete! (" << total_records << " records, "
+         << pool.size() << " threads)" << endl;
 
 }
 
+//fills the weighted buffers, the same way as buildAllSamples but with positions in the subtree's weight
+void b_plus_tree::buildWeightedSamples(){
 
-//created with inspiration from the description of sampling from Wang et al.
-//takes in records, returns d number of samples
-vector<Record> b_plus_tree::sampleWithReplacement(const vector<Record> & record, int d){
+    unique_lock<shared_mutex> write_lock(sample_latch);
 
-    //will hold samples
-    vector<Record> samples;
+    if (root)
+        BuildWeightedSamples(root, {});
+}
 
-    //edge case for d=0, just returns no samples from empty vector
-    if (record.empty())
-        return samples;
+//every eligible node with an empty weighted buffer draws SAMPLE_SIZE uniform positions in [0, W(u)), and
+//the positions are handed down by child weight, so a record is picked with probability weight / W(u)
+void b_plus_tree::BuildWeightedSamples(void* node, vector<weighted_fill> fills){
+
+    //leaf node condition, a position picks the record whose share of the running weight it falls in
+    if (isPointerValid(node)){
 
-    //defines the default random engine used for random sampling, seeded with computer clock  
-    //references: https://stackoverflow.com/questions/33131800/c-generating-random-numbers-in-a-loop-using-default-random-engine
-    static default_random_engine rand_gen (chrono::steady_clock::now().time_since_epoch().count());
+        if (fills.empty())
+            return;
 
-    //uses predefined binomial distribution function
-    //references: https://en.cppreference.com/w/cpp/numeric/random/binomial_distribution
-    binomial_distribution<int> dist(record.size() -1, .5);
+        char buffer[PAGE_SIZE];
+        handler.readPage(pointerToPageID(node), buffer);
+        disk_leaf_node * leaf = reinterpret_cast<disk_leaf_node*>(buffer);
+
+        if (leaf->record_num == 0)
+            return;
+
+        //fills are sorted by position, so one pass over the leaf resolves all of them
+        int i = 0;
+        double running = samplingWeight(leaf->records[0]);
+
+        for (const weighted_fill& fill : fills) {
 
-    //loops through the passed in records, sampling at random and pushing into samples vector
-    //uses d as the constraint
-    for (int i = 0; i < d; i++ ){
+            while (i < leaf->record_num - 1 && fill.position >= running) {
+                i++;
+                running += samplingWeight(leaf->records[i]);
+            }
 
-        int round = dist(rand_gen);
-        round = min(round, static_cast<int>((record.size() -1)));
-        samples.push_back(record[round]);
+            fill.owner->weighted_samples[fill.slot] = leaf->records[i];
+        }
 
+        return;
     }
 
-    return samples;
+    internal_node* internal = reinterpret_cast<internal_node*>(node);
+
+    //eligibility test, same as for the uniform buffers
+    double subtree_weight = getSubtreeWeight(internal);
+
+    if (getSubtreeRecordCount(internal) > 2 * SAMPLE_SIZE && subtree_weight > 0 && internal->weighted_samples.empty()) {
+
+        xoshiro256& rand_gen = threadRng();
+        internal->weighted_samples.resize(SAMPLE_SIZE);
+
+        for (int slot = 0; slot < SAMPLE_SIZE; slot++)
+            fills.push_back({internal, slot, rand_gen.uniform() * subtree_weight});
+    }
+
+    sort(fills.begin(), fills.end(), [](const weighted_fill& a, const weighted_fill& b) { return a.position < b.position; });
+
+    //hands every child the fills that fall in its weight, relative to the child
+    size_t next = 0;
+    double offset = 0;
+    int num_children = internal->numKeys + 1;
+
+    for (int i = 0; i < num_children; i++) {
+
+        vector<weighted_fill> child_fills;
+        double child_weight = max(internal->child_weights[i], 0.0);
+
+        //the last child takes whatever is left, in case of rounding in the weight sums
+        while (next < fills.size() && (fills[next].position < offset + child_weight || i == num_children - 1)) {
+            child_fills.push_back(fills[next]);
+            child_fills.back().position -= offset;
+            next++;
+        }
+
+        offset += child_weight;
+
+        BuildWeightedSamples(internal->children[i], move(child_fills));
+    }
 }
 
+
 //sampling used for standard inserts, where each sample record has a 1/|P(u)| of getting replaced with the
 //newly inserted inserted, of course assuming that record falls under the node in some way. Implementation
 //based on description in Wang et al.
@@ -1344,14 +2974,15 @@ void b_plus_tree::updateSampleBuffer(internal_node* node, const Record& e){
     }
 
     if (node->sample_count == 0) {
-        node->sample_buffer[0] = e;
+        activeSamples(node)[0] = e;
         node->sample_count = 1;
+        node->sample_version++;
         return;
     }
 
 
-    ///uses same randomizer used in sampleWithReplacement
-    static default_random_engine rand_gen(chrono::steady_clock::now().time_since_epoch().count());
+    //one stream per thread
+    xoshiro256& rand_gen = threadRng();
 
     //calculates 1 / |P(u)| and performs binomial distribution as described
     double prob = 1.0 / subtree_size;
@@ -1369,14 +3000,17 @@ void b_plus_tree::updateSampleBuffer(internal_node* node, const Record& e){
 
     //pick indices to be replaced
     while (replace_indices.size() < num_to_replace) {
-        replace_indices.insert(rand_gen() % node->sample_count);
+        replace_indices.insert(rand_gen.bounded(node->sample_count));
     }
 
     //proceeds to replace the value at the randomly selected indices
     for (int i : replace_indices) {
-        node->sample_buffer[i] = e;
+        activeSamples(node)[i] = e;
     }
 
+    //any refill the worker computed before this is now outdated
+    node->sample_version++;
+
 }
 
 //used to remove deleted record from sample buffer
@@ -1385,95 +3019,266 @@ void b_plus_tree::removeSample(internal_node* node, const Record& e){
     //used for index manipulation, value removal, shifting, and count - a swiss army variable
     int swiss_army_idx = 0;
 
+    //only the active half is changed, removes happen while no query is reading it
+    Record* samples = activeSamples(node);
+
     //loops through all of the samples in node's buffer
     for (int i =0; i < node->sample_count; i++){
 
         //gets record instance from the sample_buffer
-        const Record& record = node->sample_buffer[i];
+        const Record& record = samples[i];
 
         //if sample does not match the deleted record...
         if (!(record.hilbert == e.hilbert && strncmp(record.id, e.id, sizeof(e.id)) == 0 )){
 
             //only keeps those not deleted and updates the swiss_army_idx for sample_count purposes
-            node->sample_buffer[swiss_army_idx++] = record;
+            samples[swiss_army_idx++] = record;
 
         }
     }
 
-        //updates sample count as needed
+        //updates sample count as needed, bumping the version if anything was removed
+        if (node->sample_count != swiss_army_idx)
+            node->sample_version++;
+
         node->sample_count = swiss_army_idx;
 
 }
 
-//used to replenish buffers that are not full enough, but it is buggy
-void b_plus_tree::replenishSamples(internal_node* node) {
+//used by the background worker to replenish buffers that are not full enough, or to rotate part of a
+//buffer that served enough queries. The new buffer is built in the standby half and then swapped in,
+//so queries never see a half-written buffer. Returns false if the node has to be tried again later
+bool b_plus_tree::replenishSamples(internal_node* node) {
 
-    //triple layer redundancy
-    long int subtree_size = getSubtreeRecordCount(node);
-    if (subtree_size <= 2 * SAMPLE_SIZE) {
-        return;  
+    //new contents of the buffer, and the version they were computed against
+    vector<Record> fresh;
+    unsigned int version;
+
+    //candidates are gathered under a shared lock: queries keep running, updates wait for the reads
+    {
+        shared_lock<shared_mutex> read_lock(sample_latch);
+
+        //eligibility test based off of |P(u)| ≤ 2s as mentioned in Wang et al.
+        long int subtree_size = getSubtreeRecordCount(node);
+        if (subtree_size <= 2 * SAMPLE_SIZE) {
+            node->rotation_due = false;
+            return true;  
+        }
+
+        //a full refill when below the low watermark, otherwise only a rotation if one is due
+        bool refill = node->sample_count < SAMPLE_SIZE / 2;
+        bool rotate = node->rotation_due.exchange(false);
+
+        if (!refill && !rotate)
+            return true;
+
+        version = node->sample_version;
+
+        //a whole new buffer of uniform draws from the subtree, the same way buildAllSamples fills it
+        if (refill) {
+            fresh = drawSubtreeSamples(node, SAMPLE_SIZE);
+        }
+
+        //copy of the active half with its next window replaced, the same rotation refreshSampleBuffers does
+        else if (!rotatedSamples(node, refresh_fraction, fresh)) {
+            return true;
+        }
     }
 
-    if (subtree_size <= 2 * SAMPLE_SIZE) {
-        node->sample_count = 0;
+    //swaps the new buffer in, updates are kept out by the shared lock and queries by the swap latch
+    shared_lock<shared_mutex> read_lock(sample_latch);
+    lock_guard<mutex> swap_guard(node->swap_latch);
+
+    //an update changed the buffer in the meantime, so the refill is outdated
+    if (node->sample_version != version)
+        return false;
+
+    //the standby half may still be read by a query that started before the last swap
+    int standby = 1 - node->active_half;
+    if (node->half_readers[standby] > 0)
+        return false;
+
+    copy(fresh.begin(), fresh.end(), node->sample_buffer + standby * SAMPLE_SIZE);
+
+    node->active_half = standby;
+    node->sample_count = fresh.size();
+    node->sample_version++;
+
+    return true;
+
+}
+
+//queues a node for the background worker, unless it is already waiting
+void b_plus_tree::scheduleReplenish(internal_node* node) {
+
+    if (node->replenish_queued.exchange(true))
         return;
+
+    {
+        lock_guard<mutex> lock(queue_latch);
+        replenish_queue.push_back(node);
     }
 
-    //creates vector to store collected samples
-    vector<Record> collected;
+    queue_signal.notify_one();
+}
+
+//background worker, replenishes queued nodes one at a time until the tree is destroyed
+void b_plus_tree::replenishWorker() {
 
-    //iterates through all of the children
-    for (int i = 0; i <= node->numKeys; ++i) {
+    while (true) {
 
-        //creates child node instance
-        void* child = node->children[i];
+        internal_node* node;
 
-        //leaf conditon
-        if (isPointerValid(child)) {
+        //waits for a node to be queued
+        {
+            unique_lock<mutex> lock(queue_latch);
+            queue_signal.wait(lock, [this] { return stop_worker || !replenish_queue.empty(); });
 
-            //leaf node initialization
-            char buffer[PAGE_SIZE];
-            handler.readPage(pointerToPageID(child), buffer);
-            disk_leaf_node* leaf = reinterpret_cast<disk_leaf_node*>(buffer);
+            if (stop_worker)
+                return;
 
-            //populates the vector
-            for (int j = 0; j < leaf->record_num; ++j) {
-                collected.push_back(leaf->records[j]);
-            }
+            node = replenish_queue.front();
+            replenish_queue.pop_front();
+            replenishing = true;
         }
-        
-        //internal node condition
-        else {
 
-            //internal node
-            internal_node* internal_child = reinterpret_cast<internal_node*>(child);
+        //cleared first, so that a node that drops below the watermark again gets queued again
+        node->replenish_queued = false;
 
-            long int subtree_size = getSubtreeRecordCount(internal_child);
+        //could not be swapped in right now. If queries are still reading the standby half, waits for the last of
+        //them to let go of it instead of polling. An update that outdated the refill is already over once the
+        //worker sees it, so then it is just queued again
+        if (!replenishSamples(node)) {
 
-            //replenish if needed and eligible
-            if (internal_child->sample_count < SAMPLE_SIZE / 2 && subtree_size > 2 * SAMPLE_SIZE) {
-                replenishSamples(internal_child);
-            }
+            {
+                unique_lock<mutex> lock(release_latch);
 
-            //fills in collected
-            for (int j = 0; j < internal_child->sample_count; ++j) {
-                collected.push_back(internal_child->sample_buffer[j]);
+                worker_waiting = true;
+                release_signal.wait(lock, [this, node] {
+                    return stop_worker || node->half_readers[1 - node->active_half] == 0;
+                });
+                worker_waiting = false;
             }
+
+            if (stop_worker)
+                return;
+
+            scheduleReplenish(node);
+        }
+
+        //done with the node, which may have been queued again
+        {
+            lock_guard<mutex> lock(queue_latch);
+            replenishing = false;
+        }
+
+        replenished_signal.notify_all();
+    }
+}
+
+//the queue is emptied by the worker, along with the node it is working on
+void b_plus_tree::waitForReplenish() {
+
+    unique_lock<mutex> lock(queue_latch);
+    replenished_signal.wait(lock, [this] { return stop_worker || (replenish_queue.empty() && !replenishing); });
+}
+
+//drops a query's hold on a half of a buffer, waking the worker if it waits on the half being let go of. Only
+//the last reader of a half signals, and only while the worker is waiting, so queries rarely touch the latch
+void b_plus_tree::releaseHalf(internal_node* node, int half) {
+
+    if (--node->half_readers[half] == 0 && worker_waiting) {
+
+        {
+            lock_guard<mutex> lock(release_latch);
         }
+
+        release_signal.notify_all();
     }
+}
+
+//a new internal node, numbered in the order the tree creates them, which is the same for the same inserts
+internal_node* b_plus_tree::newInternalNode() {
+
+    internal_node* node = new internal_node();
+    node->node_number = next_node_number++;
+
+    return node;
+}
+
+//generator keyed by the node's number and buffer version. Both fit in 32 bits for any tree that fits in memory
+xoshiro256 b_plus_tree::bufferRng(internal_node* node) const {
+
+    return keyedRng((node->node_number << 32) ^ node->sample_version);
+}
+
+//count uniform draws (with replacement) from a node's subtree. The ranks are split between the children by
+//their counts and resolved at the leaves, as BuildSamples does for the buffers, so only the leaves that a rank
+//lands in are read, and nothing but the returned records is written
+vector<Record> b_plus_tree::drawSubtreeSamples(internal_node* node, int count) {
+
+    vector<Record> drawn(count);
+
+    long int subtree_size = getSubtreeRecordCount(node);
+    if (subtree_size == 0)
+        return {};
+
+    //the node's own generator, the worker and refreshSampleBuffers draw the same samples for the same buffer
+    xoshiro256 rand_gen = bufferRng(node);
 
-    //shuffles collected records
-    static default_random_engine rand_gen(chrono::steady_clock::now().time_since_epoch().count());
-    std::shuffle(collected.begin(), collected.end(), rand_gen);
+    vector<buffer_fill> fills;
+    fills.reserve(count);
 
-    //fills up the buffer as needed
-    int fill = min((int)collected.size(), SAMPLE_SIZE);
-    for (int i = 0; i < fill; ++i) {
-        node->sample_buffer[i] = collected[i];
+    for (int i = 0; i < count; i++)
+        fills.push_back({&drawn[i], static_cast<long int>(rand_gen.bounded(subtree_size))});
+
+    BuildSamples(node, move(fills), nullptr, false);
+
+    return drawn;
+}
+
+//copy of a node's active samples with the next window of them replaced by new uniform draws from its subtree.
+//The window moves along the buffer with each rotation, so that the whole buffer is renewed after 1/fraction
+//rotations. Used by both the background worker and refreshSampleBuffers, returns false if there is nothing to rotate
+bool b_plus_tree::rotatedSamples(internal_node* node, double fraction, vector<Record>& rotated) {
+
+    //nothing to rotate
+    if (node->sample_count == 0)
+        return false;
+
+    //size of the window, at least one sample
+    int window = max(1, static_cast<int>(fraction * node->sample_count));
+    window = min(window, node->sample_count);
+
+    vector<Record> drawn = drawSubtreeSamples(node, window);
+    if (drawn.empty())
+        return false;
+
+    rotated.assign(activeSamples(node), activeSamples(node) + node->sample_count);
+
+    //count may have shrunk since the last rotation
+    int cursor = node->refresh_cursor % node->sample_count;
+
+    for (int i = 0; i < window; ++i) {
+
+        rotated[cursor] = drawn[i];
+        cursor = (cursor + 1) % node->sample_count;
     }
 
-    node->sample_count = fill;
+    node->refresh_cursor = cursor;
+
+    return true;
+}
+
+//rotates a buffer in place, for when no query can be reading it
+void b_plus_tree::rotateSampleBuffer(internal_node* node, double fraction) {
+
+    vector<Record> rotated;
+    if (!rotatedSamples(node, fraction, rotated))
+        return;
 
+    copy(rotated.begin(), rotated.end(), activeSamples(node));
+    node->sample_version++;
 }
 
 //used to print the tree, more so for our error checking tbh
@@ -1541,7 +3346,7 @@ void b_plus_tree::printTree() {
                 cout << "  Sample Buffer (" << internal->sample_count << "):\n";
 
                 for (int i = 0; i < internal->sample_count; ++i) {
-                    const Record& r = internal->sample_buffer[i];
+                    const Record& r = activeSamples(internal)[i];
                     cout << "    [" << r.hilbert << "] " << r.id
                         << " | (" << r.lon << ", " << r.lat << ")"
                         << " | " << r.timestamp << "\n";
@@ -38,6 +38,23 @@ modifications and changes
 #include <vector>
 #include <string>
 #include <iostream>
+#include <unordered_map>
+#include <climits>
+
+//needed for concurrent queries and background replenishment
+#include <atomic>
+#include <shared_mutex>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+
+//used to build the sample buffers in parallel
+#include "ThreadPool.hpp"
+
+//running COUNT/SUM/AVG estimates from samples
+#include "OnlineAggregation.hpp"
+#include <functional>
 
 using namespace std;
 
@@ -47,6 +64,12 @@ using namespace std;
 constexpr int SAMPLE_SIZE = 256;
 //extern int SAMPLE_SIZE;
 
+//number of queries that may read a node's sample buffer before part of it gets rotated. Default: 32
+constexpr int SAMPLE_REFRESH_QUERIES = 32;
+
+//fraction of a sample buffer that is replaced with fresh samples on each rotation. Default: 0.25
+constexpr double SAMPLE_REFRESH_FRACTION = 0.25;
+
 //defines the Page size to be 8000 bytes, as Wang et al. have their page sizes set to 8 KB
 constexpr size_t PAGE_SIZE = 8000;
 
@@ -62,6 +85,41 @@ constexpr long int INVALID_PAGE = -1;
 //defines external variable name for needed root file 
 extern const string ROOT_META_FILE;
 
+//sampling engines that can be picked per query
+enum sampling_mode {
+
+    //Wang et al. SampleFirst, draws from the sample buffers and rejects out of range samples
+    SAMPLE_FIRST,
+
+    //descends from the root using the per child counts, no rejections and no buffers needed
+    RANDOM_PATH,
+
+    //splits k between the subtrees covering the range in one traversal, using the buffers of fully covered subtrees
+    BATCH_MULTINOMIAL
+};
+
+//how the samples of a stratified query are split between the grid cells, on top of the minimum per cell
+enum allocation_mode {
+
+    //the same number for every cell
+    ALLOC_UNIFORM,
+
+    //in proportion to the number of records in the cell
+    ALLOC_PROPORTIONAL,
+
+    //in proportion to the number of records times the standard deviation of the aggregated field (Neyman),
+    //which gives the smallest variance for the total. The deviations come from a pilot round
+    ALLOC_NEYMAN
+};
+
+//one query of a multi-query batch, k samples from [low, high]
+struct sample_request {
+
+    int low;
+    int high;
+    size_t k;
+};
+
 //used for packing alignment - memory issues without
 #pragma pack(push, 1)
 
@@ -80,6 +138,10 @@ struct Record {
 
     int hilbert;
 
+    //optional sampling weight (such as dwell time or popularity), 1 if the csv has no weight column.
+    //Weighted queries pick a record with probability proportional to it, so it should not be negative
+    float weight = 1.0f;
+
     //used to mark if a record has been reported/rejected
     //by default, none have been reported/rejected yet
     bool disabled = false;
@@ -88,6 +150,33 @@ struct Record {
 //used in conjunction with push
 #pragma pack(pop)
 
+//one grid cell of a stratified query, along with its samples and estimates
+struct grid_stratum {
+
+    int row;
+    int col;
+
+    //the cell's rectangle, the upper bounds are exclusive except on the viewport's edges
+    double lat_low;
+    double lat_high;
+    double lon_low;
+    double lon_high;
+
+    //hilbert ranges covering the cell, their record counts, and the total of those
+    vector<pair<int, int>> ranges;
+    vector<long int> range_counts;
+    long int population = 0;
+
+    //number of in-cell samples the cell was given
+    size_t quota = 0;
+
+    //the first quota samples that fell inside of the cell, uniform over the cell's records
+    vector<Record> samples;
+
+    //the cell's COUNT/SUM/AVG, from every sample drawn for it (the ones outside of the cell count as non-matching)
+    online_aggregation estimates;
+};
+
 //dynamic record size assignment used in testing, we kept anyways
 constexpr size_t RECORD_SIZE = sizeof(Record);  
 
@@ -132,16 +221,55 @@ struct internal_node {
     int keys[MAX_INTERNAL_KEYS];
     void* children[MAX_INTERNAL_KEYS + 1];
 
+    //number of records under each child, kept up to date by inserts, splits and removes
+    long int child_counts[MAX_INTERNAL_KEYS + 1] = {};
+
+    //total record weight under each child, kept up to date the same way
+    double child_weights[MAX_INTERNAL_KEYS + 1] = {};
+
+    //weighted sample buffer, SAMPLE_SIZE records picked with probability proportional to their weight.
+    //Emptied by any insert or remove below the node, and filled again by buildWeightedSamples
+    vector<Record> weighted_samples;
+
     //sample buffer, stores Records in an array
-    //its size can be up to 2s to account for merges, but can not have more than s records
+    //its size is 2s, split into two halves of s: queries read from the active half while the
+    //background worker refills the standby half, after which the two are swapped
     Record sample_buffer[2 * SAMPLE_SIZE];
 
     //determines if can have its sample_buffer filled or not
     bool sample_buffer_allowed = true;
 
-    //count of sampled records
+    //count of sampled records in the active half
     int sample_count = 0;
 
+    //which half of sample_buffer is active, 0 or 1. Swapped under swap_latch, but the replenish worker also reads it
+    //while waiting on a half to be released, so it is atomic
+    atomic<int> active_half{0};
+
+    //bumped every time the active half changes. A refill computed against an older version is dropped
+    atomic<unsigned int> sample_version{0};
+
+    //number of the node in the order the tree created its internal nodes, which along with the version picks the
+    //random draws of the buffer (see bufferRng)
+    uint64_t node_number = 0;
+
+    //queries currently reading from each half, a half is not refilled while it is still being read
+    atomic<int> half_readers[2]{};
+
+    //guards swapping the halves against queries starting to read the buffer
+    mutex swap_latch;
+
+    //set while the node is waiting in the replenish queue, or is due for a rotation
+    atomic<bool> replenish_queued{false};
+    atomic<bool> rotation_due{false};
+
+    //queries are not allowed to consume the buffer, so instead it is rotated after being read by
+    //enough queries. counts the queries that read from the buffer since its last rotation
+    atomic<int> queries_served{0};
+
+    //start of the next window of the buffer to be rotated
+    int refresh_cursor = 0;
+
 };
 
 //class used to handle pages for inserts, writes, reads. base of I/O functionality
@@ -160,6 +288,9 @@ public:
     void writePage(long int pageID, const void* data, size_t dataSize);
     void readPage(long int pageID, void* buffer);
 
+    //number of pages read by the calling thread so far
+    static long int threadPageReads();
+
     //gets the page path for further operations
     string getPagePath(long int pageID);
 
@@ -182,6 +313,9 @@ public:
     //our default sample size is set to 16 for le testing
     b_plus_tree(const string & directory_path);
 
+    //stops the background replenish worker
+    ~b_plus_tree();
+
     //same as in r-tree, but modified for memory applications
     void insert(int key, const Record& rec, bool build_mode);
     void remove(int key);
@@ -197,12 +331,138 @@ public:
     //sampling related functions
     long int getSubtreeRecordCount(void* node);
 
+    //total record weight of a subtree, from the child weights
+    double getSubtreeWeight(void* node);
+
     long int getNonDisabledSubtreeRecordCount(void* node);
 
     void buildAllSamples();
 
-    //Wang et al based query function
-    vector<Record> SampleFirstRS(int low, int high, size_t k);
+    //Wang et al based query function. With a budget, stops early once it runs out of time or page reads,
+    //and the budget keeps the reason the query stopped
+    vector<Record> SampleFirstRS(int low, int high, size_t k, query_budget* budget = nullptr);
+
+    //count-augmented query function, k independent uniform samples (with replacement) from [low, high]
+    vector<Record> RandomPathRS(int low, int high, size_t k);
+
+    //what [low, high] is made of, found in one descent from the root: the subtrees fully inside of it along with
+    //their record counts, and the in-range records of the leaves on its boundary
+    struct range_cover {
+
+        int low;
+        int high;
+
+        //structure version of the tree the cover was found for, none before the first descent
+        unsigned long int version = ULONG_MAX;
+
+        //records in range, the sum of the pieces' counts
+        long int total = 0;
+
+        //a fully covered subtree (internal node or leaf), or a boundary leaf's records in range
+        struct piece {
+
+            void* node;
+            long int count;
+            bool boundary;
+            vector<Record> records;
+        };
+
+        vector<piece> pieces;
+    };
+
+    //k uniform samples (with replacement) of the cover's range, the ranks are split between its pieces without
+    //going through the root, counting or reading the boundary leaves again. The cover is found again first if the
+    //tree was updated since it was found (or never was)
+    vector<Record> sampleCover(range_cover& cover, size_t k);
+
+    //number of records in the cover's range, finding the cover first in the same way
+    long int coverCount(range_cover& cover);
+
+    //batched query function, splits k between the subtrees in one traversal with a multinomial draw
+    vector<Record> BatchMultinomialRS(int low, int high, size_t k);
+
+    //fills the weighted sample buffer of every eligible node
+    void buildWeightedSamples();
+
+    //k samples from [low, high], each picked with probability proportional to its weight (with replacement).
+    //use_buffers lets fully covered subtrees serve their share from their weighted buffer. The buffers are only
+    //redrawn by buildWeightedSamples, so repeated queries with them get the same records, which is why it is off
+    //by default
+    vector<Record> WeightedSampleRS(int low, int high, size_t k, bool use_buffers = false);
+
+    //total weight of the records in [low, high]
+    double rangeWeight(int low, int high);
+
+    //evaluates a batch of queries in one traversal, giving each query its own k independent uniform samples
+    vector<vector<Record>> multiSample(const vector<sample_request>& requests);
+
+    //runs the query with the selected sampling engine
+    vector<Record> sample(int low, int high, size_t k, sampling_mode mode);
+
+    //exact number of records in [low, high], from the child counts
+    long int rangeCount(int low, int high);
+
+    //value of a record to aggregate (such as its lat or lon), and an optional predicate on top of the key range
+    typedef function<double(const Record&)> record_field;
+    typedef function<bool(const Record&)> record_predicate;
+
+    //called with the running estimates after every batch of samples, returning false stops the query
+    typedef function<bool(const online_aggregation&)> aggregate_callback;
+
+    //online aggregation of field over the records in [low, high], COUNT is exact. Stops on the first of the
+    //stop conditions (a plain number of samples works too), with the reason kept in the result
+    online_aggregation aggregateRange(int low, int high, const record_field& field, const stop_condition& stop,
+                                      size_t batch_size = 256, const aggregate_callback& on_batch = nullptr,
+                                      double confidence = 0.95);
+
+    //online aggregation over the records of several hilbert ranges that also pass the predicate
+    online_aggregation aggregateRanges(const vector<pair<int, int>>& ranges, const record_field& field,
+                                       const record_predicate& predicate, const stop_condition& stop, size_t batch_size = 256,
+                                       const aggregate_callback& on_batch = nullptr, double confidence = 0.95);
+
+    //online aggregation over a latitude/longitude rectangle, given the bounds and power p of the hilbert grid
+    online_aggregation aggregateRect(double lat_low, double lat_high, double lon_low, double lon_high,
+                                     double lat_min, double lat_max, double lon_min, double lon_max, int p,
+                                     const record_field& field, const stop_condition& stop, size_t batch_size = 256,
+                                     const aggregate_callback& on_batch = nullptr, double confidence = 0.95);
+
+    //online aggregation from weighted samples, with the Hansen-Hurwitz estimators
+    online_aggregation aggregateRangeWeighted(int low, int high, const record_field& field, const stop_condition& stop,
+                                              size_t batch_size = 256, const aggregate_callback& on_batch = nullptr,
+                                              double confidence = 0.95);
+
+    //stratified sampling over a rows x cols grid on a latitude/longitude rectangle, given the bounds and power p of
+    //the hilbert grid. Every cell with records gets at least min_per_cell samples, and the rest of total_k is
+    //split by the allocation. All of the cells are sampled together in one traversal per round. field is what
+    //the per cell estimates aggregate, and also what the Neyman deviations are taken of (1, so COUNT, if null)
+    vector<grid_stratum> stratifiedSample(double lat_low, double lat_high, double lon_low, double lon_high, int rows, int cols,
+                                          double lat_min, double lat_max, double lon_min, double lon_max, int p,
+                                          size_t total_k, size_t min_per_cell, allocation_mode allocation,
+                                          const record_field& field = nullptr, double confidence = 0.95);
+
+    //sets after how many queries, and by how much, a sample buffer is rotated
+    void setSampleRefreshPolicy(int every_n_queries, double fraction);
+
+    //rotates the given fraction of every sample buffer right away. This reads leaf pages for the new samples while
+    //holding the sample latch exclusively, so queries are blocked until it is done
+    void refreshSampleBuffers(double fraction);
+
+    //waits until the background worker has nothing left to replenish, so the buffers stay as they are for the
+    //queries that follow. With a seed, the buffers are then the same on every run
+    void waitForReplenish();
+
+    //a copy of a node's active samples, along with the keys its subtree lies in and the number of records under it
+    struct buffer_copy {
+
+        long int lower;
+        long int upper;
+        long int records;
+        vector<Record> samples;
+    };
+
+    //the buffers of all of the internal nodes, in breadth first order (empty for the ones with no buffer), to check
+    //them against the records or compare the buffers of two trees
+    vector<buffer_copy> bufferSnapshot();
 
 
 private:
@@ -224,13 +484,14 @@ private:
     /*memory related functionality*/
     //stores the root page id 
     void * root;
-    void insertRecursive(void* node, int key, const Record& rec, int& promoted_key, void*& new_child, bool build_mode);
+    //new_child_count is the number of records that moved into new_child after a split
+    void insertRecursive(void* node, int key, const Record& rec, int& promoted_key, void*& new_child, long int& new_child_count, double& new_child_weight, bool build_mode);
 
     //modified to be memory based
     void splitLeaf(mem_leaf_node* old_node, const Record& record, int& promoted_key, void*& new_node);
-    void splitInternal(internal_node* old_node, int insert_key, void* insert_child, int& promoted_key, void*& new_node);
+    void splitInternal(internal_node* old_node, int insert_key, void* insert_child, long int insert_count, double insert_weight, int& promoted_key, void*& new_node);
 
-    void removeRecursive(void * node, int key, bool& merged, Record& deleted_record);
+    void removeRecursive(void * node, int key, bool& merged, Record& deleted_record, bool& removed);
 
     /*disk related functionality*/
     //b plus tree will have its own instance of handler
@@ -248,11 +509,89 @@ private:
     //sampling related functions
     long int recursiveNodeSubtreeCounter(void* node);
 
+    //records of the leaves read while counting, so that the boundary leaves are read once per query
+    typedef unordered_map<long int, vector<Record>> leaf_cache;
+
+    //leaf records from the cache, reading and caching the leaf if needed
+    const vector<Record>& cachedLeaf(long int page_id, leaf_cache& cache);
+
+    //leaf records from the cache if they are there, otherwise read into scratch without caching them
+    const vector<Record>& leafRecords(long int page_id, leaf_cache& cache, vector<Record>& scratch);
+
+    //positions [first, second) of the records in [low, high] among a leaf's sorted records
+    static pair<size_t, size_t> inRangeSlice(const vector<Record>& records, int low, int high);
+
+    //bumped by every insert and remove, so a range_cover can tell that the nodes it points to may have changed
+    unsigned long int structure_version = 0;
+
+    //adds the pieces of [low, high] under a node whose keys all lie in [lower, upper] to the cover
+    void coverRecursive(void* node, int low, int high, long int lower, long int upper, range_cover& cover, leaf_cache& cache);
+
+    //finds the cover if it was never found or the tree changed since
+    void refreshCover(range_cover& cover, leaf_cache& cache);
+
+    //number of records in [low, high] under a node whose keys all lie in [lower, upper]
+    long int rangeCountRecursive(void* node, int low, int high, long int lower, long int upper, leaf_cache& cache);
+
+    //hands the sorted ranks (positions among the node's in-range records) down to the children,
+    //so that every leaf is read at most once for the whole batch
+    void randomPathDescend(void* node, int low, int high, long int lower, long int upper,
+                           const vector<long int>& ranks, vector<Record>& out, leaf_cache& cache);
+
+    //serves a quota of samples from a node, either from its buffer or by splitting the quota between its children.
+    //Buffers that were read are pinned in pins, to be released once the query is done
+    void batchDescend(void* node, int low, int high, long int lower, long int upper, long int quota,
+                      vector<Record>& out, leaf_cache& cache, vector<pair<internal_node*, int>>& pins);
+
+    //the ranks a query still has to resolve below a node
+    struct query_ranks {
+
+        size_t query;
+        vector<long int> ranks;
+    };
+
+    //randomPathDescend for several queries at once: every node and leaf on the way is visited once,
+    //and its children's counts and its records are routed to every query that reaches it
+    void multiDescend(void* node, long int lower, long int upper, const vector<sample_request>& requests,
+                      const vector<query_ranks>& active, vector<vector<Record>>& out, leaf_cache& cache);
+
     long int recursiveNonDisabledSubtreeCounter(void* node);
 
-    vector<Record> BuildSamples(void* node, int d);
+    //a sample slot to fill (in a buffer, or in a vector of draws), with the rank of its record relative to the
+    //subtree being visited
+    struct buffer_fill {
+
+        Record* target;
+        long int rank;
+    };
+
+    //a weighted buffer slot to fill, with the position of its record in the weight of the subtree being visited
+    struct weighted_fill {
+
+        internal_node* owner;
+        int slot;
+        double position;
+    };
+
+    //BuildSamples for the weighted buffers, the positions are split between children by their weights
+    void BuildWeightedSamples(void* node, vector<weighted_fill> fills);
+
+    //total weight of the records of a leaf
+    static double leafWeight(const disk_leaf_node& leaf);
+
+    //weight of a record as used for sampling, never negative
+    static double samplingWeight(const Record& rec);
+
+    //weight of the records in [low, high] under a node whose keys all lie in [lower, upper]
+    double rangeWeightRecursive(void* node, int low, int high, long int lower, long int upper, leaf_cache& cache);
 
-    vector<Record> sampleWithReplacement(const vector<Record> & record, int d);
+    //weighted version of batchDescend, quota samples out of the in-range records of a node
+    void weightedDescend(void* node, int low, int high, long int lower, long int upper, long int quota,
+                         bool use_buffers, vector<Record>& out, leaf_cache& cache);
+
+    //fills the missing samples of every eligible buffer with uniform ranks, resolved at the leaves.
+    //with a pool, internal children are built as separate tasks. Without fill_buffers only the given fills are resolved
+    void BuildSamples(void* node, vector<buffer_fill> fills, work_stealing_pool* pool, bool fill_buffers = true);
 
     //used for standard inserts
     void updateSampleBuffer(internal_node* node, const Record& e);
@@ -260,12 +599,106 @@ private:
     //removes sample instances
     void removeSample(internal_node* node, const Record& e);
 
-    //replenishes buffers recursively
-    void replenishSamples(internal_node* node);
+    //refills (or rotates) a buffer in its standby half and swaps it in, run by the background worker
+    bool replenishSamples(internal_node* node);
+
+    //start of the half of the sample buffer that is currently active
+    inline Record* activeSamples(internal_node* node) const;
+
+    //hands a node to the background worker, which replenishes it off of the query and update path
+    void scheduleReplenish(internal_node* node);
+
+    //background worker loop
+    void replenishWorker();
+
+    //internal nodes whose buffers dropped below the low watermark (SAMPLE_SIZE / 2) or are due for rotation
+    deque<internal_node*> replenish_queue;
+    mutex queue_latch;
+    condition_variable queue_signal;
+    atomic<bool> stop_worker{false};
+    thread worker;
+
+    //set while the worker is replenishing a node it took off of the queue, and signalled when it is done with it
+    bool replenishing = false;
+    condition_variable replenished_signal;
+
+    //signalled when the last query reading a half of a buffer lets go of it, while the worker is waiting on that
+    //to swap a refill in
+    mutex release_latch;
+    condition_variable release_signal;
+    atomic<bool> worker_waiting{false};
+
+    //a query is done reading a half of a node's buffer
+    void releaseHalf(internal_node* node, int half);
+
+    //internal nodes created so far, the next one gets this number
+    uint64_t next_node_number = 0;
+
+    //a new internal node, numbered
+    internal_node* newInternalNode();
+
+    //generator for the draws of a node's buffer at its current version. It only depends on the seed, the node's
+    //number and the version, so a seeded build draws the same buffers whichever thread fills them, and a background
+    //refill draws the same samples whenever it happens to run
+    xoshiro256 bufferRng(internal_node* node) const;
+
+    //count uniform draws from a node's subtree, resolved through the child counts like BuildSamples
+    vector<Record> drawSubtreeSamples(internal_node* node, int count);
+
+    //copy of the active samples with their next window replaced by new draws from the subtree, false if there is
+    //nothing to rotate. The one rotation step of both the worker and refreshSampleBuffers
+    bool rotatedSamples(internal_node* node, double fraction, vector<Record>& rotated);
+
+    //replaces a window of the buffer with fresh samples, in place
+    void rotateSampleBuffer(internal_node* node, double fraction);
+
+    //queries read the sample buffers under a shared lock, while inserts, removes,
+    //and rotations change them under a unique lock
+    shared_mutex sample_latch;
+
+    //refresh policy, SAMPLE_REFRESH_QUERIES and SAMPLE_REFRESH_FRACTION by default
+    int refresh_queries = SAMPLE_REFRESH_QUERIES;
+    double refresh_fraction = SAMPLE_REFRESH_FRACTION;
 
     //re-enables all disabled records
     void reenableAllRecordsInSubtree(void* node);
     
 };
 
+//pull based stream of uniform samples (with replacement) from [low, high]. The range's cover (its fully covered
+//subtrees and counts, and the in-range records of its boundary leaves) is found once, and samples are drawn from
+//it with the random-path split in batches that start at 1 and double up to max_batch, so the first sample comes
+//back right away and later batches only read the leaves their samples land in. The tree has to outlive the stream.
+//Every batch takes its own shared lock, so updates can go through between two batches, after which the cover is
+//found again
+class sample_stream {
+
+public:
+
+    sample_stream(b_plus_tree& tree, int low, int high, size_t max_batch = SAMPLE_SIZE);
+
+    //puts the next sample in out, false once there is nothing left in the range
+    bool next(Record& out);
+
+    //number of samples handed out so far
+    size_t produced() const { return handed_out; }
+
+private:
+
+    b_plus_tree& tree;
+
+    //current and largest batch sizes
+    size_t batch = 1;
+    size_t max_batch;
+
+    //the range's pieces, kept between batches
+    b_plus_tree::range_cover cover;
+
+    //samples drawn but not handed out yet
+    vector<Record> pending;
+    size_t position = 0;
+
+    size_t handed_out = 0;
+};
+
 extern const string ROOT_META_FILE;
\ No newline at end of file
@@ -0,0 +1,179 @@
+// --- Work Stealing Thread Pool ---
+
+/*
+References:
+https://en.cppreference.com/w/cpp/thread/condition_variable
+R. D. Blumofe and C. E. Leiserson. Scheduling Multithreaded Computations by Work Stealing. JACM, 1999
+
+--- Thread pool function implementation ---
+
+*/
+
+#include "ThreadPool.hpp"
+
+
+using namespace std;
+
+//the pool and deque index of the calling thread, if it is a worker
+thread_local work_stealing_pool* current_pool = nullptr;
+thread_local size_t current_index = 0;
+
+//constructor, creates a deque for every worker and then starts them
+work_stealing_pool::work_stealing_pool(size_t num_threads) {
+
+    //hardware_concurrency can report 0
+    if (num_threads == 0)
+        num_threads = 1;
+
+    for (size_t i = 0; i < num_threads; ++i)
+        queues.push_back(make_unique<worker_queue>());
+
+    first_stream = reserveStreams(num_threads);
+
+    for (size_t i = 0; i < num_threads; ++i)
+        workers.emplace_back(&work_stealing_pool::workerLoop, this, i);
+}
+
+//destructor, lets the workers finish what is queued before joining them
+work_stealing_pool::~work_stealing_pool() {
+
+    {
+        lock_guard<mutex> lock(idle_latch);
+        stopping = true;
+    }
+
+    idle_signal.notify_all();
+
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+}
+
+//queues a task, wrapped so that the group count goes down once it ran
+void work_stealing_pool::submit(task_group& group, function<void()> task) {
+
+    group.pending++;
+
+    //workers push onto their own deque, everyone else spreads tasks round robin
+    size_t index;
+    if (current_pool == this)
+        index = current_index;
+    else
+        index = next_queue++ % queues.size();
+
+    {
+        lock_guard<mutex> lock(queues[index]->latch);
+
+        queues[index]->tasks.push_back([this, &group, task = move(task)]() {
+
+            //the first exception of the group is kept for wait, the count goes down either way
+            try {
+                task();
+            }
+            catch (...) {
+                lock_guard<mutex> lock(group.latch);
+                if (!group.error)
+                    group.error = current_exception();
+            }
+
+            //the last task of the group wakes whoever waits on it
+            if (--group.pending == 0) {
+                lock_guard<mutex> lock(idle_latch);
+                idle_signal.notify_all();
+            }
+        });
+    }
+
+    //the latch is taken so a thread that just found nothing to run cannot miss the signal
+    {
+        lock_guard<mutex> lock(idle_latch);
+        queued++;
+    }
+
+    idle_signal.notify_all();
+}
+
+//helps with the queued tasks until the group is done, and sleeps while the group's tasks run elsewhere.
+//Rethrows the first exception one of the group's tasks threw
+void work_stealing_pool::wait(task_group& group) {
+
+    //threads outside of the pool start stealing from the first deque
+    size_t index = (current_pool == this) ? current_index : 0;
+
+    while (group.pending > 0) {
+
+        if (runOne(index))
+            continue;
+
+        //nothing to run, sleeps until the group is done or there is something to help with
+        unique_lock<mutex> lock(idle_latch);
+        idle_signal.wait(lock, [&] { return group.pending == 0 || queued > 0; });
+    }
+
+    exception_ptr error;
+    {
+        lock_guard<mutex> lock(group.latch);
+        swap(error, group.error);
+    }
+
+    if (error)
+        rethrow_exception(error);
+}
+
+//takes the newest task from its own deque, otherwise steals the oldest task of another deque
+bool work_stealing_pool::runOne(size_t index) {
+
+    function<void()> task;
+
+    for (size_t i = 0; i < queues.size() && !task; ++i) {
+
+        worker_queue& q = *queues[(index + i) % queues.size()];
+        lock_guard<mutex> lock(q.latch);
+
+        if (q.tasks.empty())
+            continue;
+
+        //own deque: back, like a stack, so it stays on the subtree it is working on
+        if (i == 0) {
+            task = move(q.tasks.back());
+            q.tasks.pop_back();
+        }
+
+        //steals from the front, which holds the biggest pieces of work
+        else {
+            task = move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+    }
+
+    if (!task)
+        return false;
+
+    queued--;
+    task();
+
+    return true;
+}
+
+//worker loop, runs tasks until the pool is destroyed and nothing is left
+void work_stealing_pool::workerLoop(size_t index) {
+
+    current_pool = this;
+    current_index = index;
+
+    //a stream per worker index, not per first draw, so the same seed gives a worker the same stream
+    setThreadStream(first_stream + index);
+
+    while (true) {
+
+        if (runOne(index))
+            continue;
+
+        //nothing to run, sleeps until a task is queued
+        unique_lock<mutex> lock(idle_latch);
+
+        if (stopping && queued == 0)
+            return;
+
+        idle_signal.wait(lock, [this] { return stopping || queued > 0; });
+    }
+}
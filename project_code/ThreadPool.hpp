@@ -0,0 +1,97 @@
+// --- Work Stealing Thread Pool ---
+
+/*
+References:
+https://en.cppreference.com/w/cpp/thread/condition_variable
+R. D. Blumofe and C. E. Leiserson. Scheduling Multithreaded Computations by Work Stealing. JACM, 1999
+
+Small fork-join pool used to split tree work (such as building the RS-tree sample buffers) over
+independent subtrees. Every worker has its own deque: it pushes and pops its own tasks at the back,
+and when it runs out it steals from the front of another worker's deque, as described in [2].
+A thread waiting on a task group keeps running queued tasks instead of sleeping, so tasks can
+submit and wait on their own subtasks without tying up the pool.
+
+--- Thread pool class declaration ---
+
+*/
+
+//a check to make sure that this header file is only included once
+#pragma once
+
+//needed for the pool
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+
+//for the workers' random streams
+#include "rng.hpp"
+
+using namespace std;
+
+class work_stealing_pool {
+
+public:
+
+    //a set of tasks that can be waited on together, along with the first exception one of them threw
+    struct task_group {
+
+        atomic<long int> pending{0};
+
+        mutex latch;
+        exception_ptr error;
+    };
+
+    //starts the given number of workers, one per core by default
+    work_stealing_pool(size_t num_threads = thread::hardware_concurrency());
+
+    //finishes the queued tasks and stops the workers
+    ~work_stealing_pool();
+
+    //queues a task as part of the group, on the calling worker's own deque if called from a task
+    void submit(task_group& group, function<void()> task);
+
+    //returns once every task of the group is done, running queued tasks while waiting and sleeping when there are
+    //none. If a task threw, the first exception is rethrown here once the rest of the group is done
+    void wait(task_group& group);
+
+    //number of workers
+    size_t size() const { return workers.size(); }
+
+private:
+
+    //per worker deque of tasks
+    struct worker_queue {
+
+        mutex latch;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<worker_queue>> queues;
+    vector<thread> workers;
+
+    //number of queued tasks, used by idle workers to know when to wake up
+    atomic<long int> queued{0};
+
+    //used to put idle workers to sleep
+    mutex idle_latch;
+    condition_variable idle_signal;
+    bool stopping = false;
+
+    //used by submits from outside of the pool to spread the tasks over the deques
+    atomic<size_t> next_queue{0};
+
+    //random stream of the first worker, worker i gets first_stream + i
+    uint64_t first_stream;
+
+    //worker loop
+    void workerLoop(size_t index);
+
+    //pops a task from the given deque (or steals one) and runs it, false if nothing was found
+    bool runOne(size_t index);
+};
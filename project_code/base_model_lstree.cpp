@@ -11,6 +11,7 @@
 #include <queue>
 #include <chrono>
 #include <cstdlib>
+#include <filesystem>
 
 //for count()
 #include <bits/stdc++.h>
@@ -21,141 +22,131 @@ using namespace std;
 
 int main() {
 
-    srand(time(0));
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+    //random seeding, SAMPLING_SEED=<number> makes a run repeatable
+    if (seedRandomFromEnv())
+        cout << "Using random seed from SAMPLING_SEED" << endl;
+
+    //a tree kept from an earlier run can be reopened from its catalog instead of being built again
+    bool reopen = false;
+    if (ls_tree::catalogExists("ls_tree_pages")) {
+        string answer;
+        cout << "Found a saved LS-Tree in ls_tree_pages, reopen it instead of building it from a CSV? (y/n): ";
+        getline(cin, answer);
+        reopen = !answer.empty() && (answer[0] == 'y' || answer[0] == 'Y');
+    }
 
-    //get input file
-    string inputFile;
-    cout << "Enter CSV file path: ";
-    getline(cin, inputFile);
+    //anything else left in the directory would get mixed into the new levels
+    if (!reopen)
+        filesystem::remove_all("ls_tree_pages");
 
-    //check if file can be opened
-    ifstream file(inputFile);
-    if (!file.is_open()) {
-        cerr << "Failed to open file." << endl;
-        return 1;
-    }
+    ls_tree tree("ls_tree_pages");
 
+    ifstream file;
     int numRecords = 0;
+    int totalNumRecords = 0;
 
-    //letting user know index construction experiment has begun
-    cout << "Index construction cost experiment beginning now: " << endl ;
+    if (reopen) {
 
+        //only the catalog and the memory level are read, the disk levels open from their root pages
+        auto startOpen = chrono::high_resolution_clock::now();
 
-    //starts the timer, at this point the file should have been found
-	auto startBuild = chrono::high_resolution_clock::now();
+        if (!tree.openCatalog()) {
+            cerr << "Failed to reopen the saved LS-Tree, delete ls_tree_pages and build it again." << endl;
+            return 1;
+        }
 
-    ls_tree tree("ls_tree_pages");
-    max_min_hilbert treesMaxMin;
-    treesMaxMin.max_hilbert = 0;
-    treesMaxMin.min_hilbert = INT64_MAX;
+        auto endOpen = chrono::high_resolution_clock::now();
+        chrono::duration<double, milli> total_timeOpen = endOpen - startOpen;
+
+        totalNumRecords = tree.recordCount();
+        cout << "Reopened LS-Tree with " << totalNumRecords << " records and " << tree.size() << " levels in "
+             << total_timeOpen.count() << " ms" << endl;
+    }
+    else {
+
+        //get input file
+        string inputFile;
+        cout << "Enter CSV file path: ";
+        getline(cin, inputFile);
+
+        //check if file can be opened
+        file.open(inputFile);
+        if (!file.is_open()) {
+            cerr << "Failed to open file." << endl;
+            return 1;
+        }
+
+        //letting user know index construction experiment has begun
+        cout << "Index construction cost experiment beginning now: " << endl ;
 
-    string line;
 
-    //int counter = 0;
-    int directoryCounter = 0;
-    const char LSTreeDir[20] = "ls_tree_pages/btree"; 
-    string directroy = LSTreeDir + to_string(directoryCounter); 
-    string strDCounter; 
-    getline(file, line); // Skip header
+        //starts the timer, at this point the file should have been found
+    	auto startBuild = chrono::high_resolution_clock::now();
+
+        string line;
+
+        getline(file, line); // Skip header
 
     
-    //read data set from file
-    while (getline(file, line)) {
-
-        stringstream ss(line);
-        string idStr, latStr, lonStr, tsStr, hStr;
-
-        //counter to get number of records added to first tree
-        numRecords++; 
-
-        if (getline(ss, idStr, ',') &&
-            getline(ss, latStr, ',') &&
-            getline(ss, lonStr, ',') &&
-            getline(ss, tsStr, ',') &&
-            getline(ss, hStr, ',')) {
-
-            try {
-                Record r;
-                strncpy(r.id, idStr.c_str(), sizeof(r.id));
-                r.id[sizeof(r.id) - 1] = '\0';
-                //cout << "test1" << endl;
-                r.lon = stof(lonStr);
-                r.lat = stof(latStr);
-                strncpy(r.timestamp, tsStr.c_str(), sizeof(r.timestamp));
-                r.timestamp[sizeof(r.timestamp) - 1] = '\0';
-                r.hilbert = stoi(hStr);
-
-                if(r.hilbert > treesMaxMin.max_hilbert) {treesMaxMin.max_hilbert = r.hilbert; } 
-                if(r.hilbert < treesMaxMin.min_hilbert) {treesMaxMin.min_hilbert = r.hilbert; } 
+        //read data set from file
+        while (getline(file, line)) {
+
+            stringstream ss(line);
+            string idStr, latStr, lonStr, tsStr, hStr;
+
+            //counter to get number of records added to first tree
+            numRecords++; 
+
+            if (getline(ss, idStr, ',') &&
+                getline(ss, latStr, ',') &&
+                getline(ss, lonStr, ',') &&
+                getline(ss, tsStr, ',') &&
+                getline(ss, hStr, ',')) {
+
+                try {
+                    Record r;
+                    strncpy(r.id, idStr.c_str(), sizeof(r.id));
+                    r.id[sizeof(r.id) - 1] = '\0';
+                    //cout << "test1" << endl;
+                    r.lon = stof(lonStr);
+                    r.lat = stof(latStr);
+                    strncpy(r.timestamp, tsStr.c_str(), sizeof(r.timestamp));
+                    r.timestamp[sizeof(r.timestamp) - 1] = '\0';
+                    r.hilbert = stoi(hStr);
+
+                    //goes to all of its levels at once, the hilbert ranges of the levels are kept by the tree
+                    tree.buildAppend(r);
                 
-                tree.addToTree(directroy, r.hilbert, r);
                 
-                
-            }
+                }
             
-            //error catching for debugging
-            catch (const exception& e) {
-                cerr << "Invalid line (skipping): " << line << "\\n";
-                cerr << "  Error: " << e.what() << "\\n";
-            }
-        } 
-    }
-
-    //ONCE WHOLE FILE IS READ, CREATE SMALLER TREES FROM SAMPLING (COIN-FLIP)
-    //int numRecords = counter; 
-    cout << "num of records in csv: " << numRecords << endl; 
-    //cout << "finished first tree" << endl; 
-    int totalNumRecords = numRecords; 
-    // numRecords = numRecords / 2; 
-    // directoryCounter++;
-    // strDCounter = to_string(directoryCounter);
-    // directroy = LSTreeDir + strDCounter; 
-    tree.maxMin.push_back(treesMaxMin); 
-
-    vector<string> prev_records; 
-    
-    //cout << "starting trees after btree0 " << endl; 
-
-    //build the next trees
-    //continues until less than 256K nodes (Page 7, Wang et al.)
-
-    while(numRecords > 256000) {
-        numRecords = numRecords / 2; 
-        directoryCounter++;
-        strDCounter = to_string(directoryCounter);
-        directroy = LSTreeDir + strDCounter; 
-        //cout << "Inserting to " << directroy << endl; 
-
-        b_plus_tree& prevTree = tree.levels.rbegin()->second;
-        vector<Record> prevTreeRecords = tree.getRecords(prevTree) ;
-        for (size_t i = 0; i < prevTreeRecords.size(); i++)
-        {
-            if (rand() % 2 == 1) {
-                //insert into next tree
-                tree.addToTree(directroy, prevTreeRecords[i].hilbert, prevTreeRecords[i]);
-                
-
+                //error catching for debugging
+                catch (const exception& e) {
+                    cerr << "Invalid line (skipping): " << line << "\\n";
+                    cerr << "  Error: " << e.what() << "\\n";
+                }
             } 
         }
-        tree.maxMin.push_back(treesMaxMin); 
-    }
-    
-
-    
-    //cout << "finished making trees and now inserting memoryTree" << endl; 
 
+        //every level was filled while reading, this closes the disk levels and sets up the memory level
+        cout << "num of records in csv: " << numRecords << endl; 
+        totalNumRecords = numRecords; 
 
-    tree.insertMemoryTree(directroy);
+        tree.finishBuild();
 
-    //cout << "completed insertMemoryTree" << endl; 
+        //cout << "completed insertMemoryTree" << endl; 
     
 
-    //ends timer after sorted data set is complete, calculates elapsed time
-	auto endBuild = std::chrono::high_resolution_clock::now();
-	chrono::duration<double> total_timeBuild = endBuild - startBuild;
-    cout << "Tree built from CSV and stored on disk, except last tree in memory.\n";
-	cout << "Index Construction Cost: " << total_timeBuild.count() << " seconds" << endl;
+        //ends timer after sorted data set is complete, calculates elapsed time
+    	auto endBuild = std::chrono::high_resolution_clock::now();
+    	chrono::duration<double> total_timeBuild = endBuild - startBuild;
+        cout << "Tree built from CSV and stored on disk, except last tree in memory.\n";
+    	cout << "Index Construction Cost: " << total_timeBuild.count() << " seconds" << endl;
+
+        //the catalog lets a later run reopen this tree instead of building it again
+        if (!tree.saveCatalog())
+            cerr << "Could not save the LS-Tree catalog" << endl;
+    }
 
 
     //give user max and min of LS-Tree
@@ -165,6 +156,16 @@ int main() {
 
 
 
+    //the levels of a query can be scanned at the same time, on one worker per core
+    unique_ptr<work_stealing_pool> queryPool;
+    string parallelInput;
+    cout << "Scan the LS-Tree levels in parallel during queries? (y/n): ";
+    cin >> parallelInput;
+    if (!parallelInput.empty() && (parallelInput[0] == 'y' || parallelInput[0] == 'Y')) {
+        queryPool = make_unique<work_stealing_pool>();
+        cout << "Querying with " << queryPool->size() << " threads" << endl;
+    }
+
     //menu to select what experiment to do next
     int experimentInput = -1;
 
@@ -187,16 +188,27 @@ int main() {
             cout << "Now inserting 5000 records into LS-Tree" << endl; 
             
 
-            b_plus_tree& firstTree = tree.levels.begin()->second;
-            //get records then shuffle, then insert 500 
-            vector<Record> firstTreeRecords = tree.getRecords(firstTree) ;
-            shuffle (firstTreeRecords.begin(), firstTreeRecords.end(), default_random_engine(seed));
+            //5001 random records of level 0 (the full data set), picked by a reservoir while streaming through the
+            //level, so the level is never held in memory, then shuffled for the insert order
+            reservoir_sampler<Record> picker(5001, threadRng());
+            tree.scanLevel(0, INT_MIN, INT_MAX, [&](const Record* first, const Record* last) {
+                for (const Record* it = first; it < last; ) {
+                    size_t skipped = min(picker.skip(), (size_t) (last - it));
+                    picker.pass(skipped);
+                    it += skipped;
+                    if (it < last)
+                        picker.offer(*it++);
+                }
+                return true;
+            });
+            vector<Record> firstTreeRecords = picker.take();
+            shuffle (firstTreeRecords.begin(), firstTreeRecords.end(), threadRng());
 
             //capture time for every 50 insertions
             vector<double> insertTimes; 
             int increments = 50; 
             auto startInsert = chrono::high_resolution_clock::now();
-            for (int i = 0; i < 5001; i++)
+            for (int i = 0; i < (int) firstTreeRecords.size(); i++)
             {
                     //insert into next tree
                     //tree.addToTree(directroy, firstTreeRecords[i].hilbert, firstTreeRecords[i]);
@@ -220,8 +232,8 @@ int main() {
             //chrono::duration<double> total_timeInsert = endInsert - startInsert;
             cout << "Insertion Cost experiment over. " << endl;
 
-            vector<Record> treeAfterInsert = tree.getRecords(tree.levels.begin()->second);
-            cout << "num records after insertion: " << treeAfterInsert.size() << endl; 
+            //the tree keeps count of its records, including the ones still in the insert buffer
+            cout << "num records after insertion: " << tree.recordCount() << endl; 
 
             //give yourself a lil break between inserts and deletes 
             sleep(2); 
@@ -234,7 +246,7 @@ int main() {
             //reset increments for deletions
             increments = 50; 
             auto startDeletion = std::chrono::high_resolution_clock::now();
-            for (int i = 0; i < 5001; i++)
+            for (int i = 0; i < (int) firstTreeRecords.size(); i++)
             {
                     //insert into next tree
                     //tree.addToTree(directroy, firstTreeRecords[i].hilbert, firstTreeRecords[i]);
@@ -251,8 +263,7 @@ int main() {
                 totalNumRecords--;
             }
 
-            vector<Record> treeAfterDelete = tree.getRecords(tree.levels.begin()->second);
-            cout << "num records after deletion: " << totalNumRecords << endl; 
+            cout << "num records after deletion: " << tree.recordCount() << endl; 
 
 
             //auto endDeletion = std::chrono::high_resolution_clock::now();
@@ -290,7 +301,7 @@ int main() {
 
 
             auto startQueryK = chrono::high_resolution_clock::now();
-            vector<Record> results = tree.querying(minInput, maxInput, kInput); 
+            vector<Record> results = tree.querying(minInput, maxInput, kInput, nullptr, queryPool.get()); 
             //cout << "getting out of querying" << endl; 
 
             //printed out for smaller values and testing
@@ -338,7 +349,7 @@ int main() {
             cout << "Starting experiment... " << endl; 
 
             auto startQueryQ = chrono::high_resolution_clock::now();
-            vector<Record> results = tree.querying(minInput, maxInput, kInput); 
+            vector<Record> results = tree.querying(minInput, maxInput, kInput, nullptr, queryPool.get()); 
 
             //printed out for smaller values and testing
             /*for (size_t i = 0; i < results.size(); i++)
@@ -366,20 +377,27 @@ int main() {
     file.close();
 
 
-    //cleans up disk directory
-    int status1 = system("rm -rf ls_tree_pages");
-    if (status1 == 0)
-        cout << "removed ls_tree_pages" << endl; 
-    else
-        cerr << "error in cleanup" << endl;
-
-      //cleans up memory directory
-      int status2 = system("rm -rf /tmp/inMemoryTree");
-      if (status2 == 0)
-          cout << "removed /tmp/inMemoryTree" << endl; 
-      else
-          cerr << "error in cleanup" << endl;
-  
+    //the tree can be kept for the next run, with the catalog brought up to date after any updates
+    string keep;
+    cout << "Keep the LS-Tree in ls_tree_pages for the next run? (y/n): ";
+    cin >> keep;
+
+    if (!keep.empty() && (keep[0] == 'y' || keep[0] == 'Y')) {
+        if (tree.saveCatalog())
+            cout << "saved ls_tree_pages" << endl;
+        else
+            cerr << "Could not save the LS-Tree catalog" << endl;
+    }
+    else {
+
+        //cleans up disk directory
+        int status1 = system("rm -rf ls_tree_pages");
+        if (status1 == 0)
+            cout << "removed ls_tree_pages" << endl; 
+        else
+            cerr << "error in cleanup" << endl;
+    }
+
 
     return 0;
 }
\ No newline at end of file
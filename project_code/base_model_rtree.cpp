@@ -7,6 +7,7 @@ Used in some experiments as is
 
 //h_rtree header files
 #include "rtree.hpp"
+#include "rng.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -74,9 +75,9 @@ void print_children( b_plus_tree& tree) {
 
 int main() {
 
-    //random seeding
-    srand(time(0));
-    unsigned seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    //random seeding, SAMPLING_SEED=<number> makes a run repeatable
+    if (seedRandomFromEnv())
+        cout << "Using random seed from SAMPLING_SEED" << endl;
 
 
     string inputFile;
@@ -237,7 +238,7 @@ int main() {
             file.close();
 
             //shuffle
-            shuffle(records_to_be_shuffled.begin(), records_to_be_shuffled.end(), default_random_engine(seed));
+            shuffle(records_to_be_shuffled.begin(), records_to_be_shuffled.end(), threadRng());
             
             //capture time for every 50 insertions
             vector<double> insertTimes; 
@@ -0,0 +1,140 @@
+// --- LS-tree reopen benchmark ---
+
+/*
+Builds an LS-tree, saves its catalog, and then times reopening it from the catalog against the build. Reopening
+only reads the catalog and the memory level snapshot, the disk levels open from their root pages. A query is run
+on the reopened tree to make sure it is usable.
+
+usage: ./bench_ls_reopen [sorted csv]
+The csv is in the format the LS-tree main reads (id, lat, lon, timestamp, hilbert value), without one 600000
+made up records are used.
+*/
+
+#include "../LSTree.hpp"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <chrono>
+#include <climits>
+
+using namespace std;
+
+//made up records when there is no csv, 3 per hilbert value
+constexpr int MADE_UP_RECORDS = 600000;
+
+//reads the records of a sorted csv, skipping its header
+static vector<Record> loadCsv(const string& path) {
+
+    vector<Record> records;
+
+    ifstream file(path);
+    string line;
+    getline(file, line);
+
+    while (getline(file, line)) {
+
+        stringstream ss(line);
+        string id, lat, lon, timestamp, hilbert;
+
+        getline(ss, id, ',');
+        getline(ss, lat, ',');
+        getline(ss, lon, ',');
+        getline(ss, timestamp, ',');
+        getline(ss, hilbert, ',');
+
+        Record rec{};
+        strncpy(rec.id, id.c_str(), sizeof(rec.id) - 1);
+        strncpy(rec.timestamp, timestamp.c_str(), sizeof(rec.timestamp) - 1);
+        rec.lat = stof(lat);
+        rec.lon = stof(lon);
+        rec.hilbert = stoi(hilbert);
+
+        records.push_back(rec);
+    }
+
+    return records;
+}
+
+//milliseconds since start
+static double msSince(chrono::steady_clock::time_point start) {
+
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+
+    vector<Record> records;
+
+    if (argc > 1) {
+        records = loadCsv(argv[1]);
+    }
+    else {
+        for (int i = 0; i < MADE_UP_RECORDS; i++) {
+
+            Record rec{};
+            snprintf(rec.id, sizeof(rec.id), "r%d", i);
+            rec.hilbert = i / 3;
+            records.push_back(rec);
+        }
+    }
+
+    if (records.empty()) {
+        cout << "no records" << endl;
+        return 1;
+    }
+
+    const string dir = "bench_pages_ls";
+    filesystem::remove_all(dir);
+
+    double build_ms;
+    double save_ms;
+
+    {
+        ls_tree tree(dir);
+
+        auto start = chrono::steady_clock::now();
+
+        for (const Record& rec : records)
+            tree.buildAppend(rec);
+
+        tree.finishBuild();
+
+        build_ms = msSince(start);
+        start = chrono::steady_clock::now();
+
+        if (!tree.saveCatalog()) {
+            cout << "could not save the catalog" << endl;
+            return 1;
+        }
+
+        save_ms = msSince(start);
+    }
+
+    double open_ms;
+    size_t sampled;
+
+    {
+        ls_tree tree(dir);
+
+        auto start = chrono::steady_clock::now();
+
+        if (!tree.openCatalog()) {
+            cout << "could not reopen the tree" << endl;
+            return 1;
+        }
+
+        open_ms = msSince(start);
+
+        sampled = tree.querying(INT_MIN, INT_MAX, 1000).size();
+    }
+
+    cout << records.size() << " records" << endl;
+    printf("build:   %10.1f ms\n", build_ms);
+    printf("save:    %10.1f ms\n", save_ms);
+    printf("reopen:  %10.1f ms (%zu samples from the reopened tree)\n", open_ms, sampled);
+
+    filesystem::remove_all(dir);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+// --- RS-tree multi-query benchmark ---
+
+/*
+Times one multiSample batch of 300 nearby range queries against the same queries run one at a time with
+RandomPathRS and with SampleFirstRS (the first 30 of them), and counts the pages each of them reads. The
+results are per query. Each query covers two steps of the
+data's hilbert range and starts one step after the previous one, so neighbouring queries overlap by half.
+
+usage: ./bench_rs_multi_sample [sorted csv] [k]
+The csv is in the format the RS-tree main reads (id, lat, lon, timestamp, hilbert value), without one 30000
+made up records are used. k is the number of samples per query, 50 by default.
+*/
+
+#include "../RStree.hpp"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <chrono>
+#include <climits>
+
+using namespace std;
+
+//number of queries in the batch
+constexpr int QUERIES = 300;
+
+//SampleFirstRS rejects everything out of range and so is far slower on small ranges, only this many of the
+//queries are run with it
+constexpr int SAMPLE_FIRST_QUERIES = 30;
+
+//made up records when there is no csv, 5 per hilbert value
+constexpr int MADE_UP_RECORDS = 30000;
+
+//reads the records of a sorted csv, skipping its header
+static vector<Record> loadCsv(const string& path) {
+
+    vector<Record> records;
+
+    ifstream file(path);
+    string line;
+    getline(file, line);
+
+    while (getline(file, line)) {
+
+        stringstream ss(line);
+        string id, lat, lon, timestamp, hilbert;
+
+        getline(ss, id, ',');
+        getline(ss, lat, ',');
+        getline(ss, lon, ',');
+        getline(ss, timestamp, ',');
+        getline(ss, hilbert, ',');
+
+        Record rec{};
+        strncpy(rec.id, id.c_str(), sizeof(rec.id) - 1);
+        strncpy(rec.timestamp, timestamp.c_str(), sizeof(rec.timestamp) - 1);
+        rec.lat = stof(lat);
+        rec.lon = stof(lon);
+        rec.hilbert = stoi(hilbert);
+        rec.weight = 1.0f;
+
+        records.push_back(rec);
+    }
+
+    return records;
+}
+
+//milliseconds since start
+static double msSince(chrono::steady_clock::time_point start) {
+
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+
+    size_t k = argc > 2 ? stoul(argv[2]) : 50;
+
+    vector<Record> records;
+
+    if (argc > 1) {
+        records = loadCsv(argv[1]);
+    }
+    else {
+        for (int i = 0; i < MADE_UP_RECORDS; i++) {
+
+            Record rec{};
+            snprintf(rec.id, sizeof(rec.id), "r%d", i);
+            rec.hilbert = i / 5;
+            rec.weight = 1.0f;
+            records.push_back(rec);
+        }
+    }
+
+    if (records.empty()) {
+        cout << "no records" << endl;
+        return 1;
+    }
+
+    const string dir = "bench_pages_rs";
+    filesystem::remove_all(dir);
+
+    {
+        b_plus_tree tree(dir);
+
+        for (const Record& rec : records)
+            tree.insert(rec.hilbert, rec, true);
+
+        tree.buildAllSamples();
+
+        //300 ranges, two steps wide, one step apart
+        int low = records.front().hilbert;
+        int high = records.back().hilbert;
+        int step = max((high - low) / (QUERIES + 1), 1);
+
+        vector<sample_request> requests;
+        for (int q = 0; q < QUERIES; q++)
+            requests.push_back({low + q * step, low + (q + 2) * step, k});
+
+        //the random-path queries read every leaf the others need, so running them once warms up the page cache
+        tree.multiSample(requests);
+        for (const sample_request& request : requests)
+            tree.RandomPathRS(request.low, request.high, request.k);
+
+        auto start = chrono::steady_clock::now();
+        long int pages = page_handler::threadPageReads();
+
+        tree.multiSample(requests);
+
+        double multi_ms = msSince(start);
+        long int multi_pages = page_handler::threadPageReads() - pages;
+
+        start = chrono::steady_clock::now();
+        pages = page_handler::threadPageReads();
+
+        for (const sample_request& request : requests)
+            tree.RandomPathRS(request.low, request.high, request.k);
+
+        double path_ms = msSince(start);
+        long int path_pages = page_handler::threadPageReads() - pages;
+
+        start = chrono::steady_clock::now();
+        pages = page_handler::threadPageReads();
+
+        for (int q = 0; q < SAMPLE_FIRST_QUERIES; q++)
+            tree.SampleFirstRS(requests[q].low, requests[q].high, requests[q].k);
+
+        double first_ms = msSince(start);
+        long int first_pages = page_handler::threadPageReads() - pages;
+
+        cout << records.size() << " records, " << QUERIES << " queries of k = " << k << ", per query:" << endl;
+        printf("multiSample:    %10.3f ms %10.1f pages\n", multi_ms / QUERIES, (double) multi_pages / QUERIES);
+        printf("RandomPathRS:   %10.3f ms %10.1f pages\n", path_ms / QUERIES, (double) path_pages / QUERIES);
+        printf("SampleFirstRS:  %10.3f ms %10.1f pages\n", first_ms / SAMPLE_FIRST_QUERIES,
+               (double) first_pages / SAMPLE_FIRST_QUERIES);
+    }
+
+    filesystem::remove_all(dir);
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+# --- Disk sort benchmark ---
+#
+# Times the disk sort on a made up csv of points in random order, against disk_based_sort.cpp as it was at an
+# earlier revision (any commit or branch git show takes, e.g. the one before a sort change), and checks that both
+# put the records in the same hilbert order. Both are built with the chunk size fixed instead of taken from
+# chunk_calculator, so they split the input into the same number of runs no matter how much memory there is.
+#
+# usage: benchmarks/bench_sort.sh <revision> [records] [records per chunk]
+# Run from project_code. 600000 records in chunks of 50000 (12 runs) by default.
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "usage: benchmarks/bench_sort.sh <revision> [records] [records per chunk]"
+    exit 1
+fi
+
+REVISION=$1
+RECORDS=${2:-600000}
+CHUNK=${3:-50000}
+
+CXX=${CXX:-g++}
+CXXFLAGS="-std=c++17 -O2 -I$(pwd)"
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# the same input every time, in the format the sort reads (id, latitude, longitude, timestamp)
+awk -v n="$RECORDS" 'BEGIN {
+    srand(50)
+    print "id,latitude,longitude,timestamp"
+    for (i = 0; i < n; i++)
+        printf "id%d,%.4f,%.4f,2020-01-01 00:00:00\n", i, rand() * 100, rand() * 100
+}' > "$WORK/input.csv"
+
+# builds a copy of the sort with the chunk size fixed
+build() {
+    sed "s/size_t chunk_size = chunk_calculator();/size_t chunk_size = $CHUNK;/" "$1" > "$WORK/$2.cpp"
+    grep -q "size_t chunk_size = $CHUNK;" "$WORK/$2.cpp" || { echo "could not fix the chunk size of $2"; exit 1; }
+    $CXX $CXXFLAGS -o "$WORK/$2" "$WORK/$2.cpp"
+}
+
+# runs a copy in its own directory, where it writes its runs, and prints the time it reports
+run() {
+    mkdir -p "$WORK/run_$1"
+    (cd "$WORK/run_$1" && printf '%s\n%s\n' "$WORK/input.csv" "$WORK/$1.csv" | "$WORK/$1" | grep -o "[0-9.]* seconds")
+}
+
+build disk_based_sort.cpp current
+
+git show "$REVISION:./disk_based_sort.cpp" > "$WORK/baseline_source.cpp"
+build "$WORK/baseline_source.cpp" baseline
+
+echo "$RECORDS records, chunks of $CHUNK"
+echo "baseline ($REVISION): $(run baseline)"
+echo "current:             $(run current)"
+
+# the hilbert value is the last column of both outputs
+if cmp -s "$WORK/baseline.csv" "$WORK/current.csv" ||
+   [ "$(awk -F, 'NR > 1 { print $NF }' "$WORK/baseline.csv" | cksum)" = "$(awk -F, 'NR > 1 { print $NF }' "$WORK/current.csv" | cksum)" ]; then
+    echo "same hilbert order"
+else
+    echo "the outputs are in a different hilbert order"
+    exit 1
+fi
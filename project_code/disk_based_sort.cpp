@@ -10,6 +10,14 @@ external merge sort which splits the data into chunks that fit within memory, so
 value, saves the chunks to disk, and then merges the sorted chunks into a final sorted .csv file. The resulting output csv 
 file is sorted by Hilbert value as specified in Wang et al. Inspiration for the merging algorithm used is from geeksforgeeks.
 
+The sorted chunks (runs) are saved as fixed width binary records with the Hilbert value first and the fields as the
+text they were read as, written and read back in large blocks. The merge only compares the Hilbert values, and a
+record is turned back into a csv line once, when it goes to the output file. A line with a field that does not fit
+its slot is reported and left out, instead of being cut.
+
+The input is id, latitude, longitude, timestamp, with an optional fifth weight column (for the RS-tree's weighted
+sampling) if the header has one. The weight is written after the Hilbert value, where the RS-tree main reads it.
+
 Run this on the desired .csv to be used in tree construction. Will perform an external merge sort by Hilbert value
 
 */
@@ -27,7 +35,9 @@ Run this on the desired .csv to be used in tree construction. Will perform an ex
 #include <vector>
 #include <queue>
 #include <cstdint>
+#include <cstring>
 #include <string>
+#include <stdexcept>
 
 //needed for calculations
 #include <algorithm>
@@ -42,17 +52,39 @@ using namespace std;
 //global min and max coord values used for hilbert calc
 double lat_min, lat_max, lon_min, lon_max;
 
-//custom structure for records from both geolife and osm .csv files
+//whether the input has the weight column, from its header
+bool has_weight = false;
+
+//lines that could not be sorted, reported and left out
+size_t rejected_lines = 0;
+
+//widths of the text fields of a run record, plus 1 for \0. A line with a longer field is rejected (the trees keep
+//24 characters of an id and 28 of a timestamp anyways)
+constexpr size_t RUN_ID_LEN = 32;
+constexpr size_t RUN_COORD_LEN = 24;
+constexpr size_t RUN_TIMESTAMP_LEN = 32;
+
+//records read or written at once per run file, about half a MB
+constexpr size_t RUN_BLOCK_RECORDS = 4096;
+
+//used for packing alignment, so the records are written exactly as laid out
+#pragma pack(push, 1)
+
+//custom structure for records from both geolife and osm .csv files, in the fixed width binary form used both
+//for sorting a chunk in memory and for the run files
 struct record{
 
-	//each represent the elements in a record 
-	string id;
-	string latitude;
-	string longitude;
-	string timestamp;
+	//hilbert_value to be used for sorting, first so the merge only has to look at the start of a record
+	int32_t hilbert_value;
+
+	//each represent the elements in a record, as the text from the input file
+	char id[RUN_ID_LEN];
+	char latitude[RUN_COORD_LEN];
+	char longitude[RUN_COORD_LEN];
+	char timestamp[RUN_TIMESTAMP_LEN];
 
-	//hilbert_value to be used for sorting
-	int hilbert_value;
+	//optional sampling weight, empty if the input has none
+	char weight[RUN_COORD_LEN];
 
 	//sorts the records by hilbert value, ascending
 	bool operator<(const record& other) const {
@@ -62,21 +94,37 @@ struct record{
 
 };
 
-//heap node to be used for k sorting, as used in geeksforgeeks external merge sorting
+#pragma pack(pop)
+
+//heap node to be used for k sorting, as used in geeksforgeeks external merge sorting. Only the key and where the
+//record is, the record itself stays in its run's block
 struct heap_node{
 
-	//record instance
-    record record_instance;
+	//hilbert value of the record
+    int32_t hilbert_value;
 
     //source file index
     int file_index; // Index of source file
 
-    //sorts records by hilbert value, ascending
+    //sorts records by hilbert value, ascending, and runs in order on ties so equal keys keep the input order
     bool operator>(const heap_node& other) const {
-        return record_instance.hilbert_value > other.record_instance.hilbert_value;
+        if (hilbert_value != other.hilbert_value)
+            return hilbert_value > other.hilbert_value;
+        return file_index > other.file_index;
     }
 };
 
+//a run file being merged, with its current block of records
+struct run_reader{
+
+	ifstream in;
+	vector<record> block;
+	size_t position = 0;
+
+	//reads the next block, false at the end of the run
+	bool refill();
+};
+
 
 //used to dynamically calculate the best chunk size to use, based on current system specs and assuming 
 //only up to 10% of available RAM is to be used, as to maintain overall system performance
@@ -89,12 +137,15 @@ record parse_line_and_calc_hilbert(const string& line, double lat_min, double la
 //used to read in chunk of lines from input.csv, returns chunk_size amount of records in vector form
 vector<record> records_to_chunks(ifstream& filename, size_t chunk_size);
 
-//used to write a record chunk into a temporary .csv file
-void chunks_to_temp_csv(const vector<record>& record_vector, int chunk_id);
+//used to write a sorted record chunk into a binary run file
+void chunks_to_temp_run(const vector<record>& record_vector, int chunk_id);
 
-//used to merge chunks into a sorted .csv file, using priority queue
+//used to merge the runs into a sorted .csv file, using priority queue, and removes the run files after
 void merge_chunks(int num_chunks, const string& filename);
 
+//name of a run file
+string run_file(int chunk_id);
+
 //main function to take in user input
 int main(){
 
@@ -122,10 +173,12 @@ int main(){
 	//starts the timer, at this point the file should have been found
 	auto start = chrono::high_resolution_clock::now();
 
-	//saves the header from the input file to be used later'
+	//saves the header from the input file to be used later, a fifth column is the weight
 	string header;
 	getline(in, header);
 
+	has_weight = count(header.begin(), header.end(), ',') >= 4;
+
 	//debugging
 	//cout<<chunk_calculator()<<endl;head 
 
@@ -152,11 +205,12 @@ int main(){
 			break;
 		}
 
-		//run sort to sort the records in the record_vector by hilbert value, uses bool defined operator
-		sort(record_vector.begin(), record_vector.end());
+		//run sort to sort the records in the record_vector by hilbert value, uses bool defined operator. Stable,
+		//so records with the same hilbert value stay in input order
+		stable_sort(record_vector.begin(), record_vector.end());
 
 		//create chunk file
-		chunks_to_temp_csv(record_vector, chunk_id++);
+		chunks_to_temp_run(record_vector, chunk_id++);
 
 	}
 
@@ -168,19 +222,19 @@ int main(){
 	ofstream out(output_csv);
 
 	//writes the header to the output_file
-	out << "id,latitude,longitude,timestamp,hilbert_value" << "\n";
+	out << "id,latitude,longitude,timestamp,hilbert_value" << (has_weight ? ",weight" : "") << "\n";
 	out.close();
 
-	//ends timer after sorted data set is complete, calculates elapsed time
+	//merge all chunk files into one gigafile
+	merge_chunks(chunk_id, output_csv);
+
+	//ends timer after sorted data set is complete (merge included), calculates elapsed time
 	auto end = std::chrono::high_resolution_clock::now();
 	chrono::duration<double> total_time = end - start;
 	cout << "Total sorting time elapsed: " << total_time.count() << " seconds" << endl;
 
-	//merge all chunk files into one gigafile
-	merge_chunks(chunk_id, output_csv);
-
-	//removes the residual chunk_0.csv file
-	filesystem::remove("chunk_0.csv");
+	if (rejected_lines > 0)
+		cerr << rejected_lines << " invalid lines were left out of the sorted file" << endl;
 
 	return 0;
 
@@ -201,16 +255,33 @@ size_t chunk_calculator(){
 	//from this, only going to use 25% to avoid issues
 	size_t actual_memory = available_memory / 25;
 
-	//using a sample OSM csv file, divided its file size (31732283 bytes) by total number of records (457809) to
-	//determine that each record is about 69 bytes. I rounded to 80 for some padding just in case scaling increases
-	//record size (though it shouldn't)
-	size_t record_size = 80;
+	//records are kept in their fixed width form while a chunk is sorted
+	size_t record_size = sizeof(record);
 
 	//return the actual free memory that can be used / the record size - corresponds to chunk size
 	return (actual_memory/record_size)	;
 
 }
 
+//copies a field into its fixed width slot with the line breaks taken out, throws if it does not fit
+static void copy_field(char* slot, size_t width, const string& field, const char* name){
+
+	size_t length = 0;
+
+	for (char c : field) {
+
+		if (c == '\n' || c == '\r')
+			continue;
+
+		if (length == width - 1)
+			throw length_error(string(name) + " is longer than " + to_string(width - 1) + " characters");
+
+		slot[length++] = c;
+	}
+
+	memset(slot + length, 0, width - length);
+}
+
 record parse_line_and_calc_hilbert(const string& line, double lat_min, double lat_max,
                                 double lon_min, double lon_max){
 
@@ -218,7 +289,7 @@ record parse_line_and_calc_hilbert(const string& line, double lat_min, double la
 	stringstream ss(line);
 
 	//record elements as variables
-	string id, lat, lon, ts;
+	string id, lat, lon, ts, weight;
 
 	//extract the values from the line
 	getline(ss, id, ',');
@@ -226,16 +297,27 @@ record parse_line_and_calc_hilbert(const string& line, double lat_min, double la
     getline(ss, lon, ',');
     getline(ss, ts, ',');
 
+    if (has_weight)
+    	getline(ss, weight, ',');
+
 
     //convert lon and lat to doubles for hilbert value calculation
     double latitude = stod(lat);
     double longitude = stod(lon);
 
     //calculate hilbert using the hilbert.h function, wiht p set to 8
-    int hilbert = coords_to_hilbert_value(latitude, longitude, lat_min, lat_max, lon_min, lon_max, 8);
+    record rec;
+    rec.hilbert_value = coords_to_hilbert_value(latitude, longitude, lat_min, lat_max, lon_min, lon_max, 8);
+
+    //the fields are kept as text, the timestamp is sanitized here once instead of at every merge step
+    copy_field(rec.id, RUN_ID_LEN, id, "id");
+    copy_field(rec.latitude, RUN_COORD_LEN, lat, "latitude");
+    copy_field(rec.longitude, RUN_COORD_LEN, lon, "longitude");
+    copy_field(rec.timestamp, RUN_TIMESTAMP_LEN, ts, "timestamp");
+    copy_field(rec.weight, RUN_COORD_LEN, weight, "weight");
 
     //return record instance
-    return {id, lat, lon, ts, hilbert};
+    return rec;
 }
 
 
@@ -254,7 +336,16 @@ vector<record> records_to_chunks(ifstream& filename, size_t chunk_size){
     while (count < chunk_size && getline(filename, line)) {
 
     	//parses the line, gets the hilbert value, and adds to record_vector
-        record_vector.push_back(parse_line_and_calc_hilbert(line, lat_min, lat_max, lon_min, lon_max));
+    	try {
+        	record_vector.push_back(parse_line_and_calc_hilbert(line, lat_min, lat_max, lon_min, lon_max));
+        }
+
+        //a field that does not fit or a coordinate that is not a number, the line is left out
+        catch (const exception& e) {
+        	cerr << "Invalid line (skipping): " << line << "\n";
+        	cerr << "  Error: " << e.what() << "\n";
+        	rejected_lines++;
+        }
 
         //increment counter
         count++;
@@ -265,22 +356,66 @@ vector<record> records_to_chunks(ifstream& filename, size_t chunk_size){
 }
 
 
-void chunks_to_temp_csv(const vector<record>& record_vector, int chunk_id){
+string run_file(int chunk_id){
+
+	return "chunk_" + to_string(chunk_id) + ".run";
+}
+
+
+void chunks_to_temp_run(const vector<record>& record_vector, int chunk_id){
 
 	//creates a file using the provided chunk_id and an outstream instance
-	ofstream out("chunk_" + to_string(chunk_id) + ".csv");
+	ofstream out(run_file(chunk_id), ios::binary | ios::trunc);
+
+	//the records are already in their on disk form, so they go out a block at a time
+    for (size_t i = 0; i < record_vector.size(); i += RUN_BLOCK_RECORDS) {
 
-	//adds record values into .csv file
-    for (size_t i = 0; i < record_vector.size(); i++) {
-        out << record_vector[i].id << "," << record_vector[i].latitude << "," << record_vector[i].longitude << "," << record_vector[i].timestamp << "," << record_vector[i].hilbert_value << "\n";
+    	size_t count = min(RUN_BLOCK_RECORDS, record_vector.size() - i);
+        out.write(reinterpret_cast<const char*>(record_vector.data() + i), count * sizeof(record));
     }
 }
 
 
+bool run_reader::refill(){
+
+	block.resize(RUN_BLOCK_RECORDS);
+	in.read(reinterpret_cast<char*>(block.data()), RUN_BLOCK_RECORDS * sizeof(record));
+
+	//the last block of a run is usually a partial one
+	block.resize(in.gcount() / sizeof(record));
+	position = 0;
+
+	return !block.empty();
+}
+
+
+//appends a record's csv line to the output buffer
+static void append_line(string& buffer, const record& rec){
+
+	buffer.append(rec.id, strnlen(rec.id, RUN_ID_LEN));
+	buffer += ',';
+	buffer.append(rec.latitude, strnlen(rec.latitude, RUN_COORD_LEN));
+	buffer += ',';
+	buffer.append(rec.longitude, strnlen(rec.longitude, RUN_COORD_LEN));
+	buffer += ',';
+	buffer.append(rec.timestamp, strnlen(rec.timestamp, RUN_TIMESTAMP_LEN));
+	buffer += ',';
+	buffer += to_string(rec.hilbert_value);
+
+	//the RS-tree main reads the weight after the hilbert value, it is left off when the input had none
+	if (rec.weight[0] != '\0') {
+		buffer += ',';
+		buffer.append(rec.weight, strnlen(rec.weight, RUN_COORD_LEN));
+	}
+
+	buffer += '\n';
+}
+
+
 void merge_chunks(int num_chunks, const string& filename){
 
-	//creates vector of input streams for each chunk file
-	vector<ifstream> inputs(num_chunks);
+	//creates vector of readers for each run file
+	vector<run_reader> inputs(num_chunks);
 
 	//creates priority queue based on the custom heap_node struct, defined as min_heap 
     priority_queue<heap_node, vector<heap_node>, greater<>> min_heap;
@@ -289,46 +424,51 @@ void merge_chunks(int num_chunks, const string& filename){
     for (int i = 0; i < num_chunks; ++i) {
 
     	//opens the file based on the iteration
-        inputs[i].open("chunk_" + to_string(i) + ".csv");
+        inputs[i].in.open(run_file(i), ios::binary);
 
-        //using line, pushes first records into min_heap
-        string line;
-        if (getline(inputs[i], line)) {
-            min_heap.push({parse_line_and_calc_hilbert(line, lat_min, lat_max, lon_min, lon_max), i});
+        //pushes the first key of every run into min_heap
+        if (inputs[i].refill()) {
+            min_heap.push({inputs[i].block[0].hilbert_value, i});
         }
     }
 
     //create output stream instance to write to output file
     ofstream out(filename, ios::app);
 
+    //lines are gathered and written about a MB at a time
+    const size_t output_block = 1 << 20;
+    string pending;
+    pending.reserve(output_block + 256);
+
     //does this process until no more records to process
     while (!min_heap.empty()) {
 
-    	//using unstructured binding to intilialize rec to record and index to file_index from the top of min_heap
-        auto [rec, idx] = min_heap.top();
-
-        //pops value from min_heap
+        //pops the smallest key, its record is the current one of that run
+        int idx = min_heap.top().file_index;
         min_heap.pop();
 
-        //sanitize the timestamp to ensure no line breaks, removes troublesome spacing
-		string ts_clean = rec.timestamp;
-		ts_clean.erase(remove(ts_clean.begin(), ts_clean.end(), '\n'), ts_clean.end());
-		ts_clean.erase(remove(ts_clean.begin(), ts_clean.end(), '\r'), ts_clean.end());
+        run_reader& run = inputs[idx];
 
-		//write sanitized record to output
-		out << rec.id << "," << rec.latitude << "," << rec.longitude << "," << ts_clean << "," << to_string(rec.hilbert_value) << "\n";
+		//write record to output, the only place it is turned into text
+		append_line(pending, run.block[run.position++]);
 
+		if (pending.size() >= output_block) {
+			out.write(pending.data(), pending.size());
+			pending.clear();
+		}
 
-        //read next line from the same file, if next line, push to heap
-        string next_line;
-        if (getline(inputs[idx], next_line)) {
-            min_heap.push({parse_line_and_calc_hilbert(next_line, lat_min, lat_max, lon_min, lon_max), idx});
+        //next record from the same run, reading its next block once this one is used up
+        if (run.position < run.block.size() || run.refill()) {
+            min_heap.push({run.block[run.position].hilbert_value, idx});
         }
     }
 
-    //close all input files
+    out.write(pending.data(), pending.size());
+
+    //close all input files, and remove them
     for (size_t i = 0; i < inputs.size(); ++i) {
-    	inputs[i].close();
+    	inputs[i].in.close();
+    	filesystem::remove(run_file(i));
 	}
 
 }
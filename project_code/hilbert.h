@@ -11,6 +11,12 @@ for calculation, run the max/min function to obtain the needed max/min values la
 to get the hilbert value for a record, use the coords_to_hilbert_value() functions, with longitude, latitude, 
 max longitude, max latitude, and p as values. p is recommended to be 8
 
+The functions are inline so that the header can be included by more than one source file.
+For range queries, hilbert_ranges_for_rect() turns a latitude/longitude rectangle into the hilbert value
+ranges of the grid cells it covers.
+For grouping, hilbert_cell() gives the cell of a coarser grid that a hilbert value falls in, and
+hilbert_cell_bounds() the rectangle of that cell.
+
 Explanation: to calculate hilbert values, coordinates must be normalized into a 2D grid as described in the paper,
 of which the size is determined by a given power p. The normalized coordinates are then converted to a hilbert 
 value, using c++ code adapted from Yaltirakli's work. Essentially, the code will recurisvely traverse the given
@@ -45,7 +51,7 @@ extern double lon_max;
 using namespace std;
 
 //used to obtain the max and min longitude and latitiude from a specified csv
-void max_and_min_finder(const string& filename) {
+inline void max_and_min_finder(const string& filename) {
 
 	//attempts to open specified value - gives warning if can't
     ifstream file(filename);
@@ -75,9 +81,15 @@ void max_and_min_finder(const string& filename) {
         if (!getline(ss, lat_str, ',')) continue;
         if (!getline(ss, lon_str, ',')) continue;
 
-        //convert string lats and lons to string
-        double lat = stod(lat_str);
-        double lon = stod(lon_str);
+        //convert string lats and lons to string, a line that is not numbers is reported when it is read again
+        double lat, lon;
+        try {
+            lat = stod(lat_str);
+            lon = stod(lon_str);
+        }
+        catch (const exception&) {
+            continue;
+        }
 
         //set the first instances as the max
         if (first) {
@@ -102,7 +114,7 @@ void max_and_min_finder(const string& filename) {
 
 //normalizes latitude and longitidue coordinate into a 2D grid (0 to 2^p - 1)
 //p can be changed to any value, though Kamel & Faloutsos seem to recommend 8 
-pair<int, int> normalize_coords(double latitude, double longitude,double lat_min, double lat_max,
+inline pair<int, int> normalize_coords(double latitude, double longitude,double lat_min, double lat_max,
                                      double lon_min, double lon_max, int p) {
 
 	//calculates 2^p and sets it equal to n
@@ -122,7 +134,7 @@ pair<int, int> normalize_coords(double latitude, double longitude,double lat_min
 
 //returns hilbert value from given points
 //adapted from Yaltirakli's Python code
-int xy2d(int n, int x, int y) {
+inline int xy2d(int n, int x, int y) {
 
     int d = 0;
     for (int s = n / 2; s > 0; s /= 2) {
@@ -143,7 +155,7 @@ int xy2d(int n, int x, int y) {
 }
 
 //normalizes the given coords and then uses the xy2d function to produce the hilbert value
-int coords_to_hilbert_value(double latitude, double longitude, double lat_min, double lat_max,
+inline int coords_to_hilbert_value(double latitude, double longitude, double lat_min, double lat_max,
                                 double lon_min, double lon_max, int p) {
 
     auto [x, y] = normalize_coords(latitude, longitude, lat_min, lat_max, lon_min, lon_max, p);
@@ -151,5 +163,122 @@ int coords_to_hilbert_value(double latitude, double longitude, double lat_min, d
     return xy2d(n, x, y);
 }
 
+//inverse of xy2d, returns the grid cell (x, y) of hilbert value d
+inline pair<int, int> d2xy(int n, int d) {
+
+    int x = 0;
+    int y = 0;
+
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+
+        //rotation functionality, undone in the opposite order of xy2d
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            swap(x, y);
+        }
+
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+    return {x, y};
+}
+
+//the cell of a coarser 2^level x 2^level grid that a hilbert value of the 2^p grid falls in. Each coarse cell is
+//one aligned run of 4^(p - level) values, so the cell's own hilbert value is just the top bits. Useful as a
+//group key, as neighbouring records get the same cell
+inline int hilbert_cell(int hilbert, int p, int level) {
+
+    return hilbert >> (2 * (p - level));
+}
+
+//latitude/longitude rectangle of a coarse cell from hilbert_cell, as {lat_low, lat_high, lon_low, lon_high}.
+//normalize_coords scales by 2^p - 1, so the cell's edges are found on the fine grid and clamped to the bounds
+inline vector<double> hilbert_cell_bounds(int cell, int p, int level, double lat_min, double lat_max, double lon_min, double lon_max) {
+
+    auto [x, y] = d2xy(1 << level, cell);
+
+    //fine cells per coarse cell side, and the fraction of the range a fine cell covers
+    int side = 1 << (p - level);
+    double step = 1.0 / ((1 << p) - 1);
+
+    double lat_low = lat_min + min(y * side * step, 1.0) * (lat_max - lat_min);
+    double lat_high = lat_min + min((y + 1) * side * step, 1.0) * (lat_max - lat_min);
+    double lon_low = lon_min + min(x * side * step, 1.0) * (lon_max - lon_min);
+    double lon_high = lon_min + min((x + 1) * side * step, 1.0) * (lon_max - lon_min);
+
+    return {lat_low, lat_high, lon_low, lon_high};
+}
+
+//collects the hilbert ranges of the cells of a size x size block at (bx, by) that lie in [x0, x1] x [y0, y1].
+//An aligned block of the grid is always one contiguous run of size * size hilbert values, so a block that is
+//fully inside the rectangle is a single range, and only blocks on the rectangle's edges have to be split
+inline void hilbert_block_ranges(int n, int bx, int by, int size, int x0, int y0, int x1, int y1,
+                                 vector<pair<int, int>>& ranges) {
+
+    //outside of the rectangle
+    if (bx > x1 || by > y1 || bx + size - 1 < x0 || by + size - 1 < y0)
+        return;
+
+    //fully inside, the block's run starts at the block aligned multiple below any of its cells
+    if (bx >= x0 && by >= y0 && bx + size - 1 <= x1 && by + size - 1 <= y1) {
+
+        int cells = size * size;
+        int start = (xy2d(n, bx, by) / cells) * cells;
+        ranges.push_back({start, start + cells - 1});
+        return;
+    }
+
+    //on the edge, splits into its four quadrants
+    int half = size / 2;
+    hilbert_block_ranges(n, bx, by, half, x0, y0, x1, y1, ranges);
+    hilbert_block_ranges(n, bx + half, by, half, x0, y0, x1, y1, ranges);
+    hilbert_block_ranges(n, bx, by + half, half, x0, y0, x1, y1, ranges);
+    hilbert_block_ranges(n, bx + half, by + half, half, x0, y0, x1, y1, ranges);
+}
+
+//returns the sorted, merged hilbert ranges covering the grid cells of a latitude/longitude rectangle.
+//Cells on the rectangle's edge are included whole, so records found through the ranges should still be
+//checked against the rectangle itself
+inline vector<pair<int, int>> hilbert_ranges_for_rect(double lat_low, double lat_high, double lon_low, double lon_high,
+                                                      double lat_min, double lat_max, double lon_min, double lon_max, int p) {
+
+    vector<pair<int, int>> ranges;
+    int n = 1 << p;
+
+    //the rectangle clamped to the grid
+    lat_low = max(lat_low, lat_min);
+    lon_low = max(lon_low, lon_min);
+    lat_high = min(lat_high, lat_max);
+    lon_high = min(lon_high, lon_max);
+
+    if (lat_low > lat_high || lon_low > lon_high)
+        return ranges;
+
+    auto [x0, y0] = normalize_coords(lat_low, lon_low, lat_min, lat_max, lon_min, lon_max, p);
+    auto [x1, y1] = normalize_coords(lat_high, lon_high, lat_min, lat_max, lon_min, lon_max, p);
+
+    hilbert_block_ranges(n, 0, 0, n, x0, y0, x1, y1, ranges);
+
+    //merges runs that follow each other on the curve
+    sort(ranges.begin(), ranges.end());
+
+    vector<pair<int, int>> merged;
+    for (const auto& range : ranges) {
+
+        if (!merged.empty() && merged.back().second + 1 >= range.first)
+            merged.back().second = max(merged.back().second, range.second);
+        else
+            merged.push_back(range);
+    }
+
+    return merged;
+}
+
 
 #endif
\ No newline at end of file
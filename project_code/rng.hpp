@@ -0,0 +1,415 @@
+// --- Random Number Generation ---
+
+/*
+References:
+D. Blackman and S. Vigna. Scrambled Linear Pseudorandom Number Generators. ACM TOMS, 2021
+https://prng.di.unimi.it/xoshiro256starstar.c
+https://prng.di.unimi.it/splitmix64.c
+D. Lemire. Fast Random Integer Generation in an Interval. ACM TOMACS, 2019
+K.-H. Li. Reservoir-Sampling Algorithms of Time Complexity O(n(1 + log(N/n))). ACM TOMS, 1994
+
+One place for the randomness used by the trees. Every thread gets its own xoshiro256** [1][2] stream,
+so parallel sampling never shares generator state, and the streams all come from one base seed through
+splitmix64 [3]. Setting the seed (seedRandom, or the SAMPLING_SEED environment variable through
+seedRandomFromEnv) makes a single threaded run repeatable, which is what the experiments need.
+The stream a thread gets does not depend on which thread happens to draw first: the thread that sets the seed
+gets stream 0, and threads that are started in a fixed order (pool workers) are given their stream number by
+whoever starts them, through reserveStreams and setThreadStream. Work that can be run by any thread, at any time
+(subtree tasks, the RS-tree's background refills), draws from a keyedRng instead, seeded from the base seed and a
+number that says what the work is, so what it draws does not depend on which thread runs it or when.
+
+The generator satisfies UniformRandomBitGenerator, so it works with shuffle and the <random> distributions,
+and bounded integers and coin flips can also be drawn in bulk without going through a distribution, using [4].
+
+For picking k out of a longer run of items there is a partial Fisher-Yates shuffle, which only does the first k
+swaps, and a reservoir sampler using Algorithm L [5], which keeps O(k) items and tells the caller how many of the
+next items it can pass over without looking at them.
+
+Header only, and it does not depend on any of the tree headers, so it can be used by any of the trees.
+
+--- Random number generator declaration and implementation ---
+
+*/
+
+//a check to make sure that this header file is only included once
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+//splitmix64 step, used to turn one seed into well mixed generator states
+inline uint64_t splitmix64(uint64_t& state) {
+
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+//xoshiro256** generator, 256 bits of state and 64 bits per call
+class xoshiro256 {
+
+public:
+
+    typedef uint64_t result_type;
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    explicit xoshiro256(uint64_t seed = 0) { reseed(seed); }
+
+    //fills the state from the seed with splitmix64, which never gives the all zero state
+    void reseed(uint64_t seed) {
+
+        for (int i = 0; i < 4; i++)
+            s[i] = splitmix64(seed);
+    }
+
+    result_type operator()() {
+
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return result;
+    }
+
+    //uniform integer in [0, bound), Lemire's multiply and reject method, which almost never divides
+    uint64_t bounded(uint64_t bound) {
+
+        uint64_t x = (*this)();
+        __uint128_t m = (__uint128_t) x * bound;
+        uint64_t low = (uint64_t) m;
+
+        if (low < bound) {
+
+            uint64_t threshold = -bound % bound;
+
+            while (low < threshold) {
+                x = (*this)();
+                m = (__uint128_t) x * bound;
+                low = (uint64_t) m;
+            }
+        }
+
+        return m >> 64;
+    }
+
+    //uniform integer in [low, high]
+    int64_t between(int64_t low, int64_t high) {
+
+        return low + (int64_t) bounded((uint64_t) (high - low) + 1);
+    }
+
+    //uniform double in [0, 1), from the top 53 bits
+    double uniform() {
+
+        return ((*this)() >> 11) * 0x1.0p-53;
+    }
+
+    //true with probability p
+    bool bernoulli(double p) {
+
+        return uniform() < p;
+    }
+
+    //number of heads before the first tails in fair coin flips, capped at cap, so P(result >= i) = 2^-i.
+    //The flips are the bits of one call, counted with a single instruction
+    int geometric(int cap) {
+
+        int heads = 0;
+
+        while (heads < cap) {
+
+            uint64_t tails = ~(*this)();
+
+            //64 heads in a row, keeps flipping
+            if (tails == 0) {
+                heads += 64;
+                continue;
+            }
+
+            heads += __builtin_ctzll(tails);
+            break;
+        }
+
+        return std::min(heads, cap);
+    }
+
+    //fills out with count uniform integers in [0, bound)
+    template <typename T>
+    void boundedBulk(uint64_t bound, size_t count, vector<T>& out) {
+
+        out.resize(count);
+        for (size_t i = 0; i < count; i++)
+            out[i] = (T) bounded(bound);
+    }
+
+    //fills out with count fair coin flips, 64 flips per generator call
+    void coinFlips(size_t count, vector<bool>& out) {
+
+        out.resize(count);
+
+        for (size_t i = 0; i < count; i += 64) {
+
+            uint64_t bits = (*this)();
+            for (size_t j = i; j < count && j < i + 64; j++, bits >>= 1)
+                out[j] = bits & 1;
+        }
+    }
+
+    //fills out with count flips that are true with probability p
+    void bernoulliBulk(double p, size_t count, vector<bool>& out) {
+
+        if (p == 0.5) {
+            coinFlips(count, out);
+            return;
+        }
+
+        out.resize(count);
+        for (size_t i = 0; i < count; i++)
+            out[i] = bernoulli(p);
+    }
+
+private:
+
+    uint64_t s[4];
+
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+//base seed of all of the thread streams. The epoch goes up every time the seed is set, so threads know to start
+//over from the new seed
+inline atomic<uint64_t> rng_base_seed{(uint64_t) chrono::steady_clock::now().time_since_epoch().count() ^ random_device{}()};
+inline atomic<uint64_t> rng_epoch{0};
+
+//stream 0 belongs to the thread that set the seed, fixed streams are handed out from 1 on, and threads that were
+//never given one take a stream from far above those, in the order they first draw
+constexpr uint64_t RNG_SEEDING_STREAM = 0;
+constexpr uint64_t RNG_UNFIXED_STREAMS = 1ULL << 32;
+constexpr uint64_t RNG_NO_STREAM = UINT64_MAX;
+inline atomic<uint64_t> rng_fixed_streams{1};
+inline atomic<uint64_t> rng_unfixed_streams{0};
+
+//generator state of a thread, along with the epoch it was seeded in and its stream number if it was given one
+struct thread_rng_state {
+
+    xoshiro256 generator;
+    uint64_t epoch = UINT64_MAX;
+    uint64_t stream = RNG_NO_STREAM;
+};
+
+inline thread_local thread_rng_state thread_rng;
+
+//reserves count consecutive stream numbers and returns the first. Called by the thread that starts the workers,
+//so as long as it starts them in the same order the workers get the same streams on every run
+inline uint64_t reserveStreams(uint64_t count) {
+
+    return rng_fixed_streams.fetch_add(count);
+}
+
+//gives the calling thread the stream number, it is (re)seeded with it on its next draw
+inline void setThreadStream(uint64_t stream) {
+
+    thread_rng.stream = stream;
+    thread_rng.epoch = UINT64_MAX;
+}
+
+//the calling thread's generator, (re)seeded from the base seed and its stream number on first use after a seed
+inline xoshiro256& threadRng() {
+
+    uint64_t epoch = rng_epoch.load();
+
+    if (thread_rng.epoch != epoch) {
+
+        if (thread_rng.stream == RNG_NO_STREAM)
+            thread_rng.stream = RNG_UNFIXED_STREAMS + rng_unfixed_streams++;
+
+        uint64_t stream = thread_rng.stream;
+        uint64_t seed = rng_base_seed.load();
+
+        thread_rng.generator.reseed(seed ^ splitmix64(stream));
+        thread_rng.epoch = epoch;
+    }
+
+    return thread_rng.generator;
+}
+
+//a generator for one piece of work, seeded from the base seed and the key (such as a node number along with how
+//many times the node was drawn from). The same key draws the same numbers on any thread, at any time
+inline xoshiro256 keyedRng(uint64_t key) {
+
+    //the second splitmix64 output, so a key does not start where the thread stream with the same number does
+    splitmix64(key);
+
+    return xoshiro256(rng_base_seed.load() ^ splitmix64(key));
+}
+
+//sets the base seed. The calling thread gets stream 0, so a single threaded run is repeatable
+inline void seedRandom(uint64_t seed) {
+
+    rng_base_seed = seed;
+    rng_epoch++;
+
+    setThreadStream(RNG_SEEDING_STREAM);
+    threadRng();
+}
+
+//seeds from the SAMPLING_SEED environment variable if it is set to a number, returns whether it was.
+//Anything else is reported and the seed is left as it was
+inline bool seedRandomFromEnv() {
+
+    const char* value = getenv("SAMPLING_SEED");
+
+    if (!value || !*value)
+        return false;
+
+    uint64_t seed;
+
+    try {
+
+        size_t used;
+        seed = stoull(value, &used);
+
+        //trailing characters, such as in "12abc"
+        if (value[used] != '\0')
+            throw invalid_argument("trailing characters");
+    }
+
+    catch (const exception&) {
+
+        cerr << "SAMPLING_SEED=" << value << " is not a number, using a random seed" << endl;
+        return false;
+    }
+
+    seedRandom(seed);
+    return true;
+}
+
+//moves a uniform random selection of min(k, size) items, in random order, to the front of items. Only the first
+//k steps of Fisher-Yates are done, so it costs O(k) instead of a full shuffle
+template <typename T>
+void partialShuffle(vector<T>& items, size_t k, xoshiro256& generator) {
+
+    size_t count = items.size();
+    k = min(k, count);
+
+    for (size_t i = 0; i < k; i++)
+        swap(items[i], items[i + generator.bounded(count - i)]);
+}
+
+//uniform sample of k items (without replacement) from a stream of unknown length, with Algorithm L: once the
+//reservoir is full, the number of items to pass over before the next one that gets in is drawn directly, so
+//the caller can skip them (or whole leaves of them) without copying anything
+template <typename T>
+class reservoir_sampler {
+
+public:
+
+    reservoir_sampler(size_t k, xoshiro256& generator) : k(k), generator(generator) { items.reserve(k); }
+
+    //how many of the next items can be passed over, 0 if the next one has to be offered
+    size_t skip() const { return gap; }
+
+    //passes over count items without looking at them, count should be at most skip()
+    void pass(size_t count) {
+
+        count = min(count, gap);
+        gap -= count;
+        passed += count;
+    }
+
+    //the next item of the stream
+    void offer(const T& item) {
+
+        passed++;
+
+        //nothing is kept
+        if (k == 0)
+            return;
+
+        //filling up
+        if (items.size() < k) {
+
+            items.push_back(item);
+
+            if (items.size() == k) {
+                w = exp(log(uniformOpen()) / k);
+                nextGap();
+            }
+
+            return;
+        }
+
+        if (gap > 0) {
+            gap--;
+            return;
+        }
+
+        //gets in, in place of a random item
+        items[generator.bounded(k)] = item;
+
+        w *= exp(log(uniformOpen()) / k);
+        nextGap();
+    }
+
+    //number of items of the stream so far, offered or passed over
+    size_t seen() const { return passed; }
+
+    //the sample, shuffled since the reservoir fills up in stream order
+    vector<T> take() {
+
+        shuffle(items.begin(), items.end(), generator);
+        return move(items);
+    }
+
+private:
+
+    size_t k;
+    xoshiro256& generator;
+
+    vector<T> items;
+    size_t passed = 0;
+
+    //Algorithm L's running W, and the items left to pass over
+    double w = 1;
+    size_t gap = 0;
+
+    //uniform double in (0, 1), as log(0) is not usable
+    double uniformOpen() {
+
+        double u;
+        do {
+            u = generator.uniform();
+        } while (u == 0);
+
+        return u;
+    }
+
+    //floor(log(u) / log(1 - W)), capped for when W gets so small that the gap no longer fits
+    void nextGap() {
+
+        double length = floor(log(uniformOpen()) / log1p(-w));
+
+        gap = (length >= (double) SIZE_MAX / 2) ? SIZE_MAX / 2 : (size_t) length;
+    }
+};
@@ -38,7 +38,8 @@ using namespace std;
 
 namespace fs = filesystem;
 
-//root.meta is used for page directory organization
+//root.meta is used for page directory organization, every tree keeps one in its own directory
+//(this is the one of the default tree_pages directory)
 const string ROOT_META_FILE = "tree_pages/root.meta";
 
 
@@ -99,8 +100,18 @@ void page_handler::writePage(int pageID, const void* data, size_t dataSize) {
 
 }
 
+//pages read by each thread, so a query can tell how many pages it read
+thread_local long int thread_page_reads = 0;
+
+long int page_handler::threadPageReads() {
+
+    return thread_page_reads;
+}
+
 //used to read pages into memory
 void page_handler::readPage(int pageID, void* buffer) {
+
+    thread_page_reads++;
     
     //opens page to be read from
     ifstream in(getPagePath(pageID), ios::binary);
@@ -118,13 +129,142 @@ string page_handler::getPagePath(int pageID) {
 
 /*end of page handler functions*/
 
+/*zone map and scan filter functions*/
+
+//timestamps are compared on their first ZONE_TIMESTAMP_LEN - 1 characters
+static int compareTimestamps(const char* a, const char* b) {
+
+    return strncmp(a, b, ZONE_TIMESTAMP_LEN - 1);
+}
+
+//copies a record's timestamp into a zone bound
+static void copyTimestamp(char* bound, const char* timestamp) {
+
+    //the rest of a longer timestamp is cut off on purpose
+    size_t length = strnlen(timestamp, ZONE_TIMESTAMP_LEN - 1);
+
+    memcpy(bound, timestamp, length);
+    memset(bound + length, 0, ZONE_TIMESTAMP_LEN - length);
+}
+
+bool zone_map::add(const Record& rec) {
+
+    bool was_empty = empty();
+    bool changed = was_empty;
+
+    if (rec.hilbert < min_hilbert) { min_hilbert = rec.hilbert; changed = true; }
+    if (rec.hilbert > max_hilbert) { max_hilbert = rec.hilbert; changed = true; }
+
+    if (rec.lat < min_lat) { min_lat = rec.lat; changed = true; }
+    if (rec.lat > max_lat) { max_lat = rec.lat; changed = true; }
+    if (rec.lon < min_lon) { min_lon = rec.lon; changed = true; }
+    if (rec.lon > max_lon) { max_lon = rec.lon; changed = true; }
+
+    if (was_empty || compareTimestamps(rec.timestamp, min_timestamp) < 0) {
+        copyTimestamp(min_timestamp, rec.timestamp);
+        changed = true;
+    }
+    if (was_empty || compareTimestamps(rec.timestamp, max_timestamp) > 0) {
+        copyTimestamp(max_timestamp, rec.timestamp);
+        changed = true;
+    }
+
+    return changed;
+}
+
+void zone_map::merge(const zone_map& other) {
+
+    if (other.empty())
+        return;
+
+    if (empty()) {
+        *this = other;
+        return;
+    }
+
+    min_hilbert = min(min_hilbert, other.min_hilbert);
+    max_hilbert = max(max_hilbert, other.max_hilbert);
+
+    min_lat = min(min_lat, other.min_lat);
+    max_lat = max(max_lat, other.max_lat);
+    min_lon = min(min_lon, other.min_lon);
+    max_lon = max(max_lon, other.max_lon);
+
+    if (compareTimestamps(other.min_timestamp, min_timestamp) < 0)
+        copyTimestamp(min_timestamp, other.min_timestamp);
+    if (compareTimestamps(other.max_timestamp, max_timestamp) > 0)
+        copyTimestamp(max_timestamp, other.max_timestamp);
+}
+
+scan_filter scan_filter::hilbertRange(int low, int high) {
+
+    scan_filter filter;
+    filter.low = low;
+    filter.high = high;
+
+    return filter;
+}
+
+void scan_filter::setRect(float lat_from, float lat_to, float lon_from, float lon_to) {
+
+    by_rect = true;
+    lat_low = lat_from;
+    lat_high = lat_to;
+    lon_low = lon_from;
+    lon_high = lon_to;
+}
+
+//a shorter bound only compares its own characters, so "2015-01-02" as the end takes in the whole day
+void scan_filter::setTime(const string& from, const string& to) {
+
+    by_time = true;
+
+    copyTimestamp(time_from, from.c_str());
+
+    //the end is padded with the highest digits, so any time within the prefix is at most the bound
+    string end = to.substr(0, ZONE_TIMESTAMP_LEN - 1);
+    const string latest = "9999-99-99 99:99:99";
+    end += latest.substr(end.size());
+    copyTimestamp(time_to, end.c_str());
+}
+
+bool scan_filter::matches(const Record& rec) const {
+
+    if (rec.hilbert < low || rec.hilbert > high)
+        return false;
+
+    if (by_rect && (rec.lat < lat_low || rec.lat > lat_high || rec.lon < lon_low || rec.lon > lon_high))
+        return false;
+
+    if (by_time && (compareTimestamps(rec.timestamp, time_from) < 0 || compareTimestamps(rec.timestamp, time_to) > 0))
+        return false;
+
+    return true;
+}
+
+bool scan_filter::overlaps(const zone_map& zone) const {
+
+    if (zone.empty() || zone.max_hilbert < low || zone.min_hilbert > high)
+        return false;
+
+    if (by_rect && (zone.max_lat < lat_low || zone.min_lat > lat_high || zone.max_lon < lon_low || zone.min_lon > lon_high))
+        return false;
+
+    if (by_time && (compareTimestamps(zone.max_timestamp, time_from) < 0 || compareTimestamps(zone.min_timestamp, time_to) > 0))
+        return false;
+
+    return true;
+}
+
+/*end of zone map and scan filter functions*/
+
 /*B Plus Tree function declaration*/
 
 //constructor
-b_plus_tree::b_plus_tree(const string& dir) : handler(dir) {
+b_plus_tree::b_plus_tree(const string& dir) : handler(dir), root_meta(dir + "/root.meta") {
 
     //opens the root.meta file for writing
-    ifstream in(ROOT_META_FILE);
+    ifstream in(root_meta);
 
     //if exists and real, will read root page ID into root_page
     if (in.is_open()) {
@@ -142,7 +282,7 @@ b_plus_tree::b_plus_tree(const string& dir) : handler(dir) {
 void b_plus_tree::saveRoot() {
 
     //opens root.meta file for reading
-    ofstream out(ROOT_META_FILE);
+    ofstream out(root_meta);
 
     //reads in the value
     out << root_page;
@@ -227,6 +367,8 @@ void b_plus_tree::insert(int key, const Record& rec) {
         root->keys[0] = promoted_key;
         root->children[0] = root_page;
         root->children[1] = new_child_page;
+        root->zones[0] = subtreeZone(root_page);
+        root->zones[1] = subtreeZone(new_child_page);
         
         //write root node, save root node 
         handler.writePage(new_root, buffer, sizeof(internal_node));
@@ -303,17 +445,23 @@ void b_plus_tree::insertRecursive(int pageID, int key, const Record& rec, int& p
         //if the new child page is valid 
         if (temp_new_child_page != -1) {
 
+            //the record is in one of the two halves, so both zones are read back from the split pages
+            node->zones[i] = subtreeZone(child);
+            zone_map new_zone = subtreeZone(temp_new_child_page);
+
             //if the internal node has enough room for a child
             if (node->numKeys < MAX_INTERNAL_KEYS) {
 
                 for (int j = node->numKeys; j > i; --j) {
                     node->keys[j] = node->keys[j - 1];
                     node->children[j + 1] = node->children[j];
+                    node->zones[j + 1] = node->zones[j];
                 }
 
                 //updates node information
                 node->keys[i] = temp_promote_key;
                 node->children[i + 1] =temp_new_child_page;
+                node->zones[i + 1] = new_zone;
                 node->numKeys++;
 
                 //creates page
@@ -328,7 +476,7 @@ void b_plus_tree::insertRecursive(int pageID, int key, const Record& rec, int& p
             else {
 
                 //calls the fucntion to split the internal node, and create new page internal
-                splitInternal(*node, temp_promote_key,temp_new_child_page, promoted_key, new_child_page);
+                splitInternal(*node, temp_promote_key,temp_new_child_page, new_zone, promoted_key, new_child_page);
                 handler.writePage(pageID, buffer, sizeof(internal_node));
             }
         } 
@@ -337,6 +485,10 @@ void b_plus_tree::insertRecursive(int pageID, int key, const Record& rec, int& p
         else {
             promoted_key = -1;
             new_child_page = -1;
+
+            //the node is only written again when the child's zone map had to grow
+            if (node->zones[i].add(rec))
+                handler.writePage(pageID, buffer, sizeof(internal_node));
         }
     }
 }
@@ -392,13 +544,15 @@ void b_plus_tree::splitLeaf(leaf_node& old_node, const Record& record, int& prom
 }
 
 //used when internal node needs to be split
-void b_plus_tree::splitInternal(internal_node& old_node, int insert_key, int insert_page_id, int& promoted_key, int& new_page_id) {
+void b_plus_tree::splitInternal(internal_node& old_node, int insert_key, int insert_page_id, const zone_map& insert_zone,
+                                int& promoted_key, int& new_page_id) {
 
 
     //creates temporary array to hold all node keys and children, in addition to one more 
     const int totalKeys = old_node.numKeys;
     int keys[MAX_INTERNAL_KEYS + 1];
     int children[MAX_INTERNAL_KEYS + 2];
+    zone_map zones[MAX_INTERNAL_KEYS + 2];
 
     //loop to maintain key order, similar to how record order is maintained
     //i will record where new key is to go
@@ -415,14 +569,19 @@ void b_plus_tree::splitInternal(internal_node& old_node, int insert_key, int ins
     for (int j = i; j < totalKeys; ++j) 
         keys[j + 1] = old_node.keys[j];
 
-    //shifts keys to the right of i and inserts new child correctly
-    for (int j = 0; j <= i; ++j) 
+    //shifts keys to the right of i and inserts new child correctly, the zones go along with the children
+    for (int j = 0; j <= i; ++j) {
         children[j] = old_node.children[j];
+        zones[j] = old_node.zones[j];
+    }
 
     children[i + 1] = insert_page_id;
+    zones[i + 1] = insert_zone;
     
-    for (int j = i + 1; j <= totalKeys; ++j)
+    for (int j = i + 1; j <= totalKeys; ++j) {
         children[j + 1] = old_node.children[j];
+        zones[j + 1] = old_node.zones[j];
+    }
 
     //total to indicate key total, which is used to determine how many records to split left
     int key_total= totalKeys + 1;
@@ -436,8 +595,14 @@ void b_plus_tree::splitInternal(internal_node& old_node, int insert_key, int ins
     for (int j = 0; j < mid; ++j) 
         old_node.keys[j] = keys[j];
 
-    for (int j = 0; j <= mid; ++j) 
+    for (int j = 0; j <= mid; ++j) {
         old_node.children[j] = children[j];
+        old_node.zones[j] = zones[j];
+    }
+
+    //the right half's entries are not the old node's any more
+    for (int j = mid + 1; j <= MAX_INTERNAL_KEYS; ++j)
+        old_node.zones[j] = zone_map{};
 
     //creates new node, and fills the right half
     char buffer[PAGE_SIZE] = {};
@@ -451,8 +616,10 @@ void b_plus_tree::splitInternal(internal_node& old_node, int insert_key, int ins
     for (int j = 0; j < new_node->numKeys; ++j) 
         new_node->keys[j] = keys[mid + 1 + j];
 
-    for (int j = 0; j <= new_node->numKeys; ++j) 
+    for (int j = 0; j <= new_node->numKeys; ++j) {
         new_node->children[j] = children[mid + 1 + j];
+        new_node->zones[j] = zones[mid + 1 + j];
+    }
 
     // Step 6: Allocate and write new internal node
     new_page_id = createInternal();  // logs and allocates
@@ -461,12 +628,134 @@ void b_plus_tree::splitInternal(internal_node& old_node, int insert_key, int ins
   
 }
 
+//adds the next record of a bulk load, the first leaf is the empty root leaf made by the constructor
+void b_plus_tree::appendSorted(const Record& rec) {
+
+    if (bulk_page == INVALID_PAGE)
+        bulk_page = root_page;
+
+    //the leaf is full, it gets written with a link to the page of the next one
+    if ((int) bulk_leaf.size() == MAX_LEAF_RECORDS) {
+
+        int next_page = handler.pageIncrementer();
+        writeBulkLeaf(next_page);
+
+        bulk_leaf.clear();
+        bulk_page = next_page;
+    }
+
+    if (bulk_leaf.empty()) {
+        bulk_fences.push_back({rec.hilbert, bulk_page});
+        bulk_zones.push_back(zone_map{});
+    }
+
+    bulk_leaf.push_back(rec);
+    bulk_zones.back().add(rec);
+}
+
+//writes the leaf being filled
+void b_plus_tree::writeBulkLeaf(int next_page) {
+
+    //memory safe buffer intialization
+    char buffer[PAGE_SIZE] = {0};
+    leaf_node* node = reinterpret_cast<leaf_node*>(buffer);
+    *node = leaf_node{};
+
+    node->record_num = bulk_leaf.size();
+    node->next_leaf_page = next_page;
+    memcpy(node->records, bulk_leaf.data(), bulk_leaf.size() * sizeof(Record));
+
+    handler.writePage(bulk_page, buffer, sizeof(leaf_node));
+}
+
+//writes the last leaf, then builds the internal levels bottom up. The children of a level are split evenly
+//between ceil(children / fanout) nodes, and the key before a child is the first key under it, which is what
+//splitLeaf promotes too
+void b_plus_tree::finishBulkLoad() {
+
+    //nothing was loaded
+    if (bulk_page == INVALID_PAGE)
+        return;
+
+    writeBulkLeaf(INVALID_PAGE);
+
+    vector<pair<int, int>> level = move(bulk_fences);
+    vector<zone_map> level_zones = move(bulk_zones);
+
+    while (level.size() > 1) {
+
+        vector<pair<int, int>> parents;
+        vector<zone_map> parent_zones;
+
+        size_t fanout = MAX_INTERNAL_KEYS + 1;
+        size_t nodes = (level.size() + fanout - 1) / fanout;
+        size_t first = 0;
+
+        for (size_t n = 0; n < nodes; n++) {
+
+            //the first (size % nodes) nodes take one more child
+            size_t children = level.size() / nodes + (n < level.size() % nodes ? 1 : 0);
+
+            char buffer[PAGE_SIZE] = {0};
+            internal_node* node = reinterpret_cast<internal_node*>(buffer);
+            *node = internal_node{};
+
+            node->is_leaf = 0;
+            node->numKeys = children - 1;
+
+            //the parent's zone covers its children's
+            zone_map parent_zone;
+
+            for (size_t c = 0; c < children; c++) {
+
+                node->children[c] = level[first + c].second;
+                node->zones[c] = level_zones[first + c];
+                parent_zone.merge(level_zones[first + c]);
+
+                if (c > 0)
+                    node->keys[c - 1] = level[first + c].first;
+            }
+
+            int pid = handler.pageIncrementer();
+            handler.writePage(pid, buffer, sizeof(internal_node));
+
+            parents.push_back({level[first].first, pid});
+            parent_zones.push_back(parent_zone);
+            first += children;
+        }
+
+        level = move(parents);
+        level_zones = move(parent_zones);
+    }
+
+    root_page = level[0].second;
+    saveRoot();
+
+    //ready for another load
+    bulk_leaf.clear();
+    bulk_leaf.shrink_to_fit();
+    bulk_page = INVALID_PAGE;
+}
+
 //range query implementation
 vector<Record> b_plus_tree::rangeQueryR(int low, int high) {
 
     //stores the results matching the query
     vector<Record> result;
 
+    //copies every in-range slice
+    rangeScanR(low, high, [&](const leaf_node& node, int first, int last) {
+        result.insert(result.end(), node.records + first, node.records + last);
+        return true;
+    });
+
+    //returns vector of records 
+    return result;
+}
+
+//range scan, hands out the in-range slice of every leaf instead of copying the records
+void b_plus_tree::rangeScanR(int low, int high, const function<bool(const leaf_node&, int, int)>& visit) {
+
     //buffer to store page info
     char buffer[PAGE_SIZE];
 
@@ -501,21 +790,199 @@ vector<Record> b_plus_tree::rangeQueryR(int low, int high) {
         handler.readPage(current_node, buffer);
         leaf_node* node = reinterpret_cast<leaf_node*>(buffer);
 
-        //records all of the record values
-        for (int i = 0; i < node->record_num; ++i) {
-            int key = node->records[i].hilbert;
-            if (key > high) return result;
-            if (key >= low) result.push_back(node->records[i]);
-        }
+        //finds the in-range slice of the leaf
+        int first = 0;
+        while (first < node->record_num && node->records[first].hilbert < low)
+            first++;
+
+        int last = first;
+        while (last < node->record_num && node->records[last].hilbert <= high)
+            last++;
+
+        if (first < last && !visit(*node, first, last))
+            return;
+
+        //a key past the range ends the scan
+        if (last < node->record_num)
+            return;
 
         //goes to neighboring leaf
         current_node = node->next_leaf_page;
     }
+}
+
+//goes down the subtrees whose zone maps overlap the filter, in order
+void b_plus_tree::filteredScan(const scan_filter& filter, const function<bool(const Record*, const Record*)>& visit) {
+
+    if (filter.low > filter.high)
+        return;
+
+    filteredScanRecursive(root_page, filter, visit);
+}
+
+bool b_plus_tree::filteredScanRecursive(int pageID, const scan_filter& filter,
+                                        const function<bool(const Record*, const Record*)>& visit) {
+
+    //buffer to store page info
+    char buffer[PAGE_SIZE];
+    handler.readPage(pageID, buffer);
+
+    int is_leaf;
+    memcpy(&is_leaf, buffer, sizeof(int));
+
+    if (is_leaf) {
+
+        leaf_node* node = reinterpret_cast<leaf_node*>(buffer);
+
+        //hands out every run of matching records
+        int first = 0;
+        while (first < node->record_num) {
+
+            int last = first;
+            while (last < node->record_num && filter.matches(node->records[last]))
+                last++;
+
+            if (first < last && !visit(node->records + first, node->records + last))
+                return false;
+
+            first = last;
+            while (first < node->record_num && !filter.matches(node->records[first]))
+                first++;
+        }
+
+        return true;
+    }
+
+    internal_node* node = reinterpret_cast<internal_node*>(buffer);
+
+    for (int i = 0; i <= node->numKeys; i++) {
+
+        if (!filter.overlaps(node->zones[i]))
+            continue;
+
+        if (!filteredScanRecursive(node->children[i], filter, visit))
+            return false;
+    }
+
+    return true;
+}
+
+//copies every matching run
+vector<Record> b_plus_tree::filteredQuery(const scan_filter& filter) {
+
+    vector<Record> result;
+
+    filteredScan(filter, [&](const Record* first, const Record* last) {
+        result.insert(result.end(), first, last);
+        return true;
+    });
 
-    //returns vector of records 
     return result;
 }
 
+//reads the page and summarizes it
+zone_map b_plus_tree::subtreeZone(int pageID) {
+
+    char buffer[PAGE_SIZE] = {0};
+    handler.readPage(pageID, buffer);
+
+    int is_leaf;
+    memcpy(&is_leaf, buffer, sizeof(int));
+
+    zone_map zone;
+
+    if (is_leaf) {
+
+        leaf_node* node = reinterpret_cast<leaf_node*>(buffer);
+
+        for (int i = 0; i < node->record_num; i++)
+            zone.add(node->records[i]);
+    }
+    else {
+
+        internal_node* node = reinterpret_cast<internal_node*>(buffer);
+
+        for (int i = 0; i <= node->numKeys; i++)
+            zone.merge(node->zones[i]);
+    }
+
+    return zone;
+}
+
+//goes down to the leaf that can hold low, the same way rangeScanR does
+leaf_cursor::leaf_cursor(b_plus_tree& tree, int low) : handler(tree.getHandler()) {
+
+    char buffer[PAGE_SIZE];
+    int current_node = tree.getRootPage();
+
+    while (true) {
+
+        handler.readPage(current_node, buffer);
+
+        int is_leaf;
+        memcpy(&is_leaf, buffer, sizeof(int));
+        if (is_leaf)
+            break;
+
+        internal_node* node = reinterpret_cast<internal_node*>(buffer);
+
+        int i = 0;
+        while (i < node->numKeys && low > node->keys[i])
+            i++;
+        current_node = node->children[i];
+    }
+
+    memcpy(&leaf, buffer, sizeof(leaf_node));
+    next_page = leaf.next_leaf_page;
+
+    //records of the first leaf before low are passed over
+    while (position < leaf.record_num && leaf.records[position].hilbert < low)
+        position++;
+}
+
+bool leaf_cursor::advance() {
+
+    if (next_page == INVALID_PAGE)
+        return false;
+
+    char buffer[PAGE_SIZE];
+    handler.readPage(next_page, buffer);
+
+    memcpy(&leaf, buffer, sizeof(leaf_node));
+    next_page = leaf.next_leaf_page;
+    position = 0;
+
+    return true;
+}
+
+//skips leaves emptied by deletes
+bool leaf_cursor::next(Record& out) {
+
+    while (position == leaf.record_num) {
+
+        if (!advance())
+            return false;
+    }
+
+    out = leaf.records[position++];
+    return true;
+}
+
+bool leaf_cursor::nextSlice(const Record*& first, const Record*& last) {
+
+    while (position == leaf.record_num) {
+
+        if (!advance())
+            return false;
+    }
+
+    first = leaf.records + position;
+    last = leaf.records + leaf.record_num;
+    position = leaf.record_num;
+
+    return true;
+}
+
 //calls the remove recursive function, while setting merged status to false
 void  b_plus_tree::removeR(int key) {
 
@@ -523,6 +990,69 @@ void  b_plus_tree::removeR(int key) {
     removeRecursive(root_page, key, merged);
 }
 
+//exact remove: goes down to the leftmost leaf that can hold the key, then follows the leaf chain through the
+//run of equal keys (which can span leaves) until the id matches. Like removeRecursive, the leaf is just
+//shifted and written back, so nothing above it changes
+bool b_plus_tree::removeRecord(int key, const char* id, Record* removed) {
+
+    //memory safe buffer intialization
+    char buffer[PAGE_SIZE] = {0};
+
+    int current_node = root_page;
+
+    while (true) {
+
+        handler.readPage(current_node, buffer);
+
+        int is_leaf;
+        memcpy(&is_leaf, buffer, sizeof(int));
+        if (is_leaf)
+            break;
+
+        internal_node* node = reinterpret_cast<internal_node*>(buffer);
+
+        int i = 0;
+        while (i < node->numKeys && key > node->keys[i])
+            i++;
+        current_node = node->children[i];
+    }
+
+    while (current_node != INVALID_PAGE) {
+
+        //the first leaf is already in the buffer
+        leaf_node* node = reinterpret_cast<leaf_node*>(buffer);
+
+        for (int i = 0; i < node->record_num; ++i) {
+
+            //past the key, it is not in the tree
+            if (node->records[i].hilbert > key)
+                return false;
+
+            if (node->records[i].hilbert == key && strcmp(node->records[i].id, id) == 0) {
+
+                if (removed)
+                    *removed = node->records[i];
+
+                for (int j = i; j < node->record_num - 1; ++j)
+                    node->records[j] = node->records[j + 1];
+
+                node->record_num--;
+
+                handler.writePage(current_node, buffer, sizeof(leaf_node));
+                return true;
+            }
+        }
+
+        //goes to neighboring leaf
+        current_node = node->next_leaf_page;
+
+        if (current_node != INVALID_PAGE)
+            handler.readPage(current_node, buffer);
+    }
+
+    return false;
+}
+
 //main remove functionality, as it is down recursively
 void  b_plus_tree::removeRecursive(int pageID, int key, bool& merged) {
 
@@ -589,6 +1119,7 @@ void  b_plus_tree::removeRecursive(int pageID, int key, bool& merged) {
 
                 node->keys[j] = node->keys[j + 1];
                 node->children[j + 1] = node->children[j + 2];
+                node->zones[j + 1] = node->zones[j + 2];
             }
 
             //decrease the number of keys
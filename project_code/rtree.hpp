@@ -24,6 +24,9 @@ The last two links are used as inspiration for the disk based implementation of
 //needed for data manipulation
 #include <vector>
 #include <string>
+#include <functional>
+#include <climits>
+#include <cfloat>
 
 using namespace std;
 
@@ -61,6 +64,10 @@ struct Record {
     char timestamp[29];
 
     int hilbert;
+
+    //LS-tree: highest level the record was drawn into (geometric, P(top_level >= i) = 2^-i), so it is in levels
+    //0 to top_level. Drawn once when the record is inserted
+    unsigned char top_level = 0;
 };
 
 //used in conjunction with push
@@ -86,6 +93,36 @@ struct leaf_node {
 //error checking 
 static_assert(sizeof(leaf_node) <= PAGE_SIZE, "leaf_node exceeds page size");
 
+//characters of a "YYYY-MM-DD hh:mm:ss" timestamp, plus 1 for \0. Timestamps in this format sort the same way
+//as strings and as times, so they are compared as strings
+constexpr int ZONE_TIMESTAMP_LEN = 20;
+
+//summary of a subtree, kept in its parent's entry: bounds on the hilbert values, coordinates and timestamps of
+//its records, so that scans can skip the subtree without reading it. Inserts widen the bounds, deletes leave
+//them as they are, which is still correct, just looser
+struct zone_map {
+
+    int min_hilbert = INT_MAX;
+    int max_hilbert = INT_MIN;
+
+    float min_lat = FLT_MAX;
+    float max_lat = -FLT_MAX;
+    float min_lon = FLT_MAX;
+    float max_lon = -FLT_MAX;
+
+    char min_timestamp[ZONE_TIMESTAMP_LEN] = {};
+    char max_timestamp[ZONE_TIMESTAMP_LEN] = {};
+
+    //no records yet
+    bool empty() const { return min_hilbert > max_hilbert; }
+
+    //widens the bounds to cover the record, returns whether they changed
+    bool add(const Record& rec);
+
+    //widens the bounds to cover another zone
+    void merge(const zone_map& other);
+};
+
 //internal node, stores key (used as MBB) and children nodes
 struct internal_node {
 
@@ -96,11 +133,42 @@ struct internal_node {
     //children and keys
     int keys[MAX_INTERNAL_KEYS];
     int children[MAX_INTERNAL_KEYS + 1];
+
+    //zone map of every child's subtree
+    zone_map zones[MAX_INTERNAL_KEYS + 1];
 };
 
 //error checking
 static_assert(sizeof(internal_node) <= PAGE_SIZE, "internal_node exceeds page size");
 
+//what a filtered scan is after: a hilbert range, and optionally a lat/lon rectangle and a time window (both ends
+//included). Subtrees whose zone maps miss any of them are skipped without being read
+struct scan_filter {
+
+    int low = INT_MIN;
+    int high = INT_MAX;
+
+    bool by_rect = false;
+    float lat_low = 0, lat_high = 0, lon_low = 0, lon_high = 0;
+
+    bool by_time = false;
+    char time_from[ZONE_TIMESTAMP_LEN] = {};
+    char time_to[ZONE_TIMESTAMP_LEN] = {};
+
+    //just a hilbert range
+    static scan_filter hilbertRange(int low, int high);
+
+    void setRect(float lat_low, float lat_high, float lon_low, float lon_high);
+
+    //timestamps in "YYYY-MM-DD hh:mm:ss" format, a shorter prefix such as a date works too
+    void setTime(const string& from, const string& to);
+
+    bool matches(const Record& rec) const;
+
+    //whether the zone can have a matching record
+    bool overlaps(const zone_map& zone) const;
+};
+
 //class used to handle pages for inserts, writes, reads. base of I/O functionality
 class page_handler {
 
@@ -116,6 +184,9 @@ public:
     void writePage(int pageID, const void* data, size_t dataSize);
     void readPage(int pageID, void* buffer);
 
+    //number of pages read by the calling thread so far
+    static long int threadPageReads();
+
     //gets the page path for further operations
     string getPagePath(int pageID);
 
@@ -137,8 +208,27 @@ public:
     //I/O operations functions 
     void insert(int key, const Record& rec);
     void removeR(int key);
+
+    //removes the record with this key and id (removeR removes the first record with the key, whichever it is).
+    //The removed record is copied into removed if given, returns false if there is no such record
+    bool removeRecord(int key, const char* id, Record* removed = nullptr);
     vector<Record> rangeQueryR(int low, int high);
 
+    //bulk loading into an empty tree, for records that come in hilbert order: appendSorted fills the leaves
+    //left to right and writes each one once, when it is full, and finishBulkLoad builds the internal nodes
+    //over the leaves, one level at a time
+    void appendSorted(const Record& rec);
+    void finishBulkLoad();
+
+    //goes through the leaves of [low, high] in order, calling visit with each leaf and the slice [first, last) of
+    //its records that is in range, without copying them. Returning false from visit ends the scan
+    void rangeScanR(int low, int high, const function<bool(const leaf_node&, int, int)>& visit);
+
+    //goes down the tree in hilbert order, skipping every subtree whose zone map misses the filter, and calls visit
+    //with the runs [first, last) of matching records of every leaf it reads. Returning false from visit ends the scan
+    void filteredScan(const scan_filter& filter, const function<bool(const Record*, const Record*)>& visit);
+    vector<Record> filteredQuery(const scan_filter& filter);
+
     //used to get root and handler info for main
     int getRootPage()  { return root_page; }
     page_handler& getHandler()  { return handler; }
@@ -155,6 +245,20 @@ private:
     //stores the root page id 
     int root_page;
 
+    //root.meta of the tree's own directory, so trees in different directories (like the LS-tree levels) each
+    //keep their own root
+    string root_meta;
+
+    //bulk load state: records of the leaf being filled, its page, and the first key, page and zone map of every
+    //leaf so far
+    vector<Record> bulk_leaf;
+    int bulk_page = INVALID_PAGE;
+    vector<pair<int, int>> bulk_fences;
+    vector<zone_map> bulk_zones;
+
+    //writes the leaf being filled, linked to next_page
+    void writeBulkLeaf(int next_page);
+
     //further explanation seen in cpp
     int createLeaf();
     int createInternal();
@@ -163,7 +267,14 @@ private:
     void insertRecursive(int pageID, int key, const Record& rec, int& promoted_key, int& new_child_page);
 
     void splitLeaf(leaf_node& node, const Record& rec, int& promoted_key, int& newPageID);
-    void splitInternal(internal_node& node, int newKey, int new_child_page, int& promoted_key, int& newPageID);
+    void splitInternal(internal_node& node, int newKey, int new_child_page, const zone_map& new_child_zone,
+                       int& promoted_key, int& newPageID);
+
+    //zone map of the subtree at a page, from the records of a leaf or the zones of an internal node
+    zone_map subtreeZone(int pageID);
+
+    //filteredScan below a page, false once visit asked to stop
+    bool filteredScanRecursive(int pageID, const scan_filter& filter, const function<bool(const Record*, const Record*)>& visit);
 
     
     void removeRecursive(int pageID, int key, bool& merged);
@@ -171,4 +282,34 @@ private:
     
 };
 
+//pull based walk over a tree's leaf chain in hilbert order, starting at the first leaf that can hold low. Only the
+//current leaf is in memory, so a whole level can be read (and fed to a bulk loader) whatever its size. The tree
+//must not change while the cursor is in use
+class leaf_cursor {
+
+public:
+
+    leaf_cursor(b_plus_tree& tree, int low = INT_MIN);
+
+    //puts the next record in out, false once the chain ends
+    bool next(Record& out);
+
+    //the rest of the current leaf as [first, last), moving on to the next leaf on the next call. False once the
+    //chain ends
+    bool nextSlice(const Record*& first, const Record*& last);
+
+private:
+
+    page_handler& handler;
+
+    leaf_node leaf;
+    int position = 0;
+
+    //page of the leaf after the current one
+    int next_page;
+
+    //reads the next leaf of the chain, false if there is none
+    bool advance();
+};
+
 extern const string ROOT_META_FILE;
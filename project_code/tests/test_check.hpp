@@ -0,0 +1,33 @@
+// --- Test checks ---
+
+/*
+The checks of every test program in this directory, whichever tree it tests. Every test is its own program, built and
+run by make test, and exits with 1 if any of its checks failed.
+*/
+
+//a check to make sure that this header file is only included once
+#pragma once
+
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+//number of checks that failed so far
+inline int failed_checks = 0;
+
+//prints the check that failed and where, and carries on so one run shows every failure
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            failed_checks++; \
+            cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << endl; \
+        } \
+    } while (0)
+
+//prints how the test went, used as the return value of main
+inline int testResult(const string& name) {
+
+    cout << name << ": " << (failed_checks == 0 ? "passed" : to_string(failed_checks) + " checks failed") << endl;
+    return failed_checks == 0 ? 0 : 1;
+}
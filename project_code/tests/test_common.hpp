@@ -0,0 +1,30 @@
+// --- Test helpers ---
+
+/*
+Shared by the test programs in this directory that test the R-tree and the LS-tree (they share rtree.hpp's Record)
+and the disk sort. The records are made up on the spot, so the tests do not need any of the csv files. The RS-tree
+tests have their own Record, and use test_rs_common.hpp instead.
+*/
+
+//a check to make sure that this header file is only included once
+#pragma once
+
+#include "test_check.hpp"
+#include "../rtree.hpp"
+#include <cstdio>
+
+using namespace std;
+
+//record number i with the given hilbert value, its id is "r<i>" and its coordinates and timestamp follow from i
+inline Record testRecord(int i, int hilbert) {
+
+    Record rec{};
+
+    snprintf(rec.id, sizeof(rec.id), "r%d", i);
+    rec.hilbert = hilbert;
+    rec.lat = 38.8f + (i % 1000) * 0.0002f;
+    rec.lon = -77.1f + (i / 1000 % 1000) * 0.0002f;
+    snprintf(rec.timestamp, sizeof(rec.timestamp), "2008-%02d-%02d %02d:%02d:00", 1 + i % 12, 1 + i % 28, i % 24, i % 60);
+
+    return rec;
+}
@@ -0,0 +1,109 @@
+// --- LS-tree catalog test ---
+
+/*
+Saves an LS-tree's catalog, changes the tree and saves it again, and reopens it from a directory it was moved to.
+Every save has to leave the snapshot the previous catalog points at alone until the new catalog is in place, and the
+catalog has to find the levels from wherever the tree's directory is.
+*/
+
+#include "test_common.hpp"
+#include "../LSTree.hpp"
+#include <climits>
+#include <filesystem>
+#include <fstream>
+#include <unordered_set>
+
+using namespace std;
+
+//enough records for a disk level below the memory level
+constexpr int BUILD_RECORDS = 300000;
+constexpr int INSERTED_RECORDS = 5000;
+
+//the memory level snapshot named in a saved catalog
+static string catalogSnapshot(const string& dir) {
+
+    ifstream in(dir + "/catalog.meta");
+    string word;
+
+    while (in >> word)
+        if (word == "memory" && in >> word && in >> word)
+            return word;
+
+    return "";
+}
+
+//number of distinct records in level 0, along with the buffered inserts
+static size_t levelZeroRecords(ls_tree& tree) {
+
+    unordered_set<string> ids;
+
+    tree.scanLevel(0, INT_MIN, INT_MAX, [&](const Record* first, const Record* last) {
+        for (; first < last; first++)
+            ids.insert(first->id);
+        return true;
+    });
+
+    return ids.size();
+}
+
+int main() {
+
+    const string dir = "test_pages_ls_catalog";
+    const string moved = "test_pages_ls_catalog_moved";
+    filesystem::remove_all(dir);
+    filesystem::remove_all(moved);
+
+    //fixed seed, so a failure can be run again
+    seedRandom(45);
+
+    vector<long int> saved_counts;
+
+    {
+        ls_tree tree(dir);
+
+        for (int i = 0; i < BUILD_RECORDS; i++)
+            tree.buildAppend(testRecord(i, i / 3));
+
+        tree.finishBuild();
+
+        CHECK(tree.levels.size() >= 1);
+        CHECK(tree.isMemoryTree);
+
+        CHECK(tree.saveCatalog());
+
+        string first = catalogSnapshot(dir);
+        CHECK(!first.empty());
+        CHECK(filesystem::exists(dir + "/" + first));
+
+        //the second save writes its snapshot next to the first one, which goes once the catalog points elsewhere
+        for (int i = BUILD_RECORDS; i < BUILD_RECORDS + INSERTED_RECORDS; i++)
+            tree.insertMoreRecords(testRecord(i, (i - BUILD_RECORDS) * 53 % (BUILD_RECORDS / 3)));
+
+        CHECK(tree.saveCatalog());
+
+        string second = catalogSnapshot(dir);
+        CHECK(!second.empty() && second != first);
+        CHECK(filesystem::exists(dir + "/" + second));
+        CHECK(!filesystem::exists(dir + "/" + first));
+
+        saved_counts = tree.levelRecords;
+    }
+
+    //the catalog holds the level directories relative to the tree's directory, so the tree can be moved
+    filesystem::rename(dir, moved);
+
+    {
+        ls_tree tree(moved);
+
+        CHECK(ls_tree::catalogExists(moved));
+        CHECK(tree.openCatalog());
+
+        CHECK(tree.levelRecords == saved_counts);
+        CHECK(levelZeroRecords(tree) == (size_t) (BUILD_RECORDS + INSERTED_RECORDS));
+        CHECK(tree.querying(INT_MIN, INT_MAX, 1000).size() == 1000);
+    }
+
+    filesystem::remove_all(moved);
+
+    return testResult("test_ls_catalog");
+}
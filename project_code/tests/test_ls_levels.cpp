@@ -0,0 +1,134 @@
+// --- LS-tree level test ---
+
+/*
+Builds an LS-tree with a few disk levels and a memory level, and checks the level layout: level i holds exactly the
+records whose top level is at least i (the memory level everything at or above its index), the level counts match
+what the levels hold, and the level sizes follow the geometric law, |level i| ≈ n / 2^i. The layout is checked again
+after inserts have been flushed into the levels and after removes.
+*/
+
+#include "test_common.hpp"
+#include "../LSTree.hpp"
+#include <climits>
+#include <cmath>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+//enough records for two disk levels below the memory level
+constexpr int BUILD_RECORDS = 600000;
+constexpr int INSERTED_RECORDS = LS_INSERT_BUFFER_RECORDS + 1000;
+constexpr int REMOVED_RECORDS = 3000;
+
+//the ids of a level's records, along with their top levels
+static unordered_map<string, int> levelContents(ls_tree& tree, size_t index) {
+
+    unordered_map<string, int> contents;
+
+    tree.scanLevel(index, INT_MIN, INT_MAX, [&](const Record* first, const Record* last) {
+
+        for (; first < last; first++)
+            CHECK(contents.insert({first->id, first->top_level}).second);
+
+        return true;
+    });
+
+    return contents;
+}
+
+//checks that every level holds exactly the records of level 0 that reach it
+static void checkLayout(ls_tree& tree, size_t expected_records) {
+
+    unordered_map<string, int> all = levelContents(tree, 0);
+    CHECK(all.size() == expected_records);
+
+    for (size_t index = 1; index < tree.size(); index++) {
+
+        unordered_map<string, int> level = levelContents(tree, index);
+
+        size_t reaching = 0;
+        for (const auto& entry : all)
+            reaching += entry.second >= (int) index;
+
+        //every record of the level reaches it and is in level 0, and every record that reaches it is there
+        size_t misplaced = 0;
+        for (const auto& entry : level)
+            misplaced += entry.second < (int) index || all.count(entry.first) == 0;
+
+        CHECK(misplaced == 0);
+        CHECK(level.size() == reaching);
+    }
+}
+
+//checks the level counts against the levels, and the level sizes against the geometric law
+static void checkSizes(ls_tree& tree) {
+
+    CHECK(tree.levelRecords.size() == tree.size());
+
+    double n = tree.levelRecords[0];
+
+    for (size_t index = 0; index < tree.size(); index++) {
+
+        size_t scanned = levelContents(tree, index).size();
+        CHECK(tree.levelRecords[index] == (long int) scanned);
+
+        //binomial(n, 2^-i), within 5 standard deviations
+        double p = ldexp(1.0, -(int) index);
+        double deviation = sqrt(n * p * (1 - p));
+
+        CHECK(fabs(scanned - n * p) <= 5 * deviation + 1);
+    }
+}
+
+int main() {
+
+    const string dir = "test_pages_ls_levels";
+    filesystem::remove_all(dir);
+
+    //fixed seed, so a failure can be run again
+    seedRandom(43);
+
+    {
+        ls_tree tree(dir);
+
+        for (int i = 0; i < BUILD_RECORDS; i++)
+            tree.buildAppend(testRecord(i, i / 3));
+
+        tree.finishBuild();
+
+        //two disk levels, with the memory level on top
+        CHECK(tree.levels.size() == 2);
+        CHECK(tree.isMemoryTree);
+        CHECK(tree.memoryTree.size() <= LS_MEMORY_LEVEL_RECORDS);
+
+        checkLayout(tree, BUILD_RECORDS);
+        checkSizes(tree);
+
+        //enough inserts for one flush into the levels, with the rest left in the insert buffer
+        for (int i = BUILD_RECORDS; i < BUILD_RECORDS + INSERTED_RECORDS; i++)
+            tree.insertMoreRecords(testRecord(i, (i - BUILD_RECORDS) * 37 % (BUILD_RECORDS / 3)));
+
+        CHECK(tree.bufferedInserts() < LS_INSERT_BUFFER_RECORDS);
+        checkLayout(tree, BUILD_RECORDS + INSERTED_RECORDS);
+
+        //removes of built and inserted records
+        for (int i = 0; i < REMOVED_RECORDS; i++) {
+
+            int number = (i % 2 == 0) ? i * 97 % BUILD_RECORDS : BUILD_RECORDS + i * 5 % INSERTED_RECORDS;
+            int hilbert = (number < BUILD_RECORDS) ? number / 3 : (number - BUILD_RECORDS) * 37 % (BUILD_RECORDS / 3);
+
+            CHECK(tree.removeHilbert(testRecord(number, hilbert)));
+        }
+
+        tree.finishMaintenance();
+
+        checkLayout(tree, BUILD_RECORDS + INSERTED_RECORDS - REMOVED_RECORDS);
+        checkSizes(tree);
+    }
+
+    filesystem::remove_all(dir);
+
+    return testResult("test_ls_levels");
+}
@@ -0,0 +1,110 @@
+// --- LS-tree rebuild test ---
+
+/*
+Removes records from a saved LS-tree while a rebuild is running, and checks that the removes do not wait on the
+rebuild, that the records are gone from the queries right away and from the new levels once they are swapped in,
+and that the saved catalog still opens the tree after the old level directories were removed.
+*/
+
+#include "test_common.hpp"
+#include "../LSTree.hpp"
+#include <climits>
+#include <filesystem>
+#include <unordered_set>
+
+using namespace std;
+
+//enough records for a disk level below the memory level, and a rebuild that takes a while
+constexpr int BUILD_RECORDS = 300000;
+constexpr int REMOVED_RECORDS = 2000;
+
+//record number of the i-th remove
+static int removedNumber(int i) {
+
+    return i * 149 % BUILD_RECORDS;
+}
+
+//the ids of level 0
+static unordered_set<string> levelZero(ls_tree& tree) {
+
+    unordered_set<string> ids;
+
+    tree.scanLevel(0, INT_MIN, INT_MAX, [&](const Record* first, const Record* last) {
+        for (; first < last; first++)
+            ids.insert(first->id);
+        return true;
+    });
+
+    return ids;
+}
+
+//checks that none of the removed records are in level 0, and that everything else is
+static void checkRemoved(ls_tree& tree) {
+
+    unordered_set<string> ids = levelZero(tree);
+
+    size_t still_there = 0;
+    for (int i = 0; i < REMOVED_RECORDS; i++)
+        still_there += ids.count(testRecord(removedNumber(i), 0).id);
+
+    CHECK(still_there == 0);
+    CHECK(ids.size() == (size_t) (BUILD_RECORDS - REMOVED_RECORDS));
+    CHECK(tree.recordCount() == BUILD_RECORDS - REMOVED_RECORDS);
+}
+
+int main() {
+
+    const string dir = "test_pages_ls_rebuild";
+    filesystem::remove_all(dir);
+
+    //fixed seed, so a failure can be run again
+    seedRandom(46);
+
+    {
+        ls_tree tree(dir);
+
+        for (int i = 0; i < BUILD_RECORDS; i++)
+            tree.buildAppend(testRecord(i, i / 3));
+
+        tree.finishBuild();
+        CHECK(tree.saveCatalog());
+
+        CHECK(tree.startRebuild());
+        CHECK(tree.rebuilding());
+
+        //the removes go on while the rebuild reads level 0. A remove that waited on it would have swapped it in,
+        //and the first one takes far less time than the rebuild
+        for (int i = 0; i < REMOVED_RECORDS; i++) {
+
+            int number = removedNumber(i);
+            CHECK(tree.removeHilbert(testRecord(number, number / 3)));
+
+            if (i == 0)
+                CHECK(tree.rebuilding());
+        }
+
+        //a second remove of the same record finds nothing
+        CHECK(!tree.removeHilbert(testRecord(removedNumber(0), removedNumber(0) / 3)));
+
+        checkRemoved(tree);
+
+        //swaps the new levels in, which get the removes, and saves the catalog again
+        tree.finishMaintenance();
+
+        CHECK(!tree.rebuilding());
+        CHECK(!filesystem::exists(dir + "/btree0"));
+
+        checkRemoved(tree);
+    }
+
+    {
+        ls_tree tree(dir);
+
+        CHECK(tree.openCatalog());
+        checkRemoved(tree);
+    }
+
+    filesystem::remove_all(dir);
+
+    return testResult("test_ls_rebuild");
+}
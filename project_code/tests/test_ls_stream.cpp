@@ -0,0 +1,89 @@
+// --- LS-tree sample stream test ---
+
+/*
+Streams every record of a few ranges out of an LS-tree with several disk levels, a memory level and buffered
+inserts, and checks that each record in range comes out exactly once. Level 0 has more new records than
+LS_STREAM_BUCKET_RECORDS, so the bucketed scans are covered too.
+*/
+
+#include "test_common.hpp"
+#include "../LSTree.hpp"
+#include <filesystem>
+#include <climits>
+#include <unordered_set>
+
+using namespace std;
+
+//records of the build, 5 per hilbert value, and inserts after it
+constexpr int BUILD_RECORDS = 300000;
+constexpr int INSERTED_RECORDS = 2000;
+
+//hilbert value of record i, inserts are spread over the same range as the build
+static int hilbertOf(int i) {
+
+    return i < BUILD_RECORDS ? i / 5 : (i - BUILD_RECORDS) * 29 % (BUILD_RECORDS / 5);
+}
+
+//streams [low, high] to the end and checks that every record in range came out once
+static void checkStream(ls_tree& tree, int low, int high) {
+
+    ls_sample_stream stream(tree, low, high);
+
+    unordered_set<string> seen;
+    Record rec;
+    size_t duplicates = 0;
+    size_t out_of_range = 0;
+
+    while (stream.next(rec)) {
+
+        if (!seen.insert(rec.id).second)
+            duplicates++;
+
+        if (rec.hilbert < low || rec.hilbert > high)
+            out_of_range++;
+    }
+
+    size_t expected = 0;
+    for (int i = 0; i < BUILD_RECORDS + INSERTED_RECORDS; i++)
+        expected += hilbertOf(i) >= low && hilbertOf(i) <= high;
+
+    CHECK(duplicates == 0);
+    CHECK(out_of_range == 0);
+    CHECK(seen.size() == expected);
+    CHECK(stream.produced() == expected);
+}
+
+int main() {
+
+    const string dir = "test_pages_ls_stream";
+    filesystem::remove_all(dir);
+
+    //fixed seed, so a failure can be run again
+    seedRandom(33);
+
+    {
+        ls_tree tree(dir);
+
+        for (int i = 0; i < BUILD_RECORDS; i++)
+            tree.buildAppend(testRecord(i, hilbertOf(i)));
+
+        tree.finishBuild();
+
+        //few enough to stay in the insert buffer
+        for (int i = BUILD_RECORDS; i < BUILD_RECORDS + INSERTED_RECORDS; i++)
+            tree.insertMoreRecords(testRecord(i, hilbertOf(i)));
+
+        CHECK(tree.levels.size() >= 1);
+        CHECK(tree.isMemoryTree);
+        CHECK(tree.bufferedInserts() == (size_t) INSERTED_RECORDS);
+
+        checkStream(tree, INT_MIN, INT_MAX);
+        checkStream(tree, 10000, 30000);
+        checkStream(tree, 500, 520);
+        checkStream(tree, BUILD_RECORDS, INT_MAX);
+    }
+
+    filesystem::remove_all(dir);
+
+    return testResult("test_ls_stream");
+}
@@ -0,0 +1,212 @@
+// --- LS-tree memory level test ---
+
+/*
+Runs inserts, deletes and scans on a memory_level next to a plain sorted vector of the same records, and checks
+that both agree after every round. Some keys have runs of records longer than a block, so lookups, inserts and
+deletes have to cross block boundaries, and blocks get split and dropped along the way.
+*/
+
+#include "test_common.hpp"
+#include "../LSTree.hpp"
+#include <algorithm>
+#include <climits>
+#include <filesystem>
+
+using namespace std;
+
+//keys go from 0 to KEY_RANGE, and the records of a few of them fill more than a block
+constexpr int KEY_RANGE = 20000;
+constexpr int RUN_KEYS[] = {0, 7777, KEY_RANGE};
+constexpr size_t RUN_RECORDS = 3 * MEMORY_BLOCK_RECORDS;
+
+//the records of the level in (hilbert, id) order, for comparing with the reference
+static vector<pair<int, string>> ordered(const vector<Record>& records) {
+
+    vector<pair<int, string>> keys;
+    for (const Record& rec : records)
+        keys.push_back({rec.hilbert, rec.id});
+
+    sort(keys.begin(), keys.end());
+    return keys;
+}
+
+//the reference records in [low, high]
+static vector<Record> referenceRange(const vector<Record>& reference, int low, int high) {
+
+    vector<Record> result;
+    for (const Record& rec : reference)
+        if (rec.hilbert >= low && rec.hilbert <= high)
+            result.push_back(rec);
+
+    return result;
+}
+
+//checks a range of the level against the reference, including the hilbert order of what the scan hands out
+static void checkRange(const memory_level& level, const vector<Record>& reference, int low, int high) {
+
+    vector<Record> scanned;
+    bool in_order = true;
+
+    level.rangeScanR(low, high, [&](const Record* first, const Record* last) {
+
+        for (; first < last; first++) {
+
+            if (!scanned.empty() && first->hilbert < scanned.back().hilbert)
+                in_order = false;
+
+            scanned.push_back(*first);
+        }
+
+        return true;
+    });
+
+    CHECK(in_order);
+    CHECK(ordered(scanned) == ordered(referenceRange(reference, low, high)));
+    CHECK(ordered(level.rangeQueryR(low, high)) == ordered(scanned));
+}
+
+//checks the whole level, a range around every long run, and a few random ones
+static void checkLevel(const memory_level& level, const vector<Record>& reference, xoshiro256& rand_gen) {
+
+    CHECK(level.size() == reference.size());
+    CHECK(level.empty() == reference.empty());
+
+    checkRange(level, reference, INT_MIN, INT_MAX);
+
+    for (int key : RUN_KEYS) {
+        checkRange(level, reference, key, key);
+        checkRange(level, reference, key - 1, key + 1);
+    }
+
+    for (int i = 0; i < 20; i++) {
+
+        int low = rand_gen.between(-10, KEY_RANGE + 10);
+        checkRange(level, reference, low, low + rand_gen.between(0, KEY_RANGE / 10));
+    }
+}
+
+int main() {
+
+    //fixed seed, so a failure can be run again
+    seedRandom(42);
+    xoshiro256& rand_gen = threadRng();
+
+    vector<Record> reference;
+    int next_id = 0;
+
+    //a random key, or one of the long runs every so often
+    auto randomKey = [&]() {
+
+        if (rand_gen.bernoulli(0.3))
+            return RUN_KEYS[rand_gen.bounded(size(RUN_KEYS))];
+
+        return (int) rand_gen.between(0, KEY_RANGE);
+    };
+
+    //built from records out of order, with the long runs in it from the start
+    for (int key : RUN_KEYS)
+        for (size_t i = 0; i < RUN_RECORDS; i++)
+            reference.push_back(testRecord(next_id++, key));
+
+    for (int i = 0; i < 10000; i++)
+        reference.push_back(testRecord(next_id++, randomKey()));
+
+    shuffle(reference.begin(), reference.end(), rand_gen);
+
+    memory_level level;
+    level.build(reference);
+    checkLevel(level, reference, rand_gen);
+
+    for (int round = 0; round < 8; round++) {
+
+        //inserts, which split the blocks they fill up
+        for (int i = 0; i < 3000; i++) {
+
+            Record rec = testRecord(next_id++, randomKey());
+            level.insert(rec);
+            reference.push_back(rec);
+        }
+
+        checkLevel(level, reference, rand_gen);
+
+        //deletes of records that are there, many of them in the runs that span blocks
+        for (int i = 0; i < 3000 && !reference.empty(); i++) {
+
+            size_t pick = rand_gen.bounded(reference.size());
+            Record removed{};
+
+            CHECK(level.remove(reference[pick].hilbert, reference[pick].id, &removed));
+            CHECK(strcmp(removed.id, reference[pick].id) == 0);
+
+            reference[pick] = reference.back();
+            reference.pop_back();
+        }
+
+        //and of records that are not, with a key that is there and one that is not
+        CHECK(!level.remove(RUN_KEYS[1], "missing"));
+        CHECK(!level.remove(KEY_RANGE + 5, "r0"));
+
+        checkLevel(level, reference, rand_gen);
+    }
+
+    //empties one of the long runs completely, which drops the blocks it filled
+    for (size_t i = 0; i < reference.size();) {
+
+        if (reference[i].hilbert == RUN_KEYS[1]) {
+            CHECK(level.remove(reference[i].hilbert, reference[i].id));
+            reference[i] = reference.back();
+            reference.pop_back();
+        }
+
+        else {
+            i++;
+        }
+    }
+
+    checkLevel(level, reference, rand_gen);
+
+    //appends in order to a level loaded from a cursor, and one that is out of order
+    memory_level appended;
+    vector<Record> sorted_reference = reference;
+    stable_sort(sorted_reference.begin(), sorted_reference.end(), [](const Record& a, const Record& b) { return a.hilbert < b.hilbert; });
+
+    for (const Record& rec : sorted_reference)
+        appended.appendSorted(rec);
+
+    Record late = testRecord(next_id++, KEY_RANGE / 2);
+    appended.appendSorted(late);
+    sorted_reference.push_back(late);
+
+    checkLevel(appended, sorted_reference, rand_gen);
+
+    //filtered scans, against the filter applied to the reference
+    scan_filter filter = scan_filter::hilbertRange(1000, KEY_RANGE - 1000);
+    filter.setRect(38.81f, 38.9f, -77.1f, -77.09f);
+
+    vector<Record> filtered;
+    level.filteredScan(filter, [&](const Record* first, const Record* last) {
+        filtered.insert(filtered.end(), first, last);
+        return true;
+    });
+
+    vector<Record> expected;
+    for (const Record& rec : reference)
+        if (filter.matches(rec))
+            expected.push_back(rec);
+
+    CHECK(!expected.empty());
+    CHECK(ordered(filtered) == ordered(expected));
+
+    //a snapshot reads back into the same level
+    const string path = "test_memory_level.bin";
+
+    CHECK(level.snapshot(path));
+
+    memory_level restored;
+    CHECK(restored.restore(path));
+    checkLevel(restored, reference, rand_gen);
+
+    filesystem::remove(path);
+
+    return testResult("test_memory_level");
+}
@@ -0,0 +1,472 @@
+// --- RS-tree aggregation test ---
+
+/*
+Checks the RS-tree's online aggregation against the true COUNT/SUM/AVG of made up points, found by a pass over all
+of them. The points are denser in the south, and their weight is 1 in the south half and varies in the north half.
+Over repeated runs the 95% intervals of aggregateRect, aggregateRange, aggregateRangeWeighted, groupedAggregate over a
+sample_stream, and of stratified strata put together with combineEstimates have to hold the true values about 95% of
+the time. stratifiedSample has to hand out exactly total_k samples, each cell at least the pilot and the rest by its
+allocation, and every query has to stop for each of the reasons a stop condition gives.
+*/
+
+#include "test_rs_common.hpp"
+#include "../hilbert.h"
+#include "../rng.hpp"
+#include <algorithm>
+#include <climits>
+#include <functional>
+
+using namespace std;
+
+constexpr int RECORDS = 20000;
+
+//the hilbert grid the points are put on
+constexpr double GRID_MIN = 0;
+constexpr double GRID_MAX = 100;
+constexpr int P = 8;
+
+//runs of every query whose intervals are checked
+constexpr int RUNS = 200;
+
+//the rectangle aggregated
+constexpr double LAT_LOW = 20;
+constexpr double LAT_HIGH = 60;
+constexpr double LON_LOW = 30;
+constexpr double LON_HIGH = 70;
+
+//true values of a query
+struct truth {
+
+    double count = 0;
+    double sum = 0;
+
+    double avg() const { return sum / count; }
+};
+
+//the values aggregated, the weight, and the latitude for the weighted queries (whose SUM of the weight is exact)
+static double weightField(const Record& rec) {
+
+    return rec.weight;
+}
+
+static double latField(const Record& rec) {
+
+    return rec.lat;
+}
+
+//points with lat = 100 * u^2, so there are more in the south, sorted by hilbert value for the build
+static vector<Record> makeRecords() {
+
+    xoshiro256& rand_gen = threadRng();
+    uniform_real_distribution<double> unit(0.0, 1.0);
+
+    vector<Record> records;
+
+    for (int i = 0; i < RECORDS; i++) {
+
+        double u = unit(rand_gen);
+        double lat = GRID_MAX * u * u;
+        double lon = GRID_MAX * unit(rand_gen);
+        double weight = (lat < 50) ? 1.0 : 1.0 + 9.0 * unit(rand_gen);
+
+        Record rec = rsRecord(i, 0, (float) weight);
+        rec.lat = (float) lat;
+        rec.lon = (float) lon;
+        rec.hilbert = coords_to_hilbert_value(rec.lat, rec.lon, GRID_MIN, GRID_MAX, GRID_MIN, GRID_MAX, P);
+
+        records.push_back(rec);
+    }
+
+    sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.hilbert < b.hilbert; });
+
+    return records;
+}
+
+//true values of field over the records that pass the predicate
+static truth bruteForce(const vector<Record>& records, const function<bool(const Record&)>& passes,
+                        const b_plus_tree::record_field& field = weightField) {
+
+    truth expected;
+
+    for (const Record& rec : records) {
+        if (passes(rec)) {
+            expected.count++;
+            expected.sum += field(rec);
+        }
+    }
+
+    return expected;
+}
+
+//whether the interval holds the value
+static bool holds(const aggregate_estimate& estimate, double value) {
+
+    return estimate.low <= value && value <= estimate.high;
+}
+
+//runs the query RUNS times with a budget of samples, which it has to use up every time, and checks that the
+//intervals held the true values about 95% of the time. With exact_count, COUNT has to be the true count every time
+static void checkCoverage(const function<online_aggregation()>& query, const truth& expected, size_t samples, bool exact_count) {
+
+    size_t count_covered = 0;
+    size_t sum_covered = 0;
+    size_t avg_covered = 0;
+    size_t wrong_stops = 0;
+    size_t wrong_counts = 0;
+
+    for (int run = 0; run < RUNS; run++) {
+
+        online_aggregation result = query();
+
+        wrong_stops += result.stopReason() != STOP_SAMPLES || result.samples() != samples;
+
+        if (exact_count)
+            wrong_counts += !result.count().exact || result.count().value != expected.count;
+
+        count_covered += holds(result.count(), expected.count);
+        sum_covered += holds(result.sum(), expected.sum);
+        avg_covered += holds(result.avg(), expected.avg());
+    }
+
+    CHECK(wrong_stops == 0);
+    CHECK(wrong_counts == 0);
+
+    if (!exact_count)
+        CHECK(coverageOk(count_covered, RUNS));
+
+    CHECK(coverageOk(sum_covered, RUNS));
+    CHECK(coverageOk(avg_covered, RUNS));
+}
+
+//the quarter of the latitudes a record is in, the groups of the grouped queries
+static bool latitudeBand(const Record& rec, long long int& key) {
+
+    key = min((int) (rec.lat / 25), 3);
+    return true;
+}
+
+//per group intervals of grouped queries over a stream of the whole tree
+static void checkGroupedCoverage(b_plus_tree& tree, const vector<Record>& records) {
+
+    vector<truth> expected(4);
+    for (int band = 0; band < 4; band++)
+        expected[band] = bruteForce(records, [&](const Record& rec) {
+            long long int key;
+            return latitudeBand(rec, key) && key == band;
+        });
+
+    vector<size_t> count_covered(4, 0);
+    vector<size_t> sum_covered(4, 0);
+    size_t wrong = 0;
+
+    for (int run = 0; run < RUNS; run++) {
+
+        sample_stream stream(tree, INT_MIN, INT_MAX);
+
+        grouped_aggregation result = groupedAggregate<Record>(stream, RECORDS, latitudeBand, weightField, stop_condition(2000),
+                                                              page_handler::threadPageReads);
+
+        wrong += result.stopReason() != STOP_SAMPLES || result.samples() != 2000 || result.groupCount() != 4;
+
+        for (int band = 0; band < 4; band++) {
+            count_covered[band] += holds(result.estimate(band, AGG_COUNT), expected[band].count);
+            sum_covered[band] += holds(result.estimate(band, AGG_SUM), expected[band].sum);
+        }
+    }
+
+    CHECK(wrong == 0);
+
+    for (int band = 0; band < 4; band++) {
+        CHECK(coverageOk(count_covered[band], RUNS));
+        CHECK(coverageOk(sum_covered[band], RUNS));
+    }
+}
+
+//whether a record is in a stratum's cell, with the upper bounds exclusive except on the viewport's edges
+static bool inCell(const Record& rec, const grid_stratum& stratum, int rows, int cols) {
+
+    bool lat_inside = rec.lat >= stratum.lat_low && (rec.lat < stratum.lat_high || (stratum.row == rows - 1 && rec.lat <= stratum.lat_high));
+    bool lon_inside = rec.lon >= stratum.lon_low && (rec.lon < stratum.lon_high || (stratum.col == cols - 1 && rec.lon <= stratum.lon_high));
+
+    return lat_inside && lon_inside;
+}
+
+//a 4 x 4 grid over the whole space, the true records of every cell
+static vector<Record> cellRecords(const vector<Record>& records, const grid_stratum& stratum) {
+
+    vector<Record> inside;
+    for (const Record& rec : records)
+        if (inCell(rec, stratum, 4, 4))
+            inside.push_back(rec);
+
+    return inside;
+}
+
+//what every allocation has to give: exactly total_k samples, every cell at least the pilot and exactly its quota,
+//all of them inside of the cell
+static vector<grid_stratum> checkStrata(b_plus_tree& tree, allocation_mode allocation, size_t total_k, size_t pilot) {
+
+    vector<grid_stratum> strata = tree.stratifiedSample(GRID_MIN, GRID_MAX, GRID_MIN, GRID_MAX, 4, 4,
+                                                        GRID_MIN, GRID_MAX, GRID_MIN, GRID_MAX, P,
+                                                        total_k, pilot, allocation, weightField);
+
+    CHECK(strata.size() == 16);
+
+    size_t quotas = 0;
+    size_t wrong = 0;
+
+    for (const grid_stratum& stratum : strata) {
+
+        quotas += stratum.quota;
+        wrong += stratum.population == 0 || stratum.quota < (allocation == ALLOC_NEYMAN ? max(pilot, (size_t) 8) : pilot);
+        wrong += stratum.samples.size() != stratum.quota;
+
+        for (const Record& rec : stratum.samples)
+            wrong += !inCell(rec, stratum, 4, 4);
+    }
+
+    CHECK(quotas == total_k);
+    CHECK(wrong == 0);
+
+    return strata;
+}
+
+//the three allocations on the same grid
+static void checkAllocations(b_plus_tree& tree, const vector<Record>& records) {
+
+    const size_t total_k = 4000;
+    const size_t pilot = 20;
+    const size_t rest = total_k - 16 * pilot;
+
+    //uniform, the same for every cell give or take one
+    {
+        vector<grid_stratum> strata = checkStrata(tree, ALLOC_UNIFORM, total_k, pilot);
+
+        size_t fewest = SIZE_MAX;
+        size_t most = 0;
+
+        for (const grid_stratum& stratum : strata) {
+            fewest = min(fewest, stratum.quota);
+            most = max(most, stratum.quota);
+        }
+
+        CHECK(most - fewest <= 1);
+    }
+
+    //proportional, in line with the cells' true number of records
+    {
+        vector<grid_stratum> strata = checkStrata(tree, ALLOC_PROPORTIONAL, total_k, pilot);
+        size_t off = 0;
+
+        for (const grid_stratum& stratum : strata) {
+
+            double share = rest * (double) cellRecords(records, stratum).size() / RECORDS;
+            off += fabs((double) (stratum.quota - pilot) - share) > 0.2 * share + 5;
+        }
+
+        CHECK(off == 0);
+
+        //the south row has about half of the records, and the north row about an eighth
+        CHECK(strata[0].quota > 3 * strata[12].quota);
+    }
+
+    //Neyman, by the spread of the weights, which are all 1 in the south half, so the north half gets nearly everything
+    //past the pilot even though it has fewer records
+    {
+        vector<grid_stratum> strata = checkStrata(tree, ALLOC_NEYMAN, total_k, pilot);
+
+        size_t most_constant = 0;
+        size_t fewest_varied = SIZE_MAX;
+
+        for (const grid_stratum& stratum : strata) {
+
+            if (stratum.lat_high <= 50)
+                most_constant = max(most_constant, stratum.quota);
+            else
+                fewest_varied = min(fewest_varied, stratum.quota);
+        }
+
+        CHECK(fewest_varied > 2 * most_constant);
+    }
+}
+
+//the total COUNT and SUM of the stratified strata put together, over repeated runs
+static void checkCombinedCoverage(b_plus_tree& tree, const vector<Record>& records) {
+
+    truth expected = bruteForce(records, [](const Record&) { return true; });
+
+    size_t count_covered = 0;
+    size_t sum_covered = 0;
+
+    for (int run = 0; run < RUNS; run++) {
+
+        vector<grid_stratum> strata = tree.stratifiedSample(GRID_MIN, GRID_MAX, GRID_MIN, GRID_MAX, 4, 4,
+                                                            GRID_MIN, GRID_MAX, GRID_MIN, GRID_MAX, P,
+                                                            1000, 10, ALLOC_PROPORTIONAL, weightField);
+
+        vector<aggregate_estimate> counts;
+        vector<aggregate_estimate> sums;
+
+        for (const grid_stratum& stratum : strata) {
+            counts.push_back(stratum.estimates.count());
+            sums.push_back(stratum.estimates.sum());
+        }
+
+        count_covered += holds(combineEstimates(counts), expected.count);
+        sum_covered += holds(combineEstimates(sums), expected.sum);
+    }
+
+    CHECK(coverageOk(count_covered, RUNS));
+    CHECK(coverageOk(sum_covered, RUNS));
+
+    //exact parts add up to an exact total
+    aggregate_estimate exact_part;
+    exact_part.value = exact_part.low = exact_part.high = 5;
+    exact_part.exact = true;
+
+    aggregate_estimate combined = combineEstimates({exact_part, exact_part});
+    CHECK(combined.exact && combined.value == 10 && combined.halfWidth() == 0);
+}
+
+//every reason a query can stop for
+static void checkStopReasons(b_plus_tree& tree, const vector<Record>& records) {
+
+    //a number of samples
+    online_aggregation result = tree.aggregateRange(INT_MIN, INT_MAX, weightField, 500);
+    CHECK(result.stopReason() == STOP_SAMPLES && result.samples() == 500);
+
+    //a narrow enough interval
+    stop_condition narrow;
+    narrow.target = AGG_AVG;
+    narrow.max_half_width = 0.2;
+
+    result = tree.aggregateRange(INT_MIN, INT_MAX, weightField, narrow);
+    CHECK(result.stopReason() == STOP_ERROR);
+    CHECK(result.avg().halfWidth() <= 0.2 && result.samples() >= narrow.min_samples);
+
+    //a deadline, with no end to the samples otherwise
+    stop_condition deadline;
+    deadline.deadline_ms = 20;
+
+    result = tree.aggregateRange(INT_MIN, INT_MAX, weightField, deadline);
+    CHECK(result.stopReason() == STOP_DEADLINE);
+    CHECK(result.elapsedMs() >= 20 && result.samples() > 0);
+
+    //a number of page reads, which it does not go far past
+    stop_condition pages;
+    pages.max_page_reads = 50;
+
+    result = tree.aggregateRange(INT_MIN, INT_MAX, weightField, pages);
+    CHECK(result.stopReason() == STOP_PAGE_READS);
+    CHECK(result.pagesRead() >= 50 && result.pagesRead() < 100);
+
+    //nothing in range, the estimates are exact right away
+    result = tree.aggregateRange(INT_MAX - 10, INT_MAX, weightField, 500);
+    CHECK(result.stopReason() == STOP_EXHAUSTED && result.samples() == 0);
+    CHECK(result.count().exact && result.count().value == 0);
+
+    //the caller's callback, after three batches
+    int batches = 0;
+    result = tree.aggregateRange(INT_MIN, INT_MAX, weightField, 100000, 100,
+                                 [&](const online_aggregation&) { return ++batches < 3; });
+    CHECK(result.stopReason() == STOP_CALLBACK && result.samples() == 300);
+
+    //SampleFirst stops once every record of the range was rejected, which is right away in a gap of the hilbert
+    //values with no records
+    int gap = 0;
+    for (const Record& rec : records) {
+
+        if (rec.hilbert > gap)
+            break;
+
+        if (rec.hilbert == gap)
+            gap++;
+    }
+
+    query_budget nothing(stop_condition(), page_handler::threadPageReads);
+    CHECK(tree.SampleFirstRS(gap, gap, 10, &nothing).empty());
+    CHECK(nothing.reason() == STOP_EXHAUSTED);
+
+    //SampleFirst samples with replacement, so it gets all k even from a range with fewer records
+    int low = records[5000].hilbert;
+    int high = records[5150].hilbert;
+
+    query_budget enough(stop_condition(), page_handler::threadPageReads);
+    vector<Record> samples = tree.SampleFirstRS(low, high, 500, &enough);
+
+    size_t outside = 0;
+    for (const Record& rec : samples)
+        outside += rec.hilbert < low || rec.hilbert > high;
+
+    CHECK(samples.size() == 500 && outside == 0);
+    CHECK(enough.reason() == STOP_SAMPLES);
+
+    //and with a page budget it runs out of
+
+    query_budget few_pages(pages, page_handler::threadPageReads);
+    CHECK(tree.SampleFirstRS(records[100].hilbert, records[RECORDS - 100].hilbert, 15000, &few_pages).size() < 15000);
+    CHECK(few_pages.reason() == STOP_PAGE_READS);
+
+    //grouped queries stop once every group converged, and when the stream runs out
+    stop_condition converged;
+    converged.target = AGG_AVG;
+    converged.max_half_width = 0.5;
+
+    sample_stream stream(tree, INT_MIN, INT_MAX);
+    grouped_aggregation grouped = groupedAggregate<Record>(stream, RECORDS, latitudeBand, weightField, converged,
+                                                           page_handler::threadPageReads);
+
+    CHECK(grouped.stopReason() == STOP_ERROR && grouped.groupCount() == 4);
+    for (long long int band : grouped.keys())
+        CHECK(grouped.converged(band) && grouped.estimate(band, AGG_AVG).halfWidth() <= 0.5);
+
+    sample_stream empty(tree, INT_MAX - 10, INT_MAX);
+    grouped = groupedAggregate<Record>(empty, 0, latitudeBand, weightField, stop_condition(500), page_handler::threadPageReads);
+
+    CHECK(grouped.stopReason() == STOP_EXHAUSTED && grouped.samples() == 0);
+}
+
+int main() {
+
+    //fixed seed, so a failure can be run again
+    seedRandom(31);
+
+    vector<Record> records = makeRecords();
+
+    b_plus_tree tree(freshDirectory("test_pages_rs_aggregation"));
+    buildTree(tree, records);
+
+    CHECK(tree.rangeCount(INT_MIN, INT_MAX) == RECORDS);
+
+    auto in_rect = [](const Record& rec) {
+        return rec.lat >= LAT_LOW && rec.lat <= LAT_HIGH && rec.lon >= LON_LOW && rec.lon <= LON_HIGH;
+    };
+
+    //a rectangle, where the samples from the edge cells that fall outside of it count as non-matching
+    checkCoverage([&]() {
+        return tree.aggregateRect(LAT_LOW, LAT_HIGH, LON_LOW, LON_HIGH, GRID_MIN, GRID_MAX, GRID_MIN, GRID_MAX, P,
+                                  weightField, 1000);
+    }, bruteForce(records, in_rect), 1000, false);
+
+    //a hilbert range, whose COUNT is exact
+    int low = records[3000].hilbert;
+    int high = records[14000].hilbert;
+
+    auto in_range = [&](const Record& rec) { return rec.hilbert >= low && rec.hilbert <= high; };
+
+    checkCoverage([&]() { return tree.aggregateRange(low, high, weightField, 1000); },
+                  bruteForce(records, in_range), 1000, true);
+
+    //the same range sampled by weight
+    checkCoverage([&]() { return tree.aggregateRangeWeighted(low, high, latField, 1000); },
+                  bruteForce(records, in_range, latField), 1000, false);
+
+    checkGroupedCoverage(tree, records);
+    checkCombinedCoverage(tree, records);
+    checkAllocations(tree, records);
+    checkStopReasons(tree, records);
+
+    filesystem::remove_all("test_pages_rs_aggregation");
+
+    return testResult("test_rs_aggregation");
+}
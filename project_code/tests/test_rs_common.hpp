@@ -0,0 +1,107 @@
+// --- RS-tree test helpers ---
+
+/*
+Shared by the RS-tree tests (test_rs_*), which are built with RStree.cpp instead of rtree.cpp, as the RS-tree has its
+own Record (with a weight). The records are made up on the spot, and the trees are small enough that every answer
+can be checked against a pass over all of the records.
+*/
+
+//a check to make sure that this header file is only included once
+#pragma once
+
+#include "test_check.hpp"
+#include "../RStree.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <vector>
+
+using namespace std;
+
+//record number i with the given hilbert value and weight, its id is "r<i>" and its coordinates follow from i
+inline Record rsRecord(int i, int hilbert, float weight = 1.0f) {
+
+    Record rec{};
+
+    snprintf(rec.id, sizeof(rec.id), "r%d", i);
+    rec.hilbert = hilbert;
+    rec.lat = 10.0f + (i % 100) * 0.5f;
+    rec.lon = 20.0f + (i / 100 % 100) * 0.5f;
+    snprintf(rec.timestamp, sizeof(rec.timestamp), "2008-%02d-%02d %02d:00:00", 1 + i % 12, 1 + i % 28, i % 24);
+    rec.weight = weight;
+
+    return rec;
+}
+
+//the number a record was made with
+inline int recordNumber(const Record& rec) {
+
+    return atoi(rec.id + 1);
+}
+
+//loads the records, which have to be in hilbert order, and fills the sample buffers
+inline void buildTree(b_plus_tree& tree, const vector<Record>& records) {
+
+    for (const Record& rec : records)
+        tree.insert(rec.hilbert, rec, true);
+
+    tree.buildAllSamples();
+}
+
+//a fresh page directory for a tree
+inline string freshDirectory(const string& dir) {
+
+    filesystem::remove_all(dir);
+    return dir;
+}
+
+//Pearson's chi-square statistic of the observed counts against the expected ones
+inline double chiSquare(const vector<double>& observed, const vector<double>& expected) {
+
+    double statistic = 0;
+
+    for (size_t i = 0; i < observed.size(); i++)
+        if (expected[i] > 0)
+            statistic += (observed[i] - expected[i]) * (observed[i] - expected[i]) / expected[i];
+
+    return statistic;
+}
+
+//value that a chi-square statistic with df degrees of freedom stays under with probability 0.999 (Wilson-Hilferty),
+//so a sampler that is right fails the check for about one seed in a thousand
+inline double chiSquareLimit(int df) {
+
+    double a = 2.0 / (9.0 * df);
+    return df * pow(1 - a + 3.09 * sqrt(a), 3);
+}
+
+//whether the samples are spread evenly over the records numbered first to last, checked with a chi-square test over
+//buckets of consecutive records. Samples outside of them fail the check
+inline bool looksUniform(const vector<Record>& samples, int first, int last, int buckets) {
+
+    long int records = last - first + 1;
+    vector<double> observed(buckets, 0);
+    vector<double> expected(buckets, 0);
+
+    for (const Record& rec : samples) {
+
+        int number = recordNumber(rec);
+        if (number < first || number > last)
+            return false;
+
+        observed[(number - first) * buckets / records]++;
+    }
+
+    for (long int i = 0; i < records; i++)
+        expected[i * buckets / records] += (double) samples.size() / records;
+
+    return chiSquare(observed, expected) <= chiSquareLimit(buckets - 1);
+}
+
+//whether an interval at 95% confidence held the true value about as often as it should, out of runs runs
+inline bool coverageOk(size_t covered, size_t runs) {
+
+    double share = (double) covered / runs;
+    return share >= 0.90 && share <= 0.99;
+}
@@ -0,0 +1,115 @@
+// --- RS-tree seeding test ---
+
+/*
+Builds the same RS-tree twice with the same seed, and checks that the sample buffers and a few queries come out the
+same both times, and different with another seed. The buffers are filled by the pool's threads, and rotated by the
+background worker after queries, neither of which may change what is drawn.
+*/
+
+#include "test_rs_common.hpp"
+#include <cstring>
+
+using namespace std;
+
+constexpr int RECORDS = 20000;
+
+//everything a run gives, to compare runs
+struct run_result {
+
+    vector<vector<Record>> built;
+    vector<vector<Record>> queries;
+    vector<vector<Record>> rotated;
+};
+
+//ids of a list of records, in order
+static vector<string> ids(const vector<Record>& records) {
+
+    vector<string> found;
+    for (const Record& rec : records)
+        found.push_back(rec.id);
+
+    return found;
+}
+
+//whether two lists of record lists hold the same records, in the same order
+static bool sameRecords(const vector<vector<Record>>& a, const vector<vector<Record>>& b) {
+
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); i++)
+        if (ids(a[i]) != ids(b[i]))
+            return false;
+
+    return true;
+}
+
+//the samples of every buffer of the tree
+static vector<vector<Record>> buffers(b_plus_tree& tree) {
+
+    vector<vector<Record>> samples;
+    for (b_plus_tree::buffer_copy& copy : tree.bufferSnapshot())
+        samples.push_back(move(copy.samples));
+
+    return samples;
+}
+
+//builds the tree with the seed, runs the queries, then has every buffer the last query read rotated by the worker
+static run_result run(uint64_t seed) {
+
+    run_result result;
+
+    vector<Record> records;
+    for (int i = 0; i < RECORDS; i++)
+        records.push_back(rsRecord(i, i / 2, 1.0f + i % 5));
+
+    seedRandom(seed);
+
+    b_plus_tree tree(freshDirectory("test_pages_rs_determinism"));
+    buildTree(tree, records);
+
+    result.built = buffers(tree);
+
+    result.queries.push_back(tree.RandomPathRS(1000, 15000, 200));
+    result.queries.push_back(tree.BatchMultinomialRS(0, RECORDS, 300));
+    result.queries.push_back(tree.SampleFirstRS(2000, 12000, 100));
+    result.queries.push_back(tree.WeightedSampleRS(500, 18000, 200));
+
+    for (vector<Record>& samples : tree.multiSample({{0, 5000, 50}, {4000, 9000, 50}}))
+        result.queries.push_back(move(samples));
+
+    //every buffer the query reads is due for a rotation right away
+    tree.setSampleRefreshPolicy(1, 0.5);
+    tree.SampleFirstRS(0, RECORDS, 2000);
+    tree.waitForReplenish();
+
+    result.rotated = buffers(tree);
+
+    return result;
+}
+
+int main() {
+
+    run_result first = run(35);
+    run_result second = run(35);
+    run_result other = run(36);
+
+    //there are buffers, and the rotation changed some of them
+    size_t filled = 0;
+    for (const vector<Record>& buffer : first.built)
+        filled += buffer.size() == (size_t) SAMPLE_SIZE;
+
+    CHECK(filled > 0);
+    CHECK(!sameRecords(first.built, first.rotated));
+
+    CHECK(sameRecords(first.built, second.built));
+    CHECK(sameRecords(first.queries, second.queries));
+    CHECK(sameRecords(first.rotated, second.rotated));
+
+    CHECK(!sameRecords(first.built, other.built));
+    CHECK(!sameRecords(first.queries, other.queries));
+
+    filesystem::remove_all("test_pages_rs_determinism");
+
+    return testResult("test_rs_determinism");
+}
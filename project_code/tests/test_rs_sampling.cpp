@@ -0,0 +1,266 @@
+// --- RS-tree sampling test ---
+
+/*
+Checks the RS-tree's sampling engines against the records they sample from. RandomPathRS, BatchMultinomialRS and
+multiSample have to give exactly k records of the range, spread evenly over it (a chi-square test over the range's
+records), on a tree with a record per hilbert value and on one with runs of equal hilbert values. The sample buffers
+have to hold exactly SAMPLE_SIZE records of their subtree after a build, evenly spread over it, and again after
+removes and a rebuild. WeightedSampleRS has to pick every record in proportion to its weight, and never one that
+weighs nothing.
+*/
+
+#include "test_rs_common.hpp"
+#include <cstring>
+#include <functional>
+#include <unordered_set>
+
+using namespace std;
+
+constexpr int RECORDS = 20000;
+
+//the range most of the queries sample, by hilbert value, which is the record number in the first tree
+constexpr int LOW = 2345;
+constexpr int HIGH = 15678;
+
+//batches of samples every engine draws, and how many in each
+constexpr int CALLS = 60;
+constexpr size_t K = 500;
+
+//weight of record i, every fifth one weighs nothing
+static float weightOf(int i) {
+
+    return (float) (i % 5);
+}
+
+//the samples are the tree's own records, with the fields they were inserted with
+static bool sameFields(const vector<Record>& samples, int hilbert_divisor) {
+
+    for (const Record& rec : samples) {
+
+        Record original = rsRecord(recordNumber(rec), recordNumber(rec) / hilbert_divisor, weightOf(recordNumber(rec)));
+
+        if (rec.hilbert != original.hilbert || rec.lat != original.lat || rec.weight != original.weight ||
+            strcmp(rec.timestamp, original.timestamp) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+//whether two lists of samples are the same records in the same order
+static bool sameSamples(const vector<Record>& a, const vector<Record>& b) {
+
+    if (a.size() != b.size())
+        return false;
+
+    for (size_t i = 0; i < a.size(); i++)
+        if (strcmp(a[i].id, b[i].id) != 0)
+            return false;
+
+    return true;
+}
+
+//draws CALLS batches of K samples of [low, high] with the engine, which has to give exactly K of the range's records
+//every time, spread evenly over the records numbered first to last. With fresh_buffers every buffer is redrawn
+//between batches, as a batch that reads from the buffers is only as uniform as the buffers it read
+static void checkEngine(b_plus_tree& tree, const function<vector<Record>(int, int, size_t)>& engine, int low, int high,
+                        int first, int last, int hilbert_divisor, bool fresh_buffers) {
+
+    vector<Record> all;
+    size_t wrong_sizes = 0;
+
+    for (int call = 0; call < CALLS; call++) {
+
+        vector<Record> samples = engine(low, high, K);
+        wrong_sizes += samples.size() != K;
+
+        all.insert(all.end(), samples.begin(), samples.end());
+
+        if (fresh_buffers)
+            tree.refreshSampleBuffers(1.0);
+    }
+
+    CHECK(wrong_sizes == 0);
+    CHECK(sameFields(all, hilbert_divisor));
+    CHECK(looksUniform(all, first, last, 50));
+
+    //a range of a single hilbert value, and ones with no records at all
+    for (const Record& rec : engine(first / hilbert_divisor, first / hilbert_divisor, 20))
+        CHECK(rec.hilbert == first / hilbert_divisor);
+
+    CHECK(engine(RECORDS * 2, RECORDS * 3, 20).empty());
+    CHECK(engine(high, low, 20).empty());
+}
+
+//the three uniform engines on [low, high], whose records are numbered first to last
+static void checkEngines(b_plus_tree& tree, int low, int high, int first, int last, int hilbert_divisor) {
+
+    checkEngine(tree, [&](int l, int h, size_t k) { return tree.RandomPathRS(l, h, k); },
+                low, high, first, last, hilbert_divisor, false);
+
+    checkEngine(tree, [&](int l, int h, size_t k) { return tree.BatchMultinomialRS(l, h, k); },
+                low, high, first, last, hilbert_divisor, true);
+
+    //the range asked for together with a copy of itself, a range beside it and one with nothing in it. Each query
+    //gets its own samples, so the two copies have to come out different
+    checkEngine(tree, [&](int l, int h, size_t k) {
+
+        vector<vector<Record>> results = tree.multiSample({{l, h, k}, {l, h, k}, {l, l + 100, 30}, {RECORDS * 2, RECORDS * 3, 30}});
+
+        CHECK(results.size() == 4);
+        CHECK(results[3].empty());
+
+        //a range of one record (or none) gives the same samples to both
+        if (!results[0].empty() && (long int) h - l >= 100)
+            CHECK(!sameSamples(results[0], results[1]));
+
+        return results[0];
+    }, low, high, first, last, hilbert_divisor, false);
+}
+
+//every buffer of a node with more than 2 * SAMPLE_SIZE records holds exactly SAMPLE_SIZE records from its subtree,
+//the others none, and none of the removed records. With check_spread, where in its subtree each sample lies is
+//pooled over every buffer, which has to be even as every buffer is a uniform sample of its subtree
+static void checkBuffers(b_plus_tree& tree, const unordered_set<int>& removed, bool check_spread) {
+
+    const int buckets = 10;
+    vector<double> observed(buckets, 0);
+    vector<double> expected(buckets, 0);
+
+    size_t wrong_sizes = 0;
+    size_t outside = 0;
+    size_t eligible = 0;
+
+    for (const b_plus_tree::buffer_copy& copy : tree.bufferSnapshot()) {
+
+        bool has_buffer = copy.records > 2 * SAMPLE_SIZE;
+        eligible += has_buffer;
+        wrong_sizes += copy.samples.size() != (has_buffer ? (size_t) SAMPLE_SIZE : 0);
+
+        //the subtree's records, which are numbered by their hilbert values
+        long int first = max(copy.lower, 0L);
+        long int last = min(copy.upper, (long int) RECORDS - 1);
+
+        for (const Record& rec : copy.samples) {
+
+            outside += rec.hilbert < first || rec.hilbert > last || removed.count(rec.hilbert);
+
+            if (rec.hilbert >= first && rec.hilbert <= last)
+                observed[(rec.hilbert - first) * buckets / (last - first + 1)]++;
+        }
+
+        for (int b = 0; b < buckets; b++)
+            expected[b] += (double) copy.samples.size() / buckets;
+    }
+
+    CHECK(eligible > 1);
+    CHECK(wrong_sizes == 0);
+    CHECK(outside == 0);
+
+    if (check_spread)
+        CHECK(chiSquare(observed, expected) <= chiSquareLimit(buckets - 1));
+}
+
+//draws weighted samples of [low, high], which pick record i with probability weight / total weight
+static void checkWeighted(b_plus_tree& tree, int low, int high) {
+
+    double total = 0;
+    for (int i = low; i <= high; i++)
+        total += weightOf(i);
+
+    CHECK(fabs(tree.rangeWeight(low, high) - total) < 1e-6 * total);
+
+    vector<double> observed(high - low + 1, 0);
+    size_t wrong_sizes = 0;
+    size_t weightless = 0;
+
+    for (int call = 0; call < CALLS; call++) {
+
+        vector<Record> samples = tree.WeightedSampleRS(low, high, K);
+        wrong_sizes += samples.size() != K;
+
+        for (const Record& rec : samples) {
+
+            weightless += rec.weight <= 0;
+
+            if (rec.hilbert >= low && rec.hilbert <= high)
+                observed[rec.hilbert - low]++;
+        }
+    }
+
+    vector<double> expected(high - low + 1);
+    int weighted_records = 0;
+
+    for (int i = low; i <= high; i++) {
+        expected[i - low] = CALLS * K * weightOf(i) / total;
+        weighted_records += weightOf(i) > 0;
+    }
+
+    CHECK(wrong_sizes == 0);
+    CHECK(weightless == 0);
+    CHECK(chiSquare(observed, expected) <= chiSquareLimit(weighted_records - 1));
+}
+
+int main() {
+
+    //fixed seed, so a failure can be run again
+    seedRandom(29);
+
+    {
+        //a record per hilbert value
+        vector<Record> records;
+        for (int i = 0; i < RECORDS; i++)
+            records.push_back(rsRecord(i, i, weightOf(i)));
+
+        b_plus_tree tree(freshDirectory("test_pages_rs_sampling"));
+        buildTree(tree, records);
+
+        checkBuffers(tree, {}, true);
+
+        checkEngines(tree, LOW, HIGH, LOW, HIGH, 1);
+        checkEngines(tree, INT_MIN, INT_MAX, 0, RECORDS - 1, 1);
+
+        //the weights of a range, record by record, and of most of the tree by the weight of the records
+        checkWeighted(tree, 500, 699);
+        checkWeighted(tree, 0, RECORDS - 1);
+
+        //the weighted buffers give records of the range with weight too
+        tree.buildWeightedSamples();
+
+        size_t wrong = 0;
+        for (const Record& rec : tree.WeightedSampleRS(LOW, HIGH, 2000, true))
+            wrong += rec.hilbert < LOW || rec.hilbert > HIGH || rec.weight <= 0;
+
+        CHECK(wrong == 0);
+
+        //removes take their records out of the buffers, and the next build fills them up to exactly SAMPLE_SIZE again
+        vector<b_plus_tree::buffer_copy> buffers = tree.bufferSnapshot();
+        unordered_set<int> removed;
+
+        for (const Record& rec : buffers[0].samples)
+            if (removed.size() < 40)
+                removed.insert(rec.hilbert);
+
+        for (int hilbert : removed)
+            tree.remove(hilbert);
+
+        tree.buildAllSamples();
+        checkBuffers(tree, removed, false);
+    }
+
+    {
+        //runs of 10 records with the same hilbert value, the range starts and ends on a run
+        vector<Record> records;
+        for (int i = 0; i < RECORDS / 4; i++)
+            records.push_back(rsRecord(i, i / 10, weightOf(i)));
+
+        b_plus_tree tree(freshDirectory("test_pages_rs_sampling"));
+        buildTree(tree, records);
+
+        checkEngines(tree, 105, 204, 1050, 2049, 10);
+    }
+
+    filesystem::remove_all("test_pages_rs_sampling");
+
+    return testResult("test_rs_sampling");
+}
@@ -0,0 +1,181 @@
+// --- RS-tree sample stream test ---
+
+/*
+Pulls samples out of sample_stream and checks them against sampleCover called by hand with the same seed: the stream
+has to hand out the batches 1, 2, 4, ... in the order they were drawn, without skipping or repeating any. The samples
+are drawn with replacement, so the check for repeats is that as many different records come out as a uniform draw
+gives. Within a batch they are not in hilbert order, they are spread evenly over the range, records removed
+between two batches never come out again, and a range with nothing in it (or nothing left) ends the stream.
+*/
+
+#include "test_rs_common.hpp"
+#include "../rng.hpp"
+#include <climits>
+#include <cstring>
+#include <unordered_set>
+
+using namespace std;
+
+constexpr int RECORDS = 20000;
+
+//samples pulled from every stream
+constexpr size_t TAKE = 4000;
+
+//the first n samples of [low, high] from a stream
+static vector<Record> pull(b_plus_tree& tree, int low, int high, size_t n) {
+
+    sample_stream stream(tree, low, high);
+    vector<Record> samples;
+    Record rec;
+
+    while (samples.size() < n && stream.next(rec))
+        samples.push_back(rec);
+
+    CHECK(stream.produced() == samples.size());
+
+    return samples;
+}
+
+//the first n samples of [low, high] from sampleCover, in batches that double up to SAMPLE_SIZE
+static vector<Record> pullBatches(b_plus_tree& tree, int low, int high, size_t n) {
+
+    b_plus_tree::range_cover cover;
+    cover.low = low;
+    cover.high = high;
+
+    vector<Record> samples;
+
+    for (size_t batch = 1; samples.size() < n; batch = min(batch * 2, (size_t) SAMPLE_SIZE)) {
+
+        vector<Record> drawn = tree.sampleCover(cover, batch);
+        samples.insert(samples.end(), drawn.begin(), drawn.end());
+    }
+
+    samples.resize(n);
+    return samples;
+}
+
+//the stream against the batches, with the same seed, and the spread of what it gave
+static void checkStream(b_plus_tree& tree, int low, int high, uint64_t seed) {
+
+    seedRandom(seed);
+    vector<Record> streamed = pull(tree, low, high, TAKE);
+
+    seedRandom(seed);
+    vector<Record> batches = pullBatches(tree, low, high, TAKE);
+
+    CHECK(streamed.size() == TAKE);
+
+    size_t different = 0;
+    for (size_t i = 0; i < streamed.size() && i < batches.size(); i++)
+        different += strcmp(streamed[i].id, batches[i].id) != 0;
+
+    CHECK(different == 0);
+
+    //spread evenly over the range's records, which are numbered by their hilbert values
+    long int first = max(low, 0);
+    long int last = min(high, RECORDS - 1);
+    CHECK(looksUniform(streamed, first, last, 40));
+
+    //as many different records as TAKE uniform draws with replacement give, a batch handed out twice would give fewer
+    double records = last - first + 1;
+    double expected = records * (1 - pow(1 - 1 / records, (double) TAKE));
+
+    unordered_set<string> distinct;
+    for (const Record& rec : streamed)
+        distinct.insert(rec.id);
+
+    CHECK(fabs(distinct.size() - expected) < 0.03 * expected + 10);
+
+    //past the small first batches, the next sample is after the one before it about half of the time
+    size_t increasing = 0;
+    size_t pairs = 0;
+
+    for (size_t i = 2 * SAMPLE_SIZE; i + 1 < streamed.size(); i++, pairs++)
+        increasing += streamed[i + 1].hilbert > streamed[i].hilbert;
+
+    double share = (double) increasing / pairs;
+    CHECK(share > 0.45 && share < 0.55);
+}
+
+int main() {
+
+    //fixed seed, so a failure can be run again
+    seedRandom(34);
+
+    vector<Record> records;
+    for (int i = 0; i < RECORDS; i++)
+        records.push_back(rsRecord(i, i));
+
+    b_plus_tree tree(freshDirectory("test_pages_rs_stream"));
+    buildTree(tree, records);
+
+    checkStream(tree, INT_MIN, INT_MAX, 1);
+    checkStream(tree, 2345, 15678, 2);
+    checkStream(tree, 700, 1900, 3);
+
+    //nothing in range
+    Record rec;
+
+    sample_stream empty(tree, RECORDS * 2, RECORDS * 3);
+    CHECK(!empty.next(rec) && empty.produced() == 0);
+
+    sample_stream reversed(tree, 500, 400);
+    CHECK(!reversed.next(rec) && reversed.produced() == 0);
+
+    //removes between two batches, the stream finds the range's cover again and never hands out a removed record.
+    //Every other record of [5000, 6999] goes
+    {
+        sample_stream stream(tree, 5000, 6999);
+
+        for (int i = 0; i < 100; i++)
+            CHECK(stream.next(rec));
+
+        for (int hilbert = 5000; hilbert < 7000; hilbert += 2)
+            tree.remove(hilbert);
+
+        //the rest of the batch it was in the middle of was drawn before the removes
+        size_t left_of_batch = 127 - 100;
+        for (size_t i = 0; i < left_of_batch; i++)
+            CHECK(stream.next(rec));
+
+        vector<Record> after;
+        for (int i = 0; i < 2000 && stream.next(rec); i++)
+            after.push_back(rec);
+
+        size_t removed = 0;
+        size_t outside = 0;
+
+        for (const Record& sample : after) {
+            removed += sample.hilbert % 2 == 0;
+            outside += sample.hilbert < 5000 || sample.hilbert > 6999;
+        }
+
+        CHECK(after.size() == 2000);
+        CHECK(removed == 0 && outside == 0);
+        CHECK(stream.produced() == 2127);
+    }
+
+    //a range whose records are all removed mid-stream ends the stream
+    {
+        sample_stream stream(tree, 100, 120);
+
+        for (int i = 0; i < 10; i++)
+            CHECK(stream.next(rec));
+
+        for (int hilbert = 100; hilbert <= 120; hilbert++)
+            tree.remove(hilbert);
+
+        //what was already drawn is handed out, then nothing
+        size_t handed_out = 0;
+        while (stream.next(rec) && handed_out < 1000)
+            handed_out++;
+
+        CHECK(handed_out < 1000);
+        CHECK(!stream.next(rec));
+    }
+
+    filesystem::remove_all("test_pages_rs_stream");
+
+    return testResult("test_rs_stream");
+}
@@ -0,0 +1,145 @@
+// --- Disk sort test ---
+
+/*
+Runs the disk sort program on made up csv files, with and without the weight column, and checks that the output
+is in hilbert order, that every record comes out once with its own fields and weight (where the RS-tree main reads
+it, after the hilbert value), and that a line with a field too long for the sort is reported and left out instead
+of being cut.
+*/
+
+#include "test_common.hpp"
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+constexpr int RECORDS = 20000;
+
+//the record that gets an id too long for the sort
+constexpr int LONG_ID_RECORD = 777;
+
+//the fields of a line of the sorted file
+static vector<string> splitLine(const string& line) {
+
+    vector<string> fields;
+    stringstream ss(line);
+    string field;
+
+    while (getline(ss, field, ','))
+        fields.push_back(field);
+
+    return fields;
+}
+
+//weight of record i, written the way a user would
+static string weightOf(int i) {
+
+    return to_string(i % 7) + "." + to_string(i % 4) + "5";
+}
+
+//writes the made up input, with or without the weight column
+static void writeInput(const string& path, bool weighted) {
+
+    ofstream out(path);
+    out << "id,latitude,longitude,timestamp" << (weighted ? ",weight" : "") << "\n";
+
+    for (int i = 0; i < RECORDS; i++) {
+
+        Record rec = testRecord(i, 0);
+        string id = (i == LONG_ID_RECORD) ? string(40, 'x') : string(rec.id);
+
+        out << id << "," << rec.lat << "," << rec.lon << "," << rec.timestamp;
+        if (weighted)
+            out << "," << weightOf(i);
+        out << "\n";
+    }
+}
+
+//sorts the input with the sort program and checks the sorted file
+static void checkSort(bool weighted) {
+
+    const string input = "test_sort_input.csv";
+    const string output = "test_sort_output.csv";
+    const string errors = "test_sort_errors.txt";
+
+    writeInput(input, weighted);
+    filesystem::remove(output);
+
+    //the sort asks for the input and output files on stdin
+    string command = "printf '%s\\n%s\\n' " + input + " " + output + " | ../sort > /dev/null 2> " + errors;
+    CHECK(system(command.c_str()) == 0);
+
+    ifstream in(output);
+    string line;
+
+    getline(in, line);
+    CHECK(line == string("id,latitude,longitude,timestamp,hilbert_value") + (weighted ? ",weight" : ""));
+
+    unordered_map<string, string> weights;
+    long int last_hilbert = -1;
+    size_t out_of_order = 0;
+    size_t wrong_fields = 0;
+
+    while (getline(in, line)) {
+
+        vector<string> fields = splitLine(line);
+
+        if (fields.size() != (weighted ? 6u : 5u)) {
+            wrong_fields++;
+            continue;
+        }
+
+        long int hilbert = stol(fields[4]);
+        out_of_order += hilbert < last_hilbert;
+        last_hilbert = hilbert;
+
+        //the timestamp still belongs to the id
+        Record rec = testRecord(atoi(fields[0].c_str() + 1), 0);
+        wrong_fields += fields[3] != rec.timestamp;
+
+        weights[fields[0]] = weighted ? fields[5] : "";
+    }
+
+    CHECK(wrong_fields == 0);
+    CHECK(out_of_order == 0);
+
+    //every record but the one with the long id, each once and with its own weight
+    CHECK(weights.size() == (size_t) (RECORDS - 1));
+
+    size_t wrong_weights = 0;
+    for (int i = 0; i < RECORDS; i++) {
+
+        if (i == LONG_ID_RECORD)
+            continue;
+
+        auto found = weights.find(testRecord(i, 0).id);
+        wrong_weights += found == weights.end() || found->second != (weighted ? weightOf(i) : "");
+    }
+
+    CHECK(wrong_weights == 0);
+
+    //the long id is reported, not cut down to another id
+    ifstream error_file(errors);
+    stringstream reported;
+    reported << error_file.rdbuf();
+
+    CHECK(reported.str().find("Invalid line (skipping): " + string(40, 'x')) != string::npos);
+    CHECK(reported.str().find("id is longer than") != string::npos);
+    CHECK(reported.str().find("1 invalid lines") != string::npos);
+
+    filesystem::remove(input);
+    filesystem::remove(output);
+    filesystem::remove(errors);
+}
+
+int main() {
+
+    checkSort(true);
+    checkSort(false);
+
+    return testResult("test_sort");
+}
@@ -0,0 +1,181 @@
+// --- R-tree zone map test ---
+
+/*
+Compares filteredQuery with a brute force pass over the same records, on a bulk loaded tree and on one built by
+inserts, before and after removes. The records come in blocks of several leaves that either all miss the filter,
+all match it, or alternate record by record, so there are pages the zone maps skip whole, pages where every record
+passes, and pages cut into runs of one record. The pages read tell that the pages that miss are skipped.
+*/
+
+#include "test_common.hpp"
+#include "../rtree.hpp"
+#include "../rng.hpp"
+#include <algorithm>
+#include <filesystem>
+
+using namespace std;
+
+constexpr int RECORDS = 60000;
+
+//records per block, ten leaves of a bulk loaded tree
+constexpr int BLOCK_RECORDS = 10 * MAX_LEAF_RECORDS;
+
+//what a block's records are like for the filters below
+enum block_kind { BLOCK_MISSES, BLOCK_MATCHES, BLOCK_ALTERNATES };
+
+//record i, inside the rectangle and time window of the filters or well outside of both
+static Record zoneRecord(int i) {
+
+    Record rec = testRecord(i, i / 2);
+
+    block_kind kind = (block_kind) (i / BLOCK_RECORDS % 3);
+    bool inside = kind == BLOCK_MATCHES || (kind == BLOCK_ALTERNATES && i % 2 == 0);
+
+    if (inside) {
+        rec.lat = 25.0f + (i % 100) * 0.01f;
+        rec.lon = 45.0f + (i % 37) * 0.01f;
+        snprintf(rec.timestamp, sizeof(rec.timestamp), "2020-03-%02d %02d:00:00", 1 + i % 28, i % 24);
+    }
+    else {
+        rec.lat = 10.0f + (i % 100) * 0.01f;
+        rec.lon = 10.0f + (i % 37) * 0.01f;
+        snprintf(rec.timestamp, sizeof(rec.timestamp), "2019-07-%02d %02d:00:00", 1 + i % 28, i % 24);
+    }
+
+    return rec;
+}
+
+//ids of the records, sorted, for comparing results
+static vector<string> sortedIds(const vector<Record>& records) {
+
+    vector<string> ids;
+    for (const Record& rec : records)
+        ids.push_back(rec.id);
+
+    sort(ids.begin(), ids.end());
+    return ids;
+}
+
+//runs the filter on the tree and by brute force, and returns the pages the tree read
+static long int checkFilter(b_plus_tree& tree, const vector<Record>& records, const scan_filter& filter) {
+
+    long int pages = page_handler::threadPageReads();
+    vector<Record> found = tree.filteredQuery(filter);
+    pages = page_handler::threadPageReads() - pages;
+
+    vector<Record> expected;
+    for (const Record& rec : records)
+        if (filter.matches(rec))
+            expected.push_back(rec);
+
+    CHECK(sortedIds(found) == sortedIds(expected));
+
+    //every run handed out matches, not just the records put together
+    size_t wrong = 0;
+    tree.filteredScan(filter, [&](const Record* first, const Record* last) {
+        for (; first < last; first++)
+            wrong += !filter.matches(*first);
+        return true;
+    });
+
+    CHECK(wrong == 0);
+
+    return pages;
+}
+
+//the filters, checked against a tree and the records it holds
+static void checkTree(b_plus_tree& tree, const vector<Record>& records) {
+
+    scan_filter everything;
+
+    scan_filter rect;
+    rect.setRect(20.0f, 30.0f, 40.0f, 50.0f);
+
+    scan_filter time;
+    time.setTime("2020-03-01", "2020-03-31 23:59:59");
+
+    scan_filter both = rect;
+    both.setTime("2020-03-10", "2020-03-20");
+
+    scan_filter narrow = scan_filter::hilbertRange(RECORDS / 8, RECORDS / 4);
+    narrow.setRect(20.0f, 30.0f, 40.0f, 50.0f);
+
+    //nothing is anywhere near this rectangle
+    scan_filter nothing;
+    nothing.setRect(60.0f, 70.0f, 60.0f, 70.0f);
+
+    long int all_pages = checkFilter(tree, records, everything);
+
+    //a third of the blocks miss the rectangle and the time window, so their leaves are not read
+    CHECK(checkFilter(tree, records, rect) < all_pages * 4 / 5);
+    CHECK(checkFilter(tree, records, time) < all_pages * 4 / 5);
+
+    checkFilter(tree, records, both);
+    checkFilter(tree, records, narrow);
+
+    //every leaf misses, only internal nodes are read
+    CHECK(checkFilter(tree, records, nothing) < all_pages / 10);
+}
+
+int main() {
+
+    const string dir = "test_pages_zone_maps";
+    filesystem::remove_all(dir);
+    filesystem::create_directory(dir);
+
+    //fixed seed, so a failure can be run again
+    seedRandom(48);
+
+    vector<Record> records;
+    for (int i = 0; i < RECORDS; i++)
+        records.push_back(zoneRecord(i));
+
+    {
+        //bulk loaded, where the leaves line up with the blocks
+        b_plus_tree bulk(dir + "/bulk");
+
+        for (const Record& rec : records)
+            bulk.appendSorted(rec);
+
+        bulk.finishBulkLoad();
+        checkTree(bulk, records);
+
+        //built by inserts in random order, where the zones grow with every insert and split
+        vector<Record> shuffled = records;
+        shuffle(shuffled.begin(), shuffled.end(), threadRng());
+
+        b_plus_tree inserted(dir + "/inserted");
+
+        for (const Record& rec : shuffled)
+            inserted.insert(rec.hilbert, rec);
+
+        checkTree(inserted, records);
+
+        //removes leave the zones as wide as they were, which still has to give the same records. Every matching
+        //record of the first few blocks goes, so some pages end up with nothing that passes
+        vector<Record> kept;
+
+        for (const Record& rec : records) {
+
+            scan_filter rect;
+            rect.setRect(20.0f, 30.0f, 40.0f, 50.0f);
+
+            int number = atoi(rec.id + 1);
+
+            if (number < 6 * BLOCK_RECORDS && rect.matches(rec)) {
+                CHECK(bulk.removeRecord(rec.hilbert, rec.id));
+                CHECK(inserted.removeRecord(rec.hilbert, rec.id));
+            }
+            else {
+                kept.push_back(rec);
+            }
+        }
+
+        checkTree(bulk, kept);
+        checkTree(inserted, kept);
+    }
+
+    filesystem::remove_all(dir);
+
+    return testResult("test_zone_maps");
+}